@@ -150,6 +150,12 @@ fn createOptionsModule(b: *std.Build, optimize: std.builtin.OptimizeMode) *std.B
     options.addOption(bool, "safety", optimize == .Debug or optimize == .ReleaseSafe);
     options.addOption(bool, "irq_debug", b.option(bool, "irq_debug", "Enable IRQ debug metadata") orelse false);
     options.addOption(bool, "irq_metrics", b.option(bool, "irq_metrics", "Enable IRQ runtime metrics") orelse false);
+    options.addOption(bool, "lock_stats", b.option(bool, "lock_stats", "Count spin lock acquisitions, spins and wait times") orelse false);
+    options.addOption(bool, "quickmap_selftest", b.option(bool, "quickmap_selftest", "Check at boot that a quickmap slot aliases the direct mapping") orelse false);
+    options.addOption(u64, "pmem_stress_rounds", b.option(u64, "pmem_stress_rounds", "Hammer the physical allocator from every cpu at boot for N rounds (0 disables it)") orelse 0);
+    options.addOption(u64, "buddy_bench_rounds", b.option(u64, "buddy_bench_rounds", "Time N churns of the buddy2 and buddy3 allocators in the buddy tests (0 disables it)") orelse 0);
+    options.addOption(u64, "vmm_bench_rounds", b.option(u64, "vmm_bench_rounds", "Time N range allocations/frees in the vmm tests (0 disables it)") orelse 0);
+    options.addOption(u64, "alloc_sample_rate", b.option(u64, "alloc_sample_rate", "Record the call site of one heap allocation in every N (0 disables it)") orelse 0);
     options.addOption(comptime_int, "num_stack_trace", 4);
     options.addOption(comptime_int, "heap_size", 1 * 1024 * 1024);
     options.addOption(comptime_int, "permanent_heap_size", 7 * 1024 * 1024);
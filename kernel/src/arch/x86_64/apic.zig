@@ -1,2 +1,3 @@
 pub const xapic = @import("apic/xapic.zig");
 pub const x2apic = @import("apic/x2apic.zig");
+pub const timer = @import("apic/timer.zig");
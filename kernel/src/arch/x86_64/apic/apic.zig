@@ -12,6 +12,9 @@ send_eoi: *const fn() void,
 configure_interrupt: *const fn (apic_types.LocalInterrupt, apic_types.InterruptConfiguration) anyerror!void,
 mask_interrupt: *const fn (apic_types.LocalInterrupt) anyerror!void,
 unmask_interrupt: *const fn (apic_types.LocalInterrupt) anyerror!void,
+configure_timer: *const fn (apic_types.TimerConfiguration) void,
+set_timer_count: *const fn (u32) void,
+read_timer_count: *const fn () u32,
 
 pub fn apicId(self: Self) cpu.CpuId {
     return self.apic_id();
@@ -44,3 +47,16 @@ pub fn mask(self: Self, interrupt: apic_types.LocalInterrupt) !void {
 pub fn unmask(self: Self, interrupt: apic_types.LocalInterrupt) !void {
     try self.unmask_interrupt(interrupt);
 }
+
+pub fn configureTimer(self: Self, config: apic_types.TimerConfiguration) void {
+    self.configure_timer(config);
+}
+
+// NOTE: one-shot/periodic modes only, a count of 0 stops the timer
+pub fn setTimerCount(self: Self, count: u32) void {
+    self.set_timer_count(count);
+}
+
+pub fn readTimerCount(self: Self) u32 {
+    return self.read_timer_count();
+}
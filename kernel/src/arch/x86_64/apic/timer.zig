@@ -0,0 +1,100 @@
+const std = @import("std");
+const flcn = @import("flcn");
+const assembly = @import("../assembly.zig");
+const cpu = @import("../cpu.zig");
+const apic_types = @import("types.zig");
+
+const timer = flcn.timer;
+const irq = flcn.irq;
+
+const log = std.log.scoped(.apic_timer);
+
+// NOTE: per cpu tick notifier on the local apic timer, works the same on xAPIC and x2APIC.
+// * tsc-deadline mode when the cpu has it and the tsc is calibrated: the deadline is written to an
+//   msr as an absolute tsc value, nothing to calibrate and no rounding to the timer's period
+// * one-shot mode otherwise, counting down at a rate measured against the current tick source (the
+//   tsc, or the hpet when the tsc isn't invariant)
+// only the next expiry gets programmed, a cpu with nothing due takes no timer interrupt at all (unless
+// the tick source wraps around, the timer subsystem caps the delays to keep the clocks updated).
+// every cpu arms its own lapic, they all share the vector and the handler
+const calibration_ms = 10;
+const divide: apic_types.TimerDivide = .by_16;
+
+const Mode = enum { tsc_deadline, one_shot };
+
+var mode: Mode = .one_shot;
+// NOTE: one-shot mode counter frequency (after the divider), the same on every cpu
+var frequency: u64 = 0;
+var irq_handle: irq.IrqHandle = undefined;
+
+pub fn init() !void {
+    mode = if (cpu.hasFeature(.tsc_deadline) and flcn.tsc.isCalibrated()) .tsc_deadline else .one_shot;
+    irq_handle = try irq.register(.{
+        .source = .{
+            .kind = .{ .local_apic = .{
+                .interrupt = .timer,
+                .polarity = .active_high,
+                .trigger_mode = .edge_triggered,
+            } },
+        },
+        .route = .{ .cpu = flcn.cpu.currentId() },
+        .config = .{ .masked = true },
+        .name = "LAPIC timer",
+        .handler = .{ .handler_fn = timer.timerHandler },
+    });
+    if (mode == .one_shot) frequency = calibrate();
+    initCore();
+    timer._registerTickNotifier(tickNotifier());
+    switch (mode) {
+        .tsc_deadline => log.info("lapic timer in tsc-deadline mode (vector {d})", .{irq_handle.vector}),
+        .one_shot => log.info("lapic timer in one-shot mode at {d}Hz (vector {d})", .{ frequency, irq_handle.vector }),
+    }
+}
+
+// NOTE: arms the calling cpu's lapic with the shared vector, the timer stays masked until programmed
+pub fn initCore() void {
+    cpu.perCpu(.apic).configureTimer(.{
+        .vector = irq_handle.vector,
+        .mode = switch (mode) {
+            .tsc_deadline => .tsc_deadline,
+            .one_shot => .one_shot,
+        },
+        .divide = divide,
+    });
+    // NOTE: a deadline written before the switch to tsc-deadline mode is visible would be dropped
+    if (mode == .tsc_deadline) assembly.mfence();
+}
+
+// NOTE: lets the counter run from the top for a while and counts what it went through
+fn calibrate() u64 {
+    const apic = cpu.perCpu(.apic);
+    apic.configureTimer(.{ .vector = irq_handle.vector, .mode = .one_shot, .divide = divide });
+    apic.setTimerCount(std.math.maxInt(u32));
+    timer.wait(.fromMilliseconds(calibration_ms));
+    const counted: u64 = std.math.maxInt(u32) - apic.readTimerCount();
+    apic.setTimerCount(0);
+    return counted * 1000 / calibration_ms;
+}
+
+fn programInterrupt(deadline: timer.Duration) !irq.IrqHandle {
+    const nanoseconds: u64 = @intCast(std.math.clamp(deadline.nanoseconds, 0, std.math.maxInt(u64)));
+    switch (mode) {
+        .tsc_deadline => {
+            const ticks = @max(flcn.tsc.ticksFromNanoseconds(nanoseconds), 1);
+            assembly.wrmsr(.TSC_DEADLINE, assembly.rdtsc() +| ticks);
+        },
+        .one_shot => {
+            // NOTE: a deadline past the counter range fires early, the handler programs the rest
+            const count = @as(u128, nanoseconds) * frequency / 1_000_000_000;
+            cpu.perCpu(.apic).setTimerCount(@intCast(std.math.clamp(count, 1, std.math.maxInt(u32))));
+        },
+    }
+    return irq_handle;
+}
+
+pub fn tickNotifier() timer.TickNotifier {
+    return .{
+        ._program_interrupt = programInterrupt,
+        .priority = 2,
+    };
+}
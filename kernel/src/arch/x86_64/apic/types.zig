@@ -73,3 +73,27 @@ pub const InterruptConfiguration = struct {
     polarity: Polarity = .active_high,
     trigger_mode: TriggerMode = .edge_triggered,
 };
+
+pub const TimerMode = enum(u2) {
+    one_shot = 0,
+    periodic = 1,
+    tsc_deadline = 2,
+};
+
+pub const TimerDivide = enum(u4) {
+    by_2 = 0b0000,
+    by_4 = 0b0001,
+    by_8 = 0b0010,
+    by_16 = 0b0011,
+    by_32 = 0b1000,
+    by_64 = 0b1001,
+    by_128 = 0b1010,
+    by_1 = 0b1011,
+};
+
+pub const TimerConfiguration = struct {
+    vector: u8,
+    masked: bool = true,
+    mode: TimerMode = .one_shot,
+    divide: TimerDivide = .by_16,
+};
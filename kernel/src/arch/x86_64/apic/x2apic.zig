@@ -108,7 +108,10 @@ fn sendEoi() void {
 }
 
 fn configureInterrupt(interrupt: apic_types.LocalInterrupt, config: apic_types.InterruptConfiguration) !void {
-    assembly.wrmsr(interruptMsr(interrupt), interruptValue(interrupt, config));
+    const msr = interruptMsr(interrupt);
+    // NOTE: the timer mode is set by configureTimer, keep it
+    const timer_mode = if (interrupt == .timer) assembly.rdmsr(msr) & timer_mode_mask else 0;
+    assembly.wrmsr(msr, interruptValue(interrupt, config) | timer_mode);
 }
 
 fn maskInterrupt(interrupt: apic_types.LocalInterrupt) !void {
@@ -147,6 +150,22 @@ fn usesPolarityAndTrigger(interrupt: apic_types.LocalInterrupt) bool {
     };
 }
 
+const timer_mode_mask: u64 = 0b11 << 17;
+fn configureTimer(config: apic_types.TimerConfiguration) void {
+    assembly.wrmsr(.X2APIC_DIV_CONFIG, @intFromEnum(config.divide));
+    const mask: u64 = @as(u64, @intCast(@intFromBool(config.masked))) << 16;
+    const mode: u64 = @as(u64, @intFromEnum(config.mode)) << 17;
+    assembly.wrmsr(.X2APIC_LVT_TIMER, @as(u64, config.vector) | mask | mode);
+}
+
+fn setTimerCount(count: u32) void {
+    assembly.wrmsr(.X2APIC_INIT_COUNT, count);
+}
+
+fn readTimerCount() u32 {
+    return @truncate(assembly.rdmsr(.X2APIC_CUR_COUNT));
+}
+
 pub const apic: Apic = .{
     .apic_id = apicId,
     .init_interrupts = initInterrupts,
@@ -156,4 +175,7 @@ pub const apic: Apic = .{
     .configure_interrupt = configureInterrupt,
     .mask_interrupt = maskInterrupt,
     .unmask_interrupt = unmaskInterrupt,
+    .configure_timer = configureTimer,
+    .set_timer_count = setTimerCount,
+    .read_timer_count = readTimerCount,
 };
@@ -66,6 +66,25 @@ var phys_lapic_base: memory.PAddr = undefined;
 var lapic_base: memory.VAddr = undefined;
 pub fn init(lapic_base_addr: memory.PAddr, page_map: *memory.PageMapManager) !void {
     log.debug("initializing xAPIC (base: 0x{x})", .{lapic_base_addr});
+    // NOTE: every cpu sees its own lapic at the same address, the bsp maps it once for all
+    if (cpu.perCpu(.is_bsp)) try mapRegisters(lapic_base_addr, page_map);
+
+    const id = readRegister(.id);
+    log.debug("xAPIC id {x}", .{id});
+    const version = readRegister(.version);
+    log.debug("xAPIC version {x}", .{version});
+
+    var apic_base = assembly.rdmsr(.APIC_BASE);
+    log.debug("xAPIC status {x}", .{apic_base});
+    apic_base |= 1 << 11;
+    assembly.wrmsr(.APIC_BASE, apic_base);
+
+    writeRegister(.spurious_interrupt_vector, 0x1ff);
+
+    log.info("xAPIC enabled", .{});
+}
+
+fn mapRegisters(lapic_base_addr: memory.PAddr, page_map: *memory.PageMapManager) !void {
     phys_lapic_base = lapic_base_addr;
     lapic_base = page_map.physToVirt(phys_lapic_base);
     log.debug("mapped xAPIC base to 0x{x}", .{lapic_base.toAddr()});
@@ -85,20 +104,6 @@ pub fn init(lapic_base_addr: memory.PAddr, page_map: *memory.PageMapManager) !vo
         }),
         .{ .remap = true },
     );
-
-    const id = readRegister(.id);
-    log.debug("xAPIC id {x}", .{id});
-    const version = readRegister(.version);
-    log.debug("xAPIC version {x}", .{version});
-
-    var apic_base = assembly.rdmsr(.APIC_BASE);
-    log.debug("xAPIC status {x}", .{apic_base});
-    apic_base |= 1 << 11;
-    assembly.wrmsr(.APIC_BASE, apic_base);
-
-    writeRegister(.spurious_interrupt_vector, 0x1ff);
-
-    log.info("xAPIC enabled", .{});
 }
 
 fn apicId() cpu.CpuId {
@@ -190,7 +195,10 @@ fn sendEoi() void {
 }
 
 fn configureInterrupt(interrupt: apic_types.LocalInterrupt, config: apic_types.InterruptConfiguration) !void {
-    writeRegister(interruptRegister(interrupt), interruptValue(interrupt, config));
+    const register = interruptRegister(interrupt);
+    // NOTE: the timer mode is set by configureTimer, keep it
+    const timer_mode = if (interrupt == .timer) readRegister(register) & timer_mode_mask else 0;
+    writeRegister(register, interruptValue(interrupt, config) | timer_mode);
 }
 
 fn maskInterrupt(interrupt: apic_types.LocalInterrupt) !void {
@@ -229,6 +237,22 @@ fn usesPolarityAndTrigger(interrupt: apic_types.LocalInterrupt) bool {
     };
 }
 
+const timer_mode_mask: u32 = 0b11 << 17;
+fn configureTimer(config: apic_types.TimerConfiguration) void {
+    writeRegister(.divide_configuration, @intFromEnum(config.divide));
+    const mask: u32 = @as(u32, @intCast(@intFromBool(config.masked))) << 16;
+    const mode: u32 = @as(u32, @intFromEnum(config.mode)) << 17;
+    writeRegister(.lvt_timer, @as(u32, config.vector) | mask | mode);
+}
+
+fn setTimerCount(count: u32) void {
+    writeRegister(.initial_count, count);
+}
+
+fn readTimerCount() u32 {
+    return readRegister(.current_count);
+}
+
 fn readRegister(register: Registers) u32 {
     const register_addr = lapic_base.toAddr() + @intFromEnum(register);
     const register_ptr: *volatile u32 = @ptrFromInt(register_addr);
@@ -250,4 +274,7 @@ pub const apic: Apic = .{
     .configure_interrupt = configureInterrupt,
     .mask_interrupt = maskInterrupt,
     .unmask_interrupt = unmaskInterrupt,
+    .configure_timer = configureTimer,
+    .set_timer_count = setTimerCount,
+    .read_timer_count = readTimerCount,
 };
@@ -13,4 +13,5 @@
  pub const memory = @import("memory.zig");
  pub const registers = @import("registers.zig");
  pub const smp = @import("smp.zig");
+ pub const tlb = @import("tlb.zig");
  pub const trampoline = @import("trampoline.zig");
@@ -61,6 +61,58 @@ pub inline fn haltEternally() noreturn {
     while (true) asm volatile ("hlt");
 }
 
+pub inline fn enableInterrupts() void {
+    asm volatile ("sti" ::: .{ .memory = true });
+}
+
+pub inline fn disableInterrupts() void {
+    asm volatile ("cli" ::: .{ .memory = true });
+}
+
+pub inline fn readFlags() u64 {
+    return asm volatile (
+        \\ pushfq
+        \\ popq %[flags]
+        : [flags] "=r" (-> u64),
+    );
+}
+
+pub inline fn enableInterruptsAndHalt() void {
+    // NOTE: sti only takes effect after the next instruction, so no interrupt can sneak in before hlt
+    asm volatile (
+        \\ sti
+        \\ hlt
+        ::: .{ .memory = true });
+}
+
+// NOTE: zeroes memory with non-temporal stores so clearing pages doesn't evict the cache.
+// length must be a multiple of 64 bytes
+pub inline fn zeroNonTemporal(dst: [*]align(64) u8, length: u64) void {
+    asm volatile (
+        \\ xorl %eax, %eax
+        \\ 1:
+        \\ movnti %rax, 0(%rdi)
+        \\ movnti %rax, 8(%rdi)
+        \\ movnti %rax, 16(%rdi)
+        \\ movnti %rax, 24(%rdi)
+        \\ movnti %rax, 32(%rdi)
+        \\ movnti %rax, 40(%rdi)
+        \\ movnti %rax, 48(%rdi)
+        \\ movnti %rax, 56(%rdi)
+        \\ addq $64, %rdi
+        \\ subq $64, %rcx
+        \\ jnz 1b
+        \\ sfence
+        :
+        : [dst] "{rdi}" (dst),
+          [len] "{rcx}" (length),
+        : .{ .rax = true, .rdi = true, .rcx = true, .memory = true });
+}
+
+pub inline fn mfence() void {
+    asm volatile ("mfence" ::: .{ .memory = true });
+}
+
 pub inline fn spinLoopHint() void {
     asm volatile ("pause");
 }
@@ -72,6 +124,22 @@ pub inline fn invalidateVirtualAddress(addr: memory.VAddrSize) void {
         : .{ .memory = true });
 }
 
+pub const InvpcidType = enum(u64) {
+    individual_address = 0,
+    single_context = 1,
+    all_context_global = 2,
+    all_context = 3,
+};
+
+pub inline fn invalidatePcid(typ: InvpcidType, pcid: u12, addr: memory.VAddrSize) void {
+    const descriptor: extern struct { pcid: u64, addr: u64 } = .{ .pcid = pcid, .addr = addr };
+    asm volatile ("invpcid (%[descriptor]), %[typ]"
+        :
+        : [descriptor] "r" (&descriptor),
+          [typ] "r" (@intFromEnum(typ)),
+        : .{ .memory = true });
+}
+
 pub inline fn outb(port: u16, value: u8) void {
     return asm volatile (
         \\ outb %[value], %[port]
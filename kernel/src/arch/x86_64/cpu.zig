@@ -9,6 +9,7 @@ const cpu_debug_context = @import("cpu/debug_context.zig");
 const memory = flcn.memory;
 const Apic = @import("apic/apic.zig");
 const ioapic = @import("ioapic.zig");
+const tlb = @import("tlb.zig");
 
 const log = std.log.scoped(.@"x86_64.cpu");
 pub const CpuId = u32;
@@ -51,6 +52,22 @@ pub fn hasFeature(feature: Feature) bool {
     return cpu_info.flags.contains(feature);
 }
 
+const interrupt_flag = 1 << 9;
+pub fn saveAndDisableInterrupts() bool {
+    const enabled = (assembly.readFlags() & interrupt_flag) != 0;
+    assembly.disableInterrupts();
+    return enabled;
+}
+
+pub fn restoreInterrupts(enabled: bool) void {
+    if (enabled) assembly.enableInterrupts();
+}
+
+// NOTE: sleeps until the next interrupt
+pub fn waitForInterrupt() void {
+    assembly.enableInterruptsAndHalt();
+}
+
 pub fn doCpuChecks() !void {
     if (!hasFeature(.apic)) return error.NoApic;
 }
@@ -60,12 +77,16 @@ pub fn initCore(cpu_id: CpuId) !void {
     const apic_base = assembly.rdmsr(.APIC_BASE);
     const is_bsp = ((apic_base >> 8) & 1) == 1;
     flcn.cpu.cpu_data[cpu_id].is_bsp = is_bsp;
+    tlb.initCore();
     flcn.cpu.cpu_data[cpu_id].apic = if (hasFeature(.x2apic)) &apic.x2apic.apic else &apic.xapic.apic;
     try initLocalApic();
     flcn.cpu.cpu_data[cpu_id].apic.init(&smp.local_apic.nmis);
     flcn.cpu.cpu_data[cpu_id].apic.setEnabled(true);
-    flcn.pic.disable();
-    try initIoApic();
+    // NOTE: system wide, the aps come up after the bsp set them up
+    if (is_bsp) {
+        flcn.pic.disable();
+        try initIoApic();
+    }
 }
 
 pub fn initLocalApic() !void {
@@ -73,6 +73,7 @@ pub const Feature = enum {
     fxsr_opt, // ffxsr: fxsave and fxrstor optimizations
     rdtscp, // rdtscp instruction supported (amd-only)
     lm, // long mode (x86_64/em64t) supported
+    pdpe1gb, // 1gb pages supported
     lahf_lm, // lahf/sahf supported in 64-bit mode
     cmp_legacy, // core multi-processing legacy mode
     svm, // amd secure virtual machine
@@ -93,7 +94,7 @@ pub const Feature = enum {
     stc, // software thermal control
     steps100mhz, // 100 mhz multiplier control
     hwpstate, // hardware p-state control
-    constant_tsc, // tsc ticks at constant rate
+    constant_tsc, // invariant tsc, ticks at a constant rate in every p/c state
     xop, // the xop instruction set (same as the old cpu_feature_sse5)
     fma3, // the fma3 instruction set
     fma4, // the fma4 instruction set
@@ -101,6 +102,7 @@ pub const Feature = enum {
     f16c, // 16-bit fp convert instruction support
     rdrand, // rdrand instruction
     x2apic, // x2apic
+    tsc_deadline, // local apic timer supports tsc-deadline mode
     cpb, // core performance boost
     aperfmperf, // mperf/aperf msrs support
     pfi, // processor feedback interface support
@@ -121,6 +123,7 @@ pub const Feature = enum {
     sgx, // sgx extensions. non-autoritative, check cpu_id_t::sgx::present to verify presence
     rdseed, // rdseed instruction
     adx, // adx extensions (arbitrary precision)
+    invpcid, // invpcid instruction supported
     avx512vnni, // avx-512 vector neural network instructions
     avx512vbmi, // avx-512 vector bit manipulationinstructions (version 1)
     avx512vbmi2, // avx-512 vector bit manipulationinstructions (version 2)
@@ -142,6 +145,7 @@ pub const featuresMatchTables = std.EnumMap(FeatureRegisters, []const BitFeature
         .{ .bit = 21, .feature = .x2apic },
         .{ .bit = 22, .feature = .movbe },
         .{ .bit = 23, .feature = .popcnt },
+        .{ .bit = 24, .feature = .tsc_deadline },
         .{ .bit = 25, .feature = .aes },
         .{ .bit = 26, .feature = .xsave },
         .{ .bit = 27, .feature = .osxsave },
@@ -178,6 +182,7 @@ pub const featuresMatchTables = std.EnumMap(FeatureRegisters, []const BitFeature
         .{ .bit = 3, .feature = .bmi1 },
         .{ .bit = 5, .feature = .avx2 },
         .{ .bit = 8, .feature = .bmi2 },
+        .{ .bit = 10, .feature = .invpcid },
         .{ .bit = 18, .feature = .rdseed },
         .{ .bit = 19, .feature = .adx },
         .{ .bit = 29, .feature = .sha_ni },
@@ -188,6 +193,7 @@ pub const featuresMatchTables = std.EnumMap(FeatureRegisters, []const BitFeature
     },
     .edx_80000001 = &.{
         .{ .bit = 11, .feature = .syscall },
+        .{ .bit = 26, .feature = .pdpe1gb },
         .{ .bit = 27, .feature = .rdtscp },
         .{ .bit = 29, .feature = .lm },
     },
@@ -344,11 +350,11 @@ fn fillCpuInfo(raw_info: *const CpuidInfoHolder, cpu_identification: *CpuInfo) !
     if (raw_info.basic[0].eax >= 7) {
         matchFeatures(.ebx_07, raw_info.basic[7].ebx, cpu_identification);
     }
-    if (raw_info.basic[0].eax >= 0x80000001) {
+    if (raw_info.extended[0].eax >= 0x80000001) {
         matchFeatures(.ecx_80000001, raw_info.extended[1].ecx, cpu_identification);
         matchFeatures(.edx_80000001, raw_info.extended[1].edx, cpu_identification);
     }
-    if (raw_info.basic[0].eax >= 0x80000007) {
+    if (raw_info.extended[0].eax >= 0x80000007) {
         matchFeatures(.edx_80000007, raw_info.extended[7].edx, cpu_identification);
     }
     if (raw_info.basic[0].eax >= 22) {
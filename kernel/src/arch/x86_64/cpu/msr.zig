@@ -34,6 +34,7 @@ pub const MSR = enum(u32) {
     MTRRfix64K_00000 = 0x00000250,
     PAT = 0x00000277,
     APIC_BASE = 0x0000001b,
+    TSC_DEADLINE = 0x000006e0,
     X2APIC_APICID = 0x00000802,
     X2APIC_VERSION = 0x00000803,
     X2APIC_TPR = 0x00000808,
@@ -18,3 +18,10 @@ pub fn init() void {
     gdt.flushGDT();
     log.info("segment descriptors initialized", .{});
 }
+
+// NOTE: the aps share the bsp's gdt, each one loads the tss of its own id
+pub fn initCore(cpu_id: u32) void {
+    gdt.loadGDTR();
+    gdt.loadTR(.{ .cpu_id = cpu_id });
+    gdt.flushGDT();
+}
@@ -21,6 +21,11 @@ pub fn loadIDTR(self: *Self) void {
         .limit = (@sizeOf(Segment.GateDescriptor) * constants.max_interrupt_vectors) - 1,
         .base = &self.idt_entries,
     };
+    self.load();
+}
+
+// NOTE: loads the already filled IDTR, how the aps pick up the bsp's table
+pub fn load(self: *const Self) void {
     log.debug("loading IDTR {*}", .{self.idtr.base});
     asm volatile (
         \\lidt (%[idtr])
@@ -10,11 +10,16 @@ const cpu = flcn.cpu;
 const Memory = flcn.memory;
 const debug = flcn.debug;
 const acpi = flcn.acpi;
+const numa = flcn.numa;
 const smp = @import("smp.zig");
 const pit = flcn.pit;
+const tsc = flcn.tsc;
+const hpet = flcn.hpet;
 const panicFn = flcn.panic.panicFn;
 const BootInfo = flcn.bootinfo.BootInfo;
 const assembly = @import("assembly.zig");
+const tlb = @import("tlb.zig");
+const apic = @import("apic.zig");
 const Timer = flcn.timer;
 
 pub const panic = std.debug.FullPanic(panicFn);
@@ -50,12 +55,48 @@ pub fn start() callconv(.naked) noreturn {
     while (true) {}
 }
 
+// NOTE: entered from the trampoline in long mode on the kernel's page map, with interrupts off and no
+// stack. the cpu finds its id from its initial apic id and moves to its own stack (the bootloader maps
+// one per possible cpu, cpu N's ends at -N * core_stack_size), an unknown apic id halts for good
 pub fn apstart() callconv(.naked) noreturn {
-    _ = cpu.cpu_count.fetchAdd(1, .monotonic);
-    assembly.haltEternally();
+    asm volatile (std.fmt.comptimePrint(
+            \\ mov $1, %eax
+            \\ cpuid
+            \\ shr $24, %ebx
+            \\ lea ap_cpu_ids(%rip), %rax
+            \\ mov (%rax, %rbx, 4), %edi
+            \\ cmp $-1, %edi
+            \\ je 1f
+            \\ imul ${d}, %rdi, %rax
+            \\ xor %esp, %esp
+            \\ sub %rax, %rsp
+            \\ xor %ebp, %ebp
+            \\ call apMain
+            \\ 1:
+            \\ cli
+            \\ hlt
+            \\ jmp 1b
+        , .{constants.core_stack_size}));
     while (true) {}
 }
 
+export fn apMain(cpu_id: cpu.CpuId) callconv(.c) noreturn {
+    // NOTE: the gdt reload clears the gs base, it has to come before the per-cpu data
+    descriptors.initCore(cpu_id);
+    interrupts.initCore();
+    cpu.initCore(cpu_id) catch |e| {
+        log.err("cpu {d} failed to come up: {any}", .{ cpu_id, e });
+        assembly.haltEternally();
+    };
+    apic.timer.initCore();
+    assembly.enableInterrupts();
+    smp.reportOnline(cpu_id);
+
+    smp.waitForBringUp();
+    Memory.pmem_stress.run();
+    cpu.idle();
+}
+
 export fn kernelMain() callconv(.c) void {
     logger.init(serial.Port.COM1);
     cpu.earlyInit() catch unreachable;
@@ -64,26 +105,38 @@ export fn kernelMain() callconv(.c) void {
     failableMain() catch |e| {
         log.err("Failed with error: {any}", .{e});
     };
+    cpu.idle();
 }
 
 fn failableMain() !void {
     try Memory.earlyInit();
+    try acpi.init();
+    try numa.init();
     try Memory.init();
     try debug.init(Memory.permanent_allocator);
     descriptors.init();
     interrupts.init();
     try Memory.lateInit();
     try Memory.printStats();
-    try acpi.init();
     try smp.init();
-    try cpu.initCore();
-    try smp.wakeUpCores();
-    log.debug("Present cpus: #{d}, mask: {any}", .{ cpu.present_cpus_count, cpu.present_cpus_mask });
-    log.debug("Online cpus: #{d}, mask: {any}", .{ cpu.online_cpus_count, cpu.online_cpus_mask });
+    try cpu.initCore(0);
     try flcn.irq.init();
-    const allocator = Memory.allocator();
-    Timer.init(allocator);
+    try Memory.lazy.init(&Memory.kernel_vmem);
+    try tlb.init();
+    try Timer.init();
+    try hpet.init();
+    tsc.init();
     pit.init();
+    try apic.timer.init();
+    // NOTE: the aps arm their lapic timer and take part in shootdowns as soon as they're up
+    smp.wakeUpCores() catch |err| {
+        // NOTE: the aps that came up are waiting for the bsp in the stress barrier
+        Memory.pmem_stress.abort();
+        return err;
+    };
+    log.debug("Present cpus: #{d}, mask: {any}", .{ cpu.present_cpus_count, cpu.present_cpus_mask });
+    log.debug("Online cpus: #{d}, mask: {any}", .{ cpu.online_cpus_count, cpu.online_cpus_mask });
+    Memory.pmem_stress.run();
 
     log.info("running timer for 2s", .{});
     const wait_duration: Timer.Duration = .fromSeconds(2);
@@ -91,7 +144,9 @@ fn failableMain() !void {
     log.info("done counting down from {f}", .{wait_duration});
 
     log.info("creating 5s timer", .{});
-    Timer._createTimer(.oneShot(onTimer, .fromSeconds(5)));
+    _ = Timer._createTimer(.oneShot(onTimer, .fromSeconds(5)));
+    tlb.printStats();
+    flcn.irq.printMetrics();
 
     // const irq_handle = try flcn.irq.register(.{
     //     .source = .{ .vector = 0xfd, .kind = .fixed },
@@ -131,3 +131,8 @@ pub fn init() void {
     asm volatile ("sti");
     log.info("interrupts enabled", .{});
 }
+
+// NOTE: the aps share the bsp's table, interrupts stay off until the cpu is fully up
+pub fn initCore() void {
+    idt.load();
+}
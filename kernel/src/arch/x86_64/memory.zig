@@ -5,6 +5,8 @@ const registers = @import("registers.zig");
 const flcn = @import("flcn");
 const assembly = @import("assembly.zig");
 const cpu = @import("cpu.zig");
+const tlb = @import("tlb.zig");
+const SpinLock = flcn.synchronization.SpinLock;
 
 const log = std.log.scoped(.@"x86_64.memory");
 
@@ -573,13 +575,20 @@ pub const VirtualMemoryManager = flcn.vmm.VirtualMemoryManager(VAddr, VAddrSize)
 pub const VirtMemRange = VirtualMemoryManager.VirtMemRange;
 pub const MMapArgs = struct {
     remap: bool = false,
+    // NOTE: ranges are mapped with the biggest pages their alignment and length allow, up to this size
+    max_page_size: PageSize = .huge,
 };
 pub const PageMapManager = struct {
     const Self = @This();
     root: u64,
     levels: u8,
+    // NOTE: the kernel address space runs with pcid 0
+    pcid: tlb.Pcid = 0,
     page_offset: VAddrSize,
     page_allocator: PageAllocator,
+    // NOTE: serializes the walks that change the tables (creating, splitting and writing entries).
+    // it is dropped before the tlb flush so no cpu waits on shootdown acks with it held
+    lock: SpinLock = .create(),
 
     pub fn init(page_allocator: PageAllocator) !Self {
         const page_offset = try readPageOffset();
@@ -593,7 +602,7 @@ pub const PageMapManager = struct {
         };
     }
 
-    fn readPageOffset() !VAddrSize {
+    pub fn readPageOffset() !VAddrSize {
         const config = env[0..constants.default_page_size];
         var line_tokenizer = std.mem.tokenizeScalar(u8, config, '\n');
         while (line_tokenizer.next()) |line| {
@@ -608,235 +617,283 @@ pub const PageMapManager = struct {
         return error.NoPageOffset;
     }
 
-    fn mmapPage(self: *PageMapManager, paddr: u64, vaddr: u64, flags: Flags, args: MMapArgs) !void {
-        if (options.safety) {
-            if (!std.mem.Alignment.fromByteUnits(constants.default_page_size).check(paddr)) return error.BadPhysAddrAlignment;
-            if (!std.mem.Alignment.fromByteUnits(constants.default_page_size).check(vaddr)) return error.BadVirtAddrAlignment;
+    // NOTE: the mapper walks the page tables once per range: a cursor moves through the range and
+    // every level consumes as many entries as it can before going back up. the entries that replace
+    // a live translation are collected and invalidated (on every cpu) once the whole range is done
+    const entries_per_table = @divExact(constants.default_page_size, @sizeOf(PageMapping.Entry));
+    const phys_addr_mask: u64 = 0x000f_ffff_ffff_f000;
+    const table_flags_mask: u64 = 0b111;
+    const present_bit: u64 = 1 << 0;
+    const page_size_bit: u64 = 1 << 7;
+    const pte_pat_bit: u64 = 1 << 7;
+    const global_bit: u64 = 1 << 8;
+    const large_pat_bit: u64 = 1 << 12;
+
+    const MapOperation = enum { map, unmap, protect };
+    const MapCursor = struct {
+        vaddr: VAddrSize,
+        paddr: PAddr,
+        remaining: u64,
+        flags: Flags,
+        args: MMapArgs,
+        op: MapOperation,
+        batch: tlb.Batch = .{},
+
+        fn advance(self: *MapCursor, length: u64) void {
+            self.vaddr +%= length;
+            self.paddr +%= length;
+            self.remaining -= length;
         }
+    };
 
-        try self.writePageTable(@bitCast(vaddr), paddr, flags, .{ .remap = args.remap });
-        assembly.invalidateVirtualAddress(vaddr);
+    fn levelShift(comptime level: u8) u6 {
+        return 12 + 9 * (level - 1);
     }
 
-    pub fn mmap(self: *PageMapManager, prange: flcn.pmm.PhysMemRange, vrange: VirtMemRange, flags: Flags, args: MMapArgs) !void {
-        if (options.safety) {
-            if (prange.length != vrange.length) return error.LengthMismatch;
-        }
-
-        var physical_addr = prange.start;
-        var virtual_addr: u64 = @bitCast(vrange.start);
-        const page_size: u64 = switch (flags.size) {
-            .page => constants.default_page_size,
-            .large => constants.large_page_size,
-            .huge => constants.huge_page_size,
-        };
-        const num_pages_to_map = @divExact(prange.length, page_size);
-        log.debug("Mapping prange {f} to vrange {f} ({d} pages)", .{ prange, vrange, num_pages_to_map });
-        for (0..num_pages_to_map) |_| {
-            defer physical_addr += page_size;
-            defer virtual_addr +%= page_size;
-            self.mmapPage(physical_addr, virtual_addr, flags, args) catch unreachable;
-        }
-        std.debug.assert(physical_addr == prange.start + prange.length);
+    fn tableAt(self: *const Self, paddr: PAddr) *PageMapping {
+        return @ptrFromInt(self.physToVirt(paddr & phys_addr_mask).toAddr());
     }
 
-    pub fn munmap(self: *PageMapManager, vrange: VirtMemRange) void {
-        var virtual_addr: u64 = @bitCast(vrange.start);
-        const num_pages_to_map = @divExact(vrange.length, constants.default_page_size);
-        log.debug("Unmapping vrange {f} ({d} pages)", .{ vrange, num_pages_to_map });
-        for (0..num_pages_to_map) |_| {
-            defer virtual_addr +%= constants.default_page_size;
-            self.mmapPage(0, virtual_addr, .{}, .{ .remap = true }) catch unreachable;
-        }
+    fn canMapLeaf(comptime level: u8, cursor: *const MapCursor, raw_entry: u64) bool {
+        const entry_size: u64 = @as(u64, 1) << levelShift(level);
+        // NOTE: never replace a page table with a leaf, its entries would leak
+        const is_table = raw_entry & present_bit != 0 and raw_entry & page_size_bit == 0;
+        const size_allowed = switch (level) {
+            1 => return true,
+            2 => cursor.args.max_page_size != .page,
+            3 => cursor.args.max_page_size == .huge and cpu.hasFeature(.pdpe1gb),
+            else => return false,
+        };
+        return size_allowed and !is_table and
+            cursor.vaddr & (entry_size - 1) == 0 and
+            cursor.paddr & (entry_size - 1) == 0 and
+            cursor.remaining >= entry_size;
     }
 
-    fn remapPage(self: *PageMapManager, vaddr: u64, flags: Flags) !void {
-        if (options.safety) {
-            if (!std.mem.Alignment.fromByteUnits(constants.default_page_size).check(vaddr)) return error.BadVirtAddrAlignment;
-        }
-
-        const entry = try self.getEntry(@bitCast(vaddr), flags);
-        var entry_addr: *u64 = undefined;
-        var entry_value: u64 = undefined;
-        switch (flags.size) {
-            .page => {
-                const pt_entry = &entry.page;
-                var pt_copy = pt_entry.*;
-                pt_copy.setFlags(flags);
-                entry_addr = @ptrCast(pt_entry);
-                entry_value = @bitCast(pt_copy);
-                log.debug("remapping pt entry {any}", .{pt_copy});
+    fn leafEntry(comptime level: u8, paddr: PAddr, flags: Flags) u64 {
+        switch (level) {
+            1 => {
+                var entry: PageMapping.PageEntry = .{};
+                entry.setAddr(paddr);
+                entry.setFlags(flags);
+                return @bitCast(entry);
             },
-            .large => {
-                const pd_entry = &entry.large;
-                var pd_copy = pd_entry.*;
-                pd_copy.setFlags(flags);
-                entry_addr = @ptrCast(pd_entry);
-                entry_value = @bitCast(pd_copy);
-                log.debug("remapping pd entry {any}", .{pd_copy});
+            2 => {
+                var entry: PageMapping.LargePageEntry = .{};
+                entry.setAddr(paddr);
+                entry.setFlags(flags.extend(.{ .size = .large }));
+                return @bitCast(entry);
             },
-            .huge => {
-                const pdp_entry = &entry.huge;
-                var pdp_copy = pdp_entry.*;
-                pdp_copy.setFlags(flags);
-                entry_addr = @ptrCast(pdp_entry);
-                entry_value = @bitCast(pdp_copy);
-                log.debug("remapping pdp entry {any}", .{pdp_copy});
+            3 => {
+                var entry: PageMapping.HugePageEntry = .{};
+                entry.setAddr(paddr);
+                entry.setFlags(flags.extend(.{ .size = .huge }));
+                return @bitCast(entry);
             },
+            else => unreachable,
         }
-        writeEntry(entry_addr, entry_value);
-        assembly.invalidateVirtualAddress(vaddr);
     }
 
-    pub fn remap(self: *PageMapManager, vrange: VirtMemRange, flags: Flags) !void {
-        var virtual_addr: u64 = @bitCast(vrange.start);
-        const page_size: u64 = switch (flags.size) {
-            .page => constants.default_page_size,
-            .large => 512 * constants.default_page_size,
-            .huge => 512 * 512 * constants.default_page_size,
-        };
-        const num_pages_to_map = @divExact(vrange.length, page_size);
-        log.debug("remapping vrange {f} ({d} pages) with flags {any}", .{ vrange, num_pages_to_map, flags });
-        for (0..num_pages_to_map) |_| {
-            defer virtual_addr +%= page_size;
-            try self.remapPage(virtual_addr, flags);
+    fn walk(self: *Self, comptime level: u8, table: *PageMapping, cursor: *MapCursor) !void {
+        const entry_size: u64 = @as(u64, 1) << levelShift(level);
+        var idx: usize = @intCast((cursor.vaddr >> levelShift(level)) & (entries_per_table - 1));
+        while (idx < entries_per_table and cursor.remaining > 0) : (idx += 1) {
+            const entry = &table.mappings[idx];
+            const raw: u64 = @bitCast(entry.*);
+            const present = raw & present_bit != 0;
+            const is_leaf = level == 1 or (present and raw & page_size_bit != 0);
+            const entry_start = cursor.vaddr & ~(entry_size - 1);
+            const covers_entry = cursor.vaddr == entry_start and cursor.remaining >= entry_size;
+            const to_entry_end = @min(entry_size - (cursor.vaddr - entry_start), cursor.remaining);
+
+            switch (cursor.op) {
+                .map => if (canMapLeaf(level, cursor, raw)) {
+                    if (present) {
+                        if (!cursor.args.remap) {
+                            @branchHint(.unlikely);
+                            log.err("overwriting an existing level {d} entry 0x{x} at 0x{x}", .{ level, raw, entry_start });
+                            @panic("mmap overwrite");
+                        }
+                        cursor.batch.add(entry_start, raw & global_bit != 0);
+                    }
+                    writeEntry(@ptrCast(entry), leafEntry(level, cursor.paddr, cursor.flags));
+                    cursor.advance(entry_size);
+                    continue;
+                },
+                .unmap => {
+                    if (!present) {
+                        cursor.advance(to_entry_end);
+                        continue;
+                    }
+                    if (is_leaf and covers_entry) {
+                        cursor.batch.add(entry_start, raw & global_bit != 0);
+                        writeEntry(@ptrCast(entry), 0);
+                        cursor.advance(entry_size);
+                        continue;
+                    }
+                },
+                .protect => {
+                    if (!present) {
+                        cursor.advance(to_entry_end);
+                        continue;
+                    }
+                    if (is_leaf and covers_entry) {
+                        cursor.batch.add(entry_start, raw & global_bit != 0);
+                        writeEntry(@ptrCast(entry), leafEntry(level, raw & phys_addr_mask & ~(entry_size - 1), cursor.flags));
+                        cursor.advance(entry_size);
+                        continue;
+                    }
+                },
+            }
+
+            if (level > 1) {
+                // NOTE: the range only covers part of this entry, go down one level (splitting a large page if needed)
+                const next_table = if (!present)
+                    self.tableAt(try self.getOrCreateMapping(entry, true))
+                else if (is_leaf)
+                    try self.splitLeaf(level, entry)
+                else
+                    self.tableAt(raw);
+                try self.walk(level - 1, next_table, cursor);
+            } else unreachable;
         }
     }
 
-    pub fn virtToPhys(self: *const Self, vaddr: VAddr) PAddr {
-        return @as(VAddrSize, @bitCast(vaddr)) - self.page_offset;
+    // NOTE: replaces a large/huge page with a table of the next level mapping the same memory
+    // with the same attributes, translations don't change so no invalidation is needed here
+    fn splitLeaf(self: *Self, comptime level: u8, entry: *PageMapping.Entry) !*PageMapping {
+        const raw: u64 = @bitCast(entry.*);
+        const child_size: u64 = @as(u64, 1) << levelShift(level - 1);
+        const base = raw & phys_addr_mask & ~(child_size * entries_per_table - 1);
+        var child_flags = raw & ~phys_addr_mask;
+        if (level == 2) child_flags &= ~page_size_bit;
+        if (raw & large_pat_bit != 0) child_flags |= if (level == 2) pte_pat_bit else large_pat_bit;
+
+        const page_ptr = try self.page_allocator.allocate(1, .{ .zero = false });
+        const table: *PageMapping = @ptrCast(page_ptr);
+        for (&table.mappings, 0..) |*child, i| {
+            child.* = @bitCast(child_flags | (base + i * child_size));
+        }
+        const table_paddr = self.virtToPhys(@bitCast(@intFromPtr(page_ptr)));
+        log.debug("split level {d} entry 0x{x} into table 0x{x}", .{ level, raw, table_paddr });
+        writeEntry(@ptrCast(entry), (raw & table_flags_mask) | table_paddr);
+        return table;
     }
 
-    pub fn physToVirt(self: *const Self, paddr: PAddr) VAddr {
-        return @bitCast(@as(PAddrSize, paddr) + self.page_offset);
+    fn walkRange(self: *Self, cursor: *MapCursor) !void {
+        if (options.safety) {
+            if (!std.mem.Alignment.fromByteUnits(constants.default_page_size).check(cursor.paddr)) return error.BadPhysAddrAlignment;
+            if (!std.mem.Alignment.fromByteUnits(constants.default_page_size).check(cursor.vaddr)) return error.BadVirtAddrAlignment;
+            if (!std.mem.Alignment.fromByteUnits(constants.default_page_size).check(cursor.remaining)) return error.BadLengthAlignment;
+        }
+        cursor.batch.pcid = self.pcid;
+        // NOTE: flush what was changed even if the walk failed midway, once the lock is released
+        defer tlb.flush(&cursor.batch);
+        self.lock.lock();
+        defer self.lock.unlock();
+        try self.walk(4, self.tableAt(self.root), cursor);
     }
 
-    fn getEntry(self: *const Self, vaddr: VAddr, flags: Flags) !*PageMapping.Entry {
-        const pml4_mapping: *PageMapping = @ptrFromInt(self.physToVirt(self.root).toAddr());
-        log.debug("PML4: 0x{x} ({*})", .{ self.root, pml4_mapping });
-        const pml4_entry = &pml4_mapping.mappings[vaddr.pml4_idx];
-
-        const pdp_mapping_addr = try self.getOrCreateMapping(pml4_entry, false);
-        const pdp_mapping: *PageMapping = @ptrFromInt(self.physToVirt(pdp_mapping_addr).toAddr());
-        log.debug("PDP: 0x{x} ({*})", .{ pdp_mapping_addr, pdp_mapping });
-        const pdp_entry = &pdp_mapping.mappings[vaddr.pdp_idx];
-        if (flags.size == .huge) {
-            return pdp_entry;
-        }
-
-        const pd_mapping_addr = try self.getOrCreateMapping(pdp_entry, false);
-        const pd_mapping: *PageMapping = @ptrFromInt(self.physToVirt(pd_mapping_addr).toAddr());
-        log.debug("PD: 0x{x} ({*})", .{ pd_mapping_addr, pd_mapping });
-        const pd_entry = &pd_mapping.mappings[vaddr.pd_idx];
-        if (flags.size == .large) {
-            return pd_entry;
+    pub fn mmap(self: *PageMapManager, prange: flcn.pmm.PhysMemRange, vrange: VirtMemRange, flags: Flags, args: MMapArgs) !void {
+        if (options.safety) {
+            if (prange.length != vrange.length) return error.LengthMismatch;
         }
 
-        const pt_mapping_addr = try self.getOrCreateMapping(pd_entry, false);
-        const pt_mapping: *PageMapping = @ptrFromInt(self.physToVirt(pt_mapping_addr).toAddr());
-        log.debug("PT: 0x{x} ({*})", .{ pt_mapping_addr, pt_mapping });
-        const pt_entry = &pt_mapping.mappings[vaddr.pt_idx];
-        if (flags.size == .page) {
-            return pt_entry;
-        }
+        log.debug("Mapping prange {f} to vrange {f}", .{ prange, vrange });
+        var cursor: MapCursor = .{
+            .vaddr = @bitCast(vrange.start),
+            .paddr = prange.start,
+            .remaining = prange.length,
+            .flags = flags,
+            .args = args,
+            .op = .map,
+        };
+        try self.walkRange(&cursor);
+    }
 
-        return error.MappingNotFound;
+    pub fn munmap(self: *PageMapManager, vrange: VirtMemRange) void {
+        log.debug("Unmapping vrange {f}", .{vrange});
+        var cursor: MapCursor = .{
+            .vaddr = @bitCast(vrange.start),
+            .paddr = 0,
+            .remaining = vrange.length,
+            .flags = .{},
+            .args = .{ .remap = true },
+            .op = .unmap,
+        };
+        self.walkRange(&cursor) catch |err| {
+            log.err("could not unmap vrange {f}: {t}", .{ vrange, err });
+            @panic("munmap failed");
+        };
     }
 
-    fn writePageTable(self: *const Self, vaddr: VAddr, paddr: PAddr, flags: Flags, args: struct { create_if_missing: bool = true, remap: bool = false }) !void {
-        const pml4_mapping: *PageMapping = @ptrFromInt(self.physToVirt(self.root).toAddr());
-        log.debug("PML4: 0x{x} ({*})", .{ self.root, pml4_mapping });
-        const pml4_entry = &pml4_mapping.mappings[vaddr.pml4_idx];
-
-        const pdp_mapping_addr = try self.getOrCreateMapping(pml4_entry, args.create_if_missing);
-        const pdp_mapping: *PageMapping = @ptrFromInt(self.physToVirt(pdp_mapping_addr).toAddr());
-        log.debug("PDP: 0x{x} ({*})", .{ pdp_mapping_addr, pdp_mapping });
-        const pdp_entry = &pdp_mapping.mappings[vaddr.pdp_idx];
-        if (flags.size == .huge) {
-            const huge_page_entry = &pdp_entry.huge;
-            if (!huge_page_entry.present) {
-                @branchHint(.likely);
-                var pdp_copy = huge_page_entry.*;
-                pdp_copy.setAddr(paddr);
-                pdp_copy.setFlags(flags);
-                log.debug("writing PDP entry {any}", .{pdp_copy});
-                writeEntry(@ptrCast(pdp_entry), @bitCast(pdp_copy));
-                return;
-            }
-            if (!args.remap) {
-                @branchHint(.likely);
-                log.err("overwriting an existing PDP entry {any}", .{pdp_entry});
-                @panic("mmap overwrite");
-            }
+    // NOTE: changes the flags of the mapped pages of a range, whatever their size. unmapped pages are skipped
+    pub fn remap(self: *PageMapManager, vrange: VirtMemRange, flags: Flags) !void {
+        log.debug("remapping vrange {f} with flags {any}", .{ vrange, flags });
+        var cursor: MapCursor = .{
+            .vaddr = @bitCast(vrange.start),
+            .paddr = 0,
+            .remaining = vrange.length,
+            .flags = flags,
+            .args = .{ .remap = true },
+            .op = .protect,
+        };
+        try self.walkRange(&cursor);
+    }
 
-            var pdp_copy = huge_page_entry.*;
-            pdp_copy.setAddr(paddr);
-            pdp_copy.setFlags(flags);
-            log.debug("writing existing PDP entry {any}", .{pdp_copy});
-            writeEntry(@ptrCast(pdp_entry), @bitCast(pdp_copy));
-            return;
-        }
-
-        const pd_mapping_addr = try self.getOrCreateMapping(pdp_entry, args.create_if_missing);
-        const pd_mapping: *PageMapping = @ptrFromInt(self.physToVirt(pd_mapping_addr).toAddr());
-        log.debug("PD: 0x{x} ({*})", .{ pd_mapping_addr, pd_mapping });
-        const pd_entry = &pd_mapping.mappings[vaddr.pd_idx];
-        if (flags.size == .large) {
-            const large_page_entry = &pd_entry.large;
-            if (!large_page_entry.present) {
-                @branchHint(.likely);
-                var pd_copy = large_page_entry.*;
-                pd_copy.setAddr(paddr);
-                pd_copy.setFlags(flags);
-                log.debug("writing PD entry {any}", .{pd_copy});
-                writeEntry(@ptrCast(pd_entry), @bitCast(pd_copy));
-                return;
-            }
-            if (!args.remap) {
-                @branchHint(.likely);
-                log.err("overwriting an existing PD entry {any}", .{pd_entry});
-                @panic("mmap overwrite");
-            }
-            var pd_copy = large_page_entry.*;
-            pd_copy.setAddr(paddr);
-            pd_copy.setFlags(flags);
-            log.debug("writing existing PD entry {any}", .{pd_entry});
-            writeEntry(@ptrCast(pd_entry), @bitCast(pd_copy));
-            return;
-        }
-
-        const pt_mapping_addr = try self.getOrCreateMapping(pd_entry, args.create_if_missing);
-        const pt_mapping: *PageMapping = @ptrFromInt(self.physToVirt(pt_mapping_addr).toAddr());
-        log.debug("PT: 0x{x} ({*})", .{ pt_mapping_addr, pt_mapping });
-        const pt_entry = &pt_mapping.mappings[vaddr.pt_idx];
-        if (flags.size == .page) {
-            const page_entry = &pt_entry.page;
-            if (!page_entry.present) {
-                @branchHint(.likely);
-                var pt_copy = page_entry.*;
-                pt_copy.setAddr(paddr);
-                pt_copy.setFlags(flags);
-                log.debug("writing PT entry {any}", .{pt_copy});
-                writeEntry(@ptrCast(pt_entry), @bitCast(pt_copy));
-                return;
+    // NOTE: software walk of the page tables, works for any mapped address (not only the direct mapping)
+    pub fn translate(self: *const Self, vaddr: VAddr) ?PAddr {
+        const addr: VAddrSize = @bitCast(vaddr);
+        var table = self.tableAt(self.root);
+        inline for (.{ 4, 3, 2, 1 }) |level| {
+            const entry_size: u64 = @as(u64, 1) << levelShift(level);
+            const idx: usize = @intCast((addr >> levelShift(level)) & (entries_per_table - 1));
+            const raw: u64 = @bitCast(table.mappings[idx]);
+            if (raw & present_bit == 0) return null;
+            if (level == 1 or (level < 4 and raw & page_size_bit != 0)) {
+                return (raw & phys_addr_mask & ~(entry_size - 1)) + (addr & (entry_size - 1));
             }
-            if (!args.remap) {
-                @branchHint(.likely);
-                log.err("overwriting an existing PT entry {any}", .{pt_entry});
-                @panic("mmap overwrite");
-            }
-            var pt_copy = page_entry.*;
-            pt_copy.setAddr(paddr);
-            pt_copy.setFlags(flags);
-            log.debug("writing existing PT entry {any}", .{pt_copy});
-            writeEntry(@ptrCast(pt_entry), @bitCast(pt_copy));
-            return;
+            table = self.tableAt(raw);
         }
-
         unreachable;
     }
 
-    fn getOrCreateMapping(self: Self, entry: *PageMapping.Entry, create_if_missing: bool) !u64 {
+    // NOTE: the level 1 entry translating `vaddr` to a 4KiB page. missing tables are created and large
+    // pages on the way are split, the entry itself is left as it is
+    pub fn locatePageEntry(self: *Self, vaddr: VAddr) !*u64 {
+        const addr: VAddrSize = @bitCast(vaddr);
+        self.lock.lock();
+        defer self.lock.unlock();
+        var table = self.tableAt(self.root);
+        inline for (.{ 4, 3, 2 }) |level| {
+            const idx: usize = @intCast((addr >> levelShift(level)) & (entries_per_table - 1));
+            const entry = &table.mappings[idx];
+            const raw: u64 = @bitCast(entry.*);
+            table = if (raw & present_bit == 0)
+                self.tableAt(try self.getOrCreateMapping(entry, true))
+            else if (level < 4 and raw & page_size_bit != 0)
+                try self.splitLeaf(level, entry)
+            else
+                self.tableAt(raw);
+        }
+        const idx: usize = @intCast((addr >> levelShift(1)) & (entries_per_table - 1));
+        return @ptrCast(&table.mappings[idx]);
+    }
+
+    // NOTE: raw level 1 entry, for callers writing page table entries themselves
+    pub fn pageEntry(paddr: PAddr, flags: Flags) u64 {
+        return leafEntry(1, paddr, flags);
+    }
+
+    pub fn virtToPhys(self: *const Self, vaddr: VAddr) PAddr {
+        return @as(VAddrSize, @bitCast(vaddr)) - self.page_offset;
+    }
+
+    pub fn physToVirt(self: *const Self, paddr: PAddr) VAddr {
+        return @bitCast(@as(PAddrSize, paddr) + self.page_offset);
+    }
+
+    fn getOrCreateMapping(self: *const Self, entry: *PageMapping.Entry, create_if_missing: bool) !u64 {
         log.debug("get or create mapping {*}", .{entry});
         const entry_page = &entry.page;
         if (!entry_page.present) {
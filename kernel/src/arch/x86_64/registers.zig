@@ -31,3 +31,12 @@ pub fn readCR(comptime reg: ControlRegisters) u64 {
         :
         : .{ .r8 = true });
 }
+
+pub fn writeCR(comptime reg: ControlRegisters, value: u64) void {
+    const reg_name = @tagName(reg);
+    const write_instr = "mov %[value], %" ++ reg_name;
+    asm volatile (write_instr
+        :
+        : [value] "r" (value),
+        : .{ .memory = true });
+}
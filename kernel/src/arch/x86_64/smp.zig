@@ -7,7 +7,8 @@ const trampoline = @import("trampoline.zig");
 const options = @import("options");
 const BootInfo = flcn.bootinfo.BootInfo;
 const constants = @import("constants.zig");
-const pit = flcn.pit;
+const apic_types = @import("apic/types.zig");
+const timer = flcn.timer;
 
 const log = std.log.scoped(.smp);
 
@@ -133,39 +134,105 @@ pub fn init() !void {
     log.debug("trampoline page initialized", .{});
 }
 
-pub fn wakeUpCores() !void {
-    const count10ms = pit.millis(10);
-    const count50ms = pit.millis(50);
+// NOTE: INIT-SIPI-SIPI broadcast to every other cpu, they all come up and run their own initCore in
+// parallel. the bsp polls cpu_count against the current tick source (tsc or hpet) instead of sleeping
+// for fixed periods, so it moves on as soon as the last cpu checked in
+// * the 10ms INIT settle delay of the MP spec only matters to cpus older than intel family 6 and amd
+//   family 0xf, modern ones take the SIPI right away
+// * the second SIPI only goes out when some cpus are still missing 200us after the first, a cpu
+//   already running ignores it
+const init_settle_delay: timer.Duration = .fromMilliseconds(10);
+const sipi_retry_delay: timer.Duration = .{ .nanoseconds = 200_000 };
+const online_timeout: timer.Duration = .fromSeconds(1);
+
+// NOTE: boot stub lookup from the initial apic id (cpuid leaf 1, 8 bit like the madt entries we parse)
+// to the cpu id, no_cpu_id for apic ids that aren't present
+const no_cpu_id = std.math.maxInt(u32);
+export var ap_cpu_ids: [256]u32 = .{no_cpu_id} ** 256;
+
+var online_flags: [cpu.possible_cpus_count]std.atomic.Value(bool) = .{std.atomic.Value(bool).init(false)} ** cpu.possible_cpus_count;
+var bring_up_done: std.atomic.Value(bool) = .init(false);
 
-    log.debug("cpu count before wakeup {d}", .{cpu.cpu_count.load(.acquire)});
+pub fn wakeUpCores() !void {
+    const expected = cpu.present_cpus_count;
+    var latencies: [cpu.possible_cpus_count]?timer.Duration = .{null} ** cpu.possible_cpus_count;
+    // NOTE: the aps wait for this before joining the rest of the boot
+    defer bring_up_done.store(true, .release);
 
     const apic = cpu.perCpu(.apic);
-    try apic.sendIPI(.{ .init = {} }, .all_excluding_self, .{});
-    pit.wait(count10ms);
+    const startup: apic_types.IPIMessage = .{ .startup = .{ .trampoline = bootinfo.trampoline_page } };
+    var watch = timer.startStopwatch();
+    try apic.sendIPI(.{ .init = {} }, .all_excluding_self, .{ .wait_for_send = true });
+    if (needsInitSettleDelay()) timer.wait(init_settle_delay);
+    try apic.sendIPI(startup, .all_excluding_self, .{ .wait_for_send = true });
+    const first_sipi = try watch.read();
+    var sipi_retried = false;
+
+    var now = first_sipi;
+    while (cpu.cpu_count.load(.acquire) < expected and now.nanoseconds < online_timeout.nanoseconds) {
+        recordArrivals(&latencies, now);
+        if (!sipi_retried and now.nanoseconds - first_sipi.nanoseconds >= sipi_retry_delay.nanoseconds) {
+            try apic.sendIPI(startup, .all_excluding_self, .{ .wait_for_send = true });
+            sipi_retried = true;
+        }
+        std.atomic.spinLoopHint();
+        now = try watch.read();
+    }
+    recordArrivals(&latencies, now);
+
+    const self_id = cpu.currentId();
+    var iter = cpu.present_cpus_mask.iterator(.{});
+    while (iter.next()) |cpu_id| {
+        if (cpu_id == self_id) continue;
+        const apic_id = cpu.cpu_data[cpu_id].apic_id;
+        if (latencies[cpu_id]) |latency| {
+            log.debug("cpu {d} (apic {d}) online after {f}", .{ cpu_id, apic_id, latency });
+        } else {
+            log.warn("cpu {d} (apic {d}) didn't come up", .{ cpu_id, apic_id });
+        }
+    }
+    const online = cpu.cpu_count.load(.acquire);
+    log.info("{d}/{d} cpus online after {f} (second SIPI: {any})", .{ online, expected, now, sipi_retried });
+    if (online < expected) {
+        return error.MissingCpu;
+    }
+}
 
-    for (0..2) |_| {
-        try apic.sendIPI(.{ .startup = .{ .trampoline = bootinfo.trampoline_page } }, .all_excluding_self, .{});
-        pit.wait(count10ms);
-        if (cpu.cpu_count.load(.acquire) >= cpu.present_cpus_count) break;
+// NOTE: called by an ap once it's ready to take interrupts, last step before cpu_count moves
+pub fn reportOnline(cpu_id: cpu.CpuId) void {
+    online_flags[cpu_id].store(true, .release);
+    _ = cpu.cpu_count.fetchAdd(1, .release);
+}
 
-        pit.wait(count50ms);
-        pit.wait(count50ms);
-    }
+pub fn waitForBringUp() void {
+    while (!bring_up_done.load(.acquire)) std.atomic.spinLoopHint();
+}
 
-    log.info("cpu count after wake up {d}", .{cpu.cpu_count.load(.acquire)});
-    if (cpu.cpu_count.load(.acquire) < cpu.present_cpus_count) {
-        return error.MissingCpu;
+fn recordArrivals(latencies: *[cpu.possible_cpus_count]?timer.Duration, now: timer.Duration) void {
+    var iter = cpu.present_cpus_mask.iterator(.{});
+    while (iter.next()) |cpu_id| {
+        if (latencies[cpu_id] == null and online_flags[cpu_id].load(.acquire)) latencies[cpu_id] = now;
     }
 }
 
+fn needsInitSettleDelay() bool {
+    const info = cpu.cpu_info;
+    return switch (info.vendor) {
+        .intel => info.family < 6,
+        .amd => info.extended_family < 0xf,
+        .unknown => true,
+    };
+}
+
 // EL PLAN:
 // 1/ identify cpu count (done)
 // 2/ create a trampoline page (done)
 // 2.5/ write the startup code (small bootloader: takes the core from real mode to long mode AFAP)
 // 3/ copy the startup code to the trampoline (done)
 // 4/ have a special path in our kernel entrypoint for APs (done)
-// 5/ initiate the INIT SIPI SIPI sequence to start up the APs
+// 5/ initiate the INIT SIPI SIPI sequence to start up the APs (done)
 
 fn setCpuPresent(cpu_id: cpu.CpuId, apic_id: cpu.CpuId) !void {
     try cpu.setCpuPresent(cpu_id, .{ .apic_id = apic_id, .lapic_addr = local_apic.address });
+    if (apic_id < ap_cpu_ids.len) ap_cpu_ids[apic_id] = cpu_id;
 }
@@ -0,0 +1,196 @@
+const std = @import("std");
+const flcn = @import("flcn");
+const assembly = @import("assembly.zig");
+const registers = @import("registers.zig");
+const cpu = @import("cpu.zig");
+const memory = @import("memory.zig");
+const interrupts = @import("interrupts.zig");
+const apic_types = @import("apic/types.zig");
+
+const log = std.log.scoped(.tlb);
+
+// NOTE: above this many entries a full flush is cheaper than individual invalidations
+pub const invlpg_threshold = 32;
+const shootdown_vector = 0xfd;
+const cr3_pcid_mask: u64 = 0xfff;
+const cr4_pge: u64 = 1 << 7;
+const cr4_pcide: u64 = 1 << 17;
+
+pub const Pcid = u12;
+
+// NOTE: invalidations gathered while changing the mappings of one address space. the batch only
+// keeps the first `invlpg_threshold` addresses, past that it degrades to a full flush
+pub const Batch = struct {
+    pcid: Pcid = 0,
+    addrs: [invlpg_threshold]memory.VAddrSize = undefined,
+    count: u64 = 0,
+    global: bool = false,
+
+    pub fn add(self: *Batch, vaddr: memory.VAddrSize, global: bool) void {
+        if (self.count < invlpg_threshold) self.addrs[self.count] = vaddr;
+        self.count += 1;
+        self.global = self.global or global;
+    }
+
+    fn isFullFlush(self: *const Batch) bool {
+        return self.count > invlpg_threshold;
+    }
+};
+
+pub const Stats = struct {
+    shootdowns: std.atomic.Value(u64) = .init(0),
+    ipis_sent: std.atomic.Value(u64) = .init(0),
+    pages_flushed: std.atomic.Value(u64) = .init(0),
+    full_flushes: std.atomic.Value(u64) = .init(0),
+};
+
+const CpuState = struct {
+    pending: std.atomic.Value(bool) align(std.atomic.cache_line) = .init(false),
+    received: u64 = 0,
+};
+
+var pcid_enabled = false;
+var invpcid_enabled = false;
+var shootdown_ready = false;
+// NOTE: one shootdown in flight at a time. a cpu waiting for its turn keeps servicing the
+// request targeting it, so two initiators can't wait on each other with interrupts disabled
+var shootdown_lock: std.atomic.Value(bool) align(std.atomic.cache_line) = .init(false);
+var pending_acks: std.atomic.Value(u32) align(std.atomic.cache_line) = .init(0);
+var request: Batch = .{};
+var cpu_states: [flcn.cpu.possible_cpus_count]CpuState = .{CpuState{}} ** flcn.cpu.possible_cpus_count;
+pub var stats: Stats = .{};
+
+pub fn initCore() void {
+    // NOTE: pcids can only be turned on while cr3 runs with pcid 0 (the kernel's)
+    if (cpu.hasFeature(.pcid) and registers.readCR(.cr3) & cr3_pcid_mask == 0) {
+        registers.writeCR(.cr4, registers.readCR(.cr4) | cr4_pcide);
+        pcid_enabled = true;
+        invpcid_enabled = cpu.hasFeature(.invpcid);
+    }
+    log.debug("pcid: {any}, invpcid: {any}", .{ pcid_enabled, invpcid_enabled });
+}
+
+pub fn init() !void {
+    _ = try flcn.irq.register(.{
+        .source = .{ .vector = shootdown_vector, .kind = .fixed },
+        .config = .{ .masked = false },
+        .name = "tlb shootdown",
+        .handler = .{ .handler_fn = onShootdownIpi },
+    });
+    shootdown_ready = true;
+    log.info("tlb shootdown initialized (pcid: {any}, invpcid: {any})", .{ pcid_enabled, invpcid_enabled });
+}
+
+// NOTE: invalidates the batch on every online cpu
+pub fn flush(batch: *const Batch) void {
+    if (batch.count == 0) return;
+    const int_state = cpu.saveAndDisableInterrupts();
+    defer cpu.restoreInterrupts(int_state);
+    flushLocal(batch);
+    if (!shootdown_ready or flcn.cpu.online_cpus_count <= 1) return;
+    // NOTE: the targets ack from their interrupt handler, one spinning with interrupts disabled on a
+    // lock held here would never answer
+    if (flcn.synchronization.heldLocksCount() != 0) @panic("tlb shootdown with a spin lock held");
+    shootdown(batch);
+}
+
+fn currentPcid() Pcid {
+    if (!pcid_enabled) return 0;
+    return @intCast(registers.readCR(.cr3) & cr3_pcid_mask);
+}
+
+fn flushLocal(batch: *const Batch) void {
+    const foreign_pcid = batch.pcid != currentPcid();
+    // NOTE: invlpg only reaches the current pcid, another one needs invpcid or a full flush
+    if (!batch.isFullFlush() and (invpcid_enabled or !foreign_pcid)) {
+        _ = stats.pages_flushed.fetchAdd(batch.count, .monotonic);
+        for (batch.addrs[0..batch.count]) |vaddr| {
+            if (invpcid_enabled and foreign_pcid) {
+                assembly.invalidatePcid(.individual_address, batch.pcid, vaddr);
+            } else {
+                assembly.invalidateVirtualAddress(vaddr);
+            }
+        }
+        return;
+    }
+
+    _ = stats.full_flushes.fetchAdd(1, .monotonic);
+    if (invpcid_enabled) {
+        // NOTE: global translations are shared by every pcid
+        if (batch.global) {
+            assembly.invalidatePcid(.all_context_global, 0, 0);
+        } else {
+            assembly.invalidatePcid(.single_context, batch.pcid, 0);
+        }
+        return;
+    }
+    if (batch.global or foreign_pcid) {
+        // NOTE: any write to cr4 that changes pge drops every translation of every pcid
+        const cr4 = registers.readCR(.cr4);
+        registers.writeCR(.cr4, cr4 ^ cr4_pge);
+        registers.writeCR(.cr4, cr4);
+        return;
+    }
+    registers.writeCR(.cr3, registers.readCR(.cr3));
+}
+
+fn shootdown(batch: *const Batch) void {
+    const self_id = flcn.cpu.currentId();
+    while (shootdown_lock.cmpxchgWeak(false, true, .acquire, .monotonic) != null) {
+        serviceRequest(self_id);
+        assembly.spinLoopHint();
+    }
+    defer shootdown_lock.store(false, .release);
+
+    var targets = flcn.cpu.online_cpus_mask;
+    targets.unset(self_id);
+    const target_count = targets.count();
+    if (target_count == 0) return;
+
+    request = batch.*;
+    pending_acks.store(@intCast(target_count), .monotonic);
+    var iter = targets.iterator(.{});
+    while (iter.next()) |target| cpu_states[target].pending.store(true, .release);
+
+    // NOTE: a single broadcast when every other cpu is a target, one ipi per target otherwise
+    const apic = cpu.perCpu(.apic);
+    const ipi: apic_types.IPIMessage = .{ .fixed = .{ .vector = shootdown_vector } };
+    if (target_count == flcn.cpu.online_cpus_count - 1) {
+        apic.sendIPI(ipi, .all_excluding_self, .{}) catch @panic("tlb shootdown ipi failed");
+        _ = stats.ipis_sent.fetchAdd(1, .monotonic);
+    } else {
+        iter = targets.iterator(.{});
+        while (iter.next()) |target| {
+            apic.sendIPI(ipi, .{ .apic = .{ .id = flcn.cpu.cpu_data[target].apic_id } }, .{}) catch @panic("tlb shootdown ipi failed");
+        }
+        _ = stats.ipis_sent.fetchAdd(target_count, .monotonic);
+    }
+    _ = stats.shootdowns.fetchAdd(1, .monotonic);
+
+    while (pending_acks.load(.acquire) != 0) {
+        assembly.spinLoopHint();
+    }
+}
+
+fn serviceRequest(cpu_id: flcn.cpu.CpuId) void {
+    const state = &cpu_states[cpu_id];
+    if (!state.pending.swap(false, .acquire)) return;
+    flushLocal(&request);
+    state.received += 1;
+    _ = pending_acks.fetchSub(1, .release);
+}
+
+fn onShootdownIpi(_: *const interrupts.interrupt_context.Context, _: ?*anyopaque) void {
+    serviceRequest(flcn.cpu.currentId());
+}
+
+pub fn printStats() void {
+    log.info(
+        \\ TLB: {d} shootdowns, {d} ipis sent, {d} pages flushed, {d} full flushes
+    , .{
+        stats.shootdowns.load(.monotonic),
+        stats.ipis_sent.load(.monotonic),
+        stats.pages_flushed.load(.monotonic),
+        stats.full_flushes.load(.monotonic),
+    });
+}
@@ -1,6 +1,5 @@
 const std = @import("std");
 const BootInfo = @import("bootinfo.zig").BootInfo;
-const Memory = @import("memory.zig");
 const arch = @import("arch");
 const acpi_types = @import("acpi/types.zig");
 const acpi_events = @import("acpi/acpi_events.zig");
@@ -24,7 +23,7 @@ const AcpiTable = struct {
     header: acpi_types.DescriptionHeader,
 
     pub fn init(header: *const acpi_types.DescriptionHeader) AcpiTable {
-        const paddr = Memory.kernel_vmem.virtToPhys(@bitCast(@intFromPtr(header)));
+        const paddr = @intFromPtr(header) - direct_map_offset;
         const is_valid = validateChecksum(header);
         return .{
             .phys_addr = paddr,
@@ -34,7 +33,7 @@ const AcpiTable = struct {
         };
     }
     pub fn initFromPhys(paddr: arch.memory.PAddr) AcpiTable {
-        const table_addr = Memory.kernel_vmem.physToVirt(paddr).toAddr();
+        const table_addr = physToVirt(paddr);
         const header: *const acpi_types.DescriptionHeader = @ptrFromInt(table_addr);
         return .init(header);
     }
@@ -42,10 +41,18 @@ const AcpiTable = struct {
 
 const AcpiTableMap = std.EnumMap(acpi_types.TableSignatures, AcpiTable);
 var acpi_tables: AcpiTableMap = undefined;
+// NOTE: the tables are read through the bootloader's direct mapping so they can be parsed
+// before the physical memory manager is up (it needs the SRAT to place its regions)
+var direct_map_offset: u64 = undefined;
+
+fn physToVirt(paddr: arch.memory.PAddr) u64 {
+    return paddr + direct_map_offset;
+}
 
 pub fn init() !void {
+    direct_map_offset = try arch.memory.PageMapManager.readPageOffset();
     const rsdp_paddr = bootinfo.acpi_ptr;
-    const rsdp_addr = Memory.kernel_vmem.physToVirt(rsdp_paddr).toAddr();
+    const rsdp_addr = physToVirt(rsdp_paddr);
     log.debug("found ACPI root table at 0x{x}", .{rsdp_addr});
     acpi_tables = .init(.{});
     try initFromRsdt(rsdp_addr);
@@ -118,6 +125,86 @@ pub fn iterateTable(sig: acpi_types.TableSignatures, ctx: AcpiTableIterationCont
 
                 return;
             },
+            .srat => {
+                if (!table.is_valid) return error.BadChecksum;
+                const table_end: u64 = table.virt_addr + table.header.len;
+                var affinity_header: *align(1) const acpi_types.AcpiSrat.AffinityHeader = @ptrFromInt(table.virt_addr + @sizeOf(acpi_types.AcpiSrat));
+
+                while (@intFromPtr(affinity_header) < table_end) : (affinity_header = @ptrFromInt(@intFromPtr(affinity_header) + affinity_header.length)) {
+                    log.debug("found srat entry with type {t}", .{affinity_header.typ});
+                    if (affinity_header.length == 0) return error.BadTable;
+                    switch (affinity_header.typ) {
+                        .processorLocalApic => {
+                            const affinity: *align(1) const acpi_types.AcpiSrat.ProcessorLocalApicAffinity = @ptrCast(affinity_header);
+                            if (!affinity.flags.enabled) continue;
+                            try ctx.notify(&acpi_events.SratParsingEvent{
+                                .processor_affinity = .{
+                                    .apic_id = affinity.apic_id,
+                                    .proximity_domain = affinity.proximityDomain(),
+                                },
+                            });
+                        },
+                        .processorLocalx2Apic => {
+                            const affinity: *align(1) const acpi_types.AcpiSrat.ProcessorLocalx2ApicAffinity = @ptrCast(affinity_header);
+                            if (!affinity.flags.enabled) continue;
+                            try ctx.notify(&acpi_events.SratParsingEvent{
+                                .processor_affinity = .{
+                                    .apic_id = affinity.x2apic_id,
+                                    .proximity_domain = affinity.proximity_domain,
+                                },
+                            });
+                        },
+                        .memory => {
+                            const affinity: *align(1) const acpi_types.AcpiSrat.MemoryAffinity = @ptrCast(affinity_header);
+                            if (!affinity.flags.enabled) continue;
+                            try ctx.notify(&acpi_events.SratParsingEvent{
+                                .memory_affinity = .{
+                                    .base = @as(u64, affinity.base_addr_high) << 32 | affinity.base_addr_low,
+                                    .length = @as(u64, affinity.length_high) << 32 | affinity.length_low,
+                                    .proximity_domain = affinity.proximity_domain,
+                                    .hot_pluggable = affinity.flags.hot_pluggable,
+                                },
+                            });
+                        },
+                        else => {
+                            log.warn("Unhandled srat affinity type {t}", .{affinity_header.typ});
+                        },
+                        _ => log.warn("Unknown srat affinity type {d}", .{@intFromEnum(affinity_header.typ)}),
+                    }
+                }
+
+                return;
+            },
+            .slit => {
+                if (!table.is_valid) return error.BadChecksum;
+                const slit: *align(1) const acpi_types.AcpiSlit = @ptrFromInt(table.virt_addr);
+                const locality_count = slit.locality_count;
+                if (@sizeOf(acpi_types.AcpiSlit) + locality_count * locality_count > table.header.len) return error.BadTable;
+                try ctx.notify(&acpi_events.SlitParsingEvent{ .locality_count = locality_count });
+                const distances: [*]const u8 = @ptrFromInt(table.virt_addr + @sizeOf(acpi_types.AcpiSlit));
+                for (0..locality_count) |from| {
+                    for (0..locality_count) |to| {
+                        try ctx.notify(&acpi_events.SlitParsingEvent{
+                            .distance = .{ .from = from, .to = to, .distance = distances[from * locality_count + to] },
+                        });
+                    }
+                }
+
+                return;
+            },
+            .hpet => {
+                if (!table.is_valid) return error.BadChecksum;
+                const hpet: *align(1) const acpi_types.AcpiHpet = @ptrFromInt(table.virt_addr);
+                if (table.header.len < @sizeOf(acpi_types.AcpiHpet)) return error.BadTable;
+                if (hpet.base_address.address_space != .system_memory) return error.UnsupportedAddressSpace;
+                try ctx.notify(&acpi_events.HpetParsingEvent{
+                    .address = hpet.base_address.address,
+                    .hpet_number = hpet.hpet_number,
+                    .minimum_tick = hpet.minimum_tick,
+                });
+
+                return;
+            },
             else => unreachable,
         }
     }
@@ -127,7 +214,7 @@ pub fn iterateTable(sig: acpi_types.TableSignatures, ctx: AcpiTableIterationCont
 fn initFromRsdt(rsdp_addr: u64) !void {
     const rsdp: *align(1) const acpi_types.AcpiRsdp = @ptrFromInt(rsdp_addr);
     const rsdt_paddr = if (rsdp.rev == 2) rsdp.xsdt_addr else rsdp.rsdt_addr;
-    const rsdt_addr = Memory.kernel_vmem.physToVirt(rsdt_paddr).toAddr();
+    const rsdt_addr = physToVirt(rsdt_paddr);
     const header: *const acpi_types.DescriptionHeader = @ptrFromInt(rsdt_addr);
     const header_sig = std.mem.bytesAsValue(u32, &header.sig).*;
     if (header_sig != @intFromEnum(acpi_types.TableSignatures.rsdt) and header_sig != @intFromEnum(acpi_types.TableSignatures.xsdt)) {
@@ -163,7 +250,11 @@ fn findRXsdtEntries(header: *const acpi_types.DescriptionHeader) !void {
 fn parseTable(comptime TAddr: type, addr: TAddr) void {
     const acpi_table: AcpiTable = .initFromPhys(addr);
     log.debug("parsed table with signature {s}", .{acpi_table.header.sig});
-    acpi_tables.put(.fromSignature(&acpi_table.header.sig), acpi_table);
+    const sig = acpi_types.TableSignatures.fromSignature(&acpi_table.header.sig) orelse {
+        log.debug("ignoring unsupported table {s}", .{acpi_table.header.sig});
+        return;
+    };
+    acpi_tables.put(sig, acpi_table);
 }
 
 fn validateChecksum(header: *const acpi_types.DescriptionHeader) bool {
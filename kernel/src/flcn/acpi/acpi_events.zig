@@ -34,3 +34,37 @@ pub const MadtParsingEvent = union(enum) {
     interrupt_source_override: InterruptSourceOverrideFoundEvent,
     local_apic_nmi: LocalApicNMIFoundEvent,
 };
+
+pub const ProcessorAffinityFoundEvent = struct {
+    apic_id: u32,
+    proximity_domain: u32,
+};
+pub const MemoryAffinityFoundEvent = struct {
+    base: u64,
+    length: u64,
+    proximity_domain: u32,
+    hot_pluggable: bool,
+};
+
+pub const SratParsingEvent = union(enum) {
+    processor_affinity: ProcessorAffinityFoundEvent,
+    memory_affinity: MemoryAffinityFoundEvent,
+};
+
+pub const LocalityDistanceFoundEvent = struct {
+    from: u64,
+    to: u64,
+    distance: u8,
+};
+
+pub const SlitParsingEvent = union(enum) {
+    locality_count: u64,
+    distance: LocalityDistanceFoundEvent,
+};
+
+pub const HpetParsingEvent = struct {
+    address: u64,
+    hpet_number: u8,
+    // NOTE: smallest comparator delta (in main counter ticks) the block handles in one-shot mode
+    minimum_tick: u16,
+};
@@ -20,9 +20,15 @@ pub const TableSignatures = enum(u32) {
     hpet = std.mem.bytesToValue(u32, "HPET"),
     waet = std.mem.bytesToValue(u32, "WAET"),
     bgrt = std.mem.bytesToValue(u32, "BGRT"),
+    srat = std.mem.bytesToValue(u32, "SRAT"),
+    slit = std.mem.bytesToValue(u32, "SLIT"),
 
-    pub fn fromSignature(signature: []const u8) TableSignatures {
-        return @enumFromInt(std.mem.bytesToValue(u32, signature));
+    pub fn fromSignature(signature: []const u8) ?TableSignatures {
+        const sig = std.mem.bytesToValue(u32, signature);
+        inline for (comptime std.enums.values(TableSignatures)) |table_sig| {
+            if (sig == @intFromEnum(table_sig)) return table_sig;
+        }
+        return null;
     }
 };
 
@@ -178,3 +184,98 @@ pub const AcpiMadt = extern struct {
     flags: packed struct(u32) { pcat_compat: bool, reserved: u31 } align(1),
     // Interrupt controller structures beyond here up to header.len
 };
+
+pub const AcpiSrat = extern struct {
+    pub const AffinityHeader = extern struct {
+        pub const Type = enum(u8) {
+            processorLocalApic = 0,
+            memory = 1,
+            processorLocalx2Apic = 2,
+            gicc = 3,
+            gicIts = 4,
+            genericInitiator = 5,
+            genericPort = 6,
+            _,
+        };
+        typ: Type align(1),
+        length: u8 align(1),
+    };
+    pub const ProcessorLocalApicAffinity = extern struct {
+        header: AffinityHeader,
+        proximity_domain_low: u8,
+        apic_id: u8,
+        flags: packed struct(u32) { enabled: bool, reserved: u31 } align(1),
+        local_sapic_eid: u8,
+        proximity_domain_high: [3]u8,
+        clock_domain: u32 align(1),
+
+        pub fn proximityDomain(self: *align(1) const ProcessorLocalApicAffinity) u32 {
+            return @as(u32, self.proximity_domain_low) |
+                @as(u32, self.proximity_domain_high[0]) << 8 |
+                @as(u32, self.proximity_domain_high[1]) << 16 |
+                @as(u32, self.proximity_domain_high[2]) << 24;
+        }
+    };
+    pub const MemoryAffinity = extern struct {
+        header: AffinityHeader,
+        proximity_domain: u32 align(1),
+        reserved1: u16 align(1),
+        base_addr_low: u32 align(1),
+        base_addr_high: u32 align(1),
+        length_low: u32 align(1),
+        length_high: u32 align(1),
+        reserved2: u32 align(1),
+        flags: packed struct(u32) { enabled: bool, hot_pluggable: bool, non_volatile: bool, reserved: u29 } align(1),
+        reserved3: u64 align(1),
+    };
+    pub const ProcessorLocalx2ApicAffinity = extern struct {
+        header: AffinityHeader,
+        reserved1: u16 align(1),
+        proximity_domain: u32 align(1),
+        x2apic_id: u32 align(1),
+        flags: packed struct(u32) { enabled: bool, reserved: u31 } align(1),
+        clock_domain: u32 align(1),
+        reserved2: u32 align(1),
+    };
+
+    header: DescriptionHeader,
+    reserved1: u32 align(1),
+    reserved2: u64 align(1),
+    // Static resource allocation structures beyond here up to header.len
+};
+
+pub const AcpiSlit = extern struct {
+    header: DescriptionHeader,
+    locality_count: u64 align(1),
+    // locality_count * locality_count distance entries (u8) beyond here
+};
+
+pub const GenericAddress = extern struct {
+    pub const AddressSpace = enum(u8) {
+        system_memory = 0,
+        system_io = 1,
+        pci_configuration = 2,
+        _,
+    };
+    address_space: AddressSpace align(1),
+    register_bit_width: u8 align(1),
+    register_bit_offset: u8 align(1),
+    access_size: u8 align(1),
+    address: u64 align(1),
+};
+
+pub const AcpiHpet = extern struct {
+    header: DescriptionHeader,
+    event_timer_block_id: packed struct(u32) {
+        hardware_rev_id: u8,
+        comparator_count: u5,
+        counter_64bit: bool,
+        reserved: u1,
+        legacy_replacement: bool,
+        pci_vendor_id: u16,
+    } align(1),
+    base_address: GenericAddress align(1),
+    hpet_number: u8 align(1),
+    minimum_tick: u16 align(1),
+    page_protection: u8 align(1),
+};
@@ -1,5 +1,6 @@
 const std = @import("std");
 const DoublyLinkedList = @import("list.zig").DoublyLinkedList;
+const PageDescriptor = @import("pmm.zig").PageDescriptor;
 
 pub const SubHeapAllocator = struct {
     ptr: *anyopaque,
@@ -41,6 +42,7 @@ pub fn PageAllocator(comptime alignment: std.mem.Alignment) type {
         pub const VTable = struct {
             allocate: *const fn (*anyopaque, count: u64, args: AllocateArgs) anyerror![*]align(page_alignment) u8,
             free: *const fn (*anyopaque, ptr: [*]align(page_alignment) u8, count: u64, args: FreeArgs) anyerror!void,
+            descriptor: *const fn (*anyopaque, ptr: *const anyopaque) ?*PageDescriptor,
         };
 
         pub fn allocate(self: Self, count: u64, args: AllocateArgs) ![*]align(page_alignment) u8 {
@@ -49,6 +51,9 @@ pub fn PageAllocator(comptime alignment: std.mem.Alignment) type {
         pub fn free(self: Self, ptr: [*]align(page_alignment) u8, count: u64, args: FreeArgs) !void {
             return try self.vtable.free(self.ptr, ptr, count, .{ .poison = args.poison });
         }
+        pub fn descriptor(self: Self, ptr: *const anyopaque) ?*PageDescriptor {
+            return self.vtable.descriptor(self.ptr, ptr);
+        }
     };
 }
 
@@ -0,0 +1,326 @@
+const std = @import("std");
+
+pub fn Links(comptime T: type) type {
+    return struct {
+        parent: ?*T = null,
+        left: ?*T = null,
+        right: ?*T = null,
+        height: u8 = 1,
+    };
+}
+
+// NOTE: intrusive avl tree. `T` embeds a Links(T) in `links_field`, nodes are ordered by `compare`
+// (equal keys go to the right). `augment`, when given, recomputes a node's summary of its subtree
+// from its children, it runs on every node whose subtree changed (rotations, insert/remove paths)
+pub fn AvlTree(
+    comptime T: type,
+    comptime links_field: std.meta.FieldEnum(T),
+    comptime compare: fn (*const T, *const T) std.math.Order,
+    comptime augment: ?fn (*T) void,
+) type {
+    return struct {
+        const Self = @This();
+        const links_name = std.meta.fieldInfo(T, links_field).name;
+
+        root: ?*T = null,
+        count: usize = 0,
+
+        pub fn links(node: *T) *Links(T) {
+            return &@field(node, links_name);
+        }
+
+        pub fn left(node: *T) ?*T {
+            return links(node).left;
+        }
+
+        pub fn right(node: *T) ?*T {
+            return links(node).right;
+        }
+
+        fn height(node: ?*T) i16 {
+            return if (node) |n| links(n).height else 0;
+        }
+
+        fn balanceFactor(node: *T) i16 {
+            return height(links(node).left) - height(links(node).right);
+        }
+
+        fn fix(node: *T) void {
+            const l = links(node);
+            l.height = @intCast(1 + @max(height(l.left), height(l.right)));
+            if (augment) |f| f(node);
+        }
+
+        fn replaceChild(self: *Self, parent: ?*T, old: *T, new: ?*T) void {
+            if (parent) |p| {
+                if (links(p).left == old) links(p).left = new else links(p).right = new;
+            } else {
+                self.root = new;
+            }
+        }
+
+        fn rotateLeft(self: *Self, x: *T) *T {
+            const y = links(x).right.?;
+            self.replaceChild(links(x).parent, x, y);
+            links(y).parent = links(x).parent;
+            links(x).right = links(y).left;
+            if (links(y).left) |child| links(child).parent = x;
+            links(y).left = x;
+            links(x).parent = y;
+            fix(x);
+            fix(y);
+            return y;
+        }
+
+        fn rotateRight(self: *Self, x: *T) *T {
+            const y = links(x).left.?;
+            self.replaceChild(links(x).parent, x, y);
+            links(y).parent = links(x).parent;
+            links(x).left = links(y).right;
+            if (links(y).right) |child| links(child).parent = x;
+            links(y).right = x;
+            links(x).parent = y;
+            fix(x);
+            fix(y);
+            return y;
+        }
+
+        fn rebalance(self: *Self, node: *T) *T {
+            fix(node);
+            const balance = balanceFactor(node);
+            if (balance > 1) {
+                if (balanceFactor(links(node).left.?) < 0) _ = self.rotateLeft(links(node).left.?);
+                return self.rotateRight(node);
+            }
+            if (balance < -1) {
+                if (balanceFactor(links(node).right.?) > 0) _ = self.rotateRight(links(node).right.?);
+                return self.rotateLeft(node);
+            }
+            return node;
+        }
+
+        // NOTE: walks up to the root, augmented data changes all the way up
+        fn rebalanceFrom(self: *Self, start: ?*T) void {
+            var cursor = start;
+            while (cursor) |node| {
+                cursor = links(self.rebalance(node)).parent;
+            }
+        }
+
+        pub fn insert(self: *Self, node: *T) void {
+            links(node).* = .{};
+            var parent: ?*T = null;
+            var go_left = false;
+            var cursor = self.root;
+            while (cursor) |c| {
+                parent = c;
+                go_left = compare(node, c) == .lt;
+                cursor = if (go_left) links(c).left else links(c).right;
+            }
+            links(node).parent = parent;
+            if (parent) |p| {
+                if (go_left) links(p).left = node else links(p).right = node;
+            } else {
+                self.root = node;
+            }
+            fix(node);
+            self.rebalanceFrom(parent);
+            self.count += 1;
+        }
+
+        // NOTE: purely structural, the node's key may already have been changed by the caller
+        pub fn remove(self: *Self, node: *T) void {
+            const l = links(node);
+            var rebalance_start: ?*T = undefined;
+            if (l.left != null and l.right != null) {
+                // NOTE: the successor takes the place of the node
+                var successor = l.right.?;
+                while (links(successor).left) |s| successor = s;
+                const s = links(successor);
+                if (s.parent == node) {
+                    rebalance_start = successor;
+                } else {
+                    rebalance_start = s.parent;
+                    links(s.parent.?).left = s.right;
+                    if (s.right) |child| links(child).parent = s.parent;
+                    s.right = l.right;
+                    links(l.right.?).parent = successor;
+                }
+                s.left = l.left;
+                links(l.left.?).parent = successor;
+                s.parent = l.parent;
+                self.replaceChild(l.parent, node, successor);
+            } else {
+                const child = l.left orelse l.right;
+                if (child) |c| links(c).parent = l.parent;
+                self.replaceChild(l.parent, node, child);
+                rebalance_start = l.parent;
+            }
+            l.* = .{};
+            self.rebalanceFrom(rebalance_start);
+            self.count -= 1;
+        }
+
+        // NOTE: recomputes the augmented data above a node whose contents changed in place
+        pub fn update(self: *Self, node: *T) void {
+            _ = self;
+            var cursor: ?*T = node;
+            while (cursor) |n| {
+                fix(n);
+                cursor = links(n).parent;
+            }
+        }
+
+        pub fn first(self: *const Self) ?*T {
+            var node = self.root orelse return null;
+            while (links(node).left) |l| node = l;
+            return node;
+        }
+
+        pub fn last(self: *const Self) ?*T {
+            var node = self.root orelse return null;
+            while (links(node).right) |r| node = r;
+            return node;
+        }
+
+        pub fn next(node: *T) ?*T {
+            if (links(node).right) |r| {
+                var cursor = r;
+                while (links(cursor).left) |l| cursor = l;
+                return cursor;
+            }
+            var cursor = node;
+            while (links(cursor).parent) |p| {
+                if (links(p).left == cursor) return p;
+                cursor = p;
+            }
+            return null;
+        }
+
+        pub fn prev(node: *T) ?*T {
+            if (links(node).left) |l| {
+                var cursor = l;
+                while (links(cursor).right) |r| cursor = r;
+                return cursor;
+            }
+            var cursor = node;
+            while (links(cursor).parent) |p| {
+                if (links(p).right == cursor) return p;
+                cursor = p;
+            }
+            return null;
+        }
+
+        // NOTE: last node ordered before or equal to `key`
+        pub fn floor(self: *const Self, key: *const T) ?*T {
+            var result: ?*T = null;
+            var cursor = self.root;
+            while (cursor) |c| {
+                if (compare(key, c) == .lt) {
+                    cursor = links(c).left;
+                } else {
+                    result = c;
+                    cursor = links(c).right;
+                }
+            }
+            return result;
+        }
+
+        // NOTE: first node ordered after or equal to `key`
+        pub fn ceiling(self: *const Self, key: *const T) ?*T {
+            var result: ?*T = null;
+            var cursor = self.root;
+            while (cursor) |c| {
+                if (compare(c, key) == .lt) {
+                    cursor = links(c).right;
+                } else {
+                    result = c;
+                    cursor = links(c).left;
+                }
+            }
+            return result;
+        }
+
+        pub const Iterator = struct {
+            current: ?*T,
+
+            pub fn next(it: *Iterator) ?*T {
+                const current = it.current orelse return null;
+                it.current = Self.next(current);
+                return current;
+            }
+        };
+
+        pub fn iter(self: *const Self) Iterator {
+            return .{ .current = self.first() };
+        }
+
+        // NOTE: checks ordering, parent links and balance, returns the height
+        pub fn validate(self: *const Self) !usize {
+            return validateNode(self.root, null);
+        }
+
+        fn validateNode(node: ?*T, parent: ?*T) !usize {
+            const n = node orelse return 0;
+            const l = links(n);
+            if (l.parent != parent) return error.BrokenParentLink;
+            if (l.left) |child| if (compare(child, n) == .gt) return error.BrokenOrder;
+            if (l.right) |child| if (compare(child, n) == .lt) return error.BrokenOrder;
+            const left_height = try validateNode(l.left, n);
+            const right_height = try validateNode(l.right, n);
+            if (@max(left_height, right_height) - @min(left_height, right_height) > 1) return error.Unbalanced;
+            const h = 1 + @max(left_height, right_height);
+            if (h != l.height) return error.WrongHeight;
+            return h;
+        }
+    };
+}
+
+const TestNode = struct {
+    value: u32,
+    links: Links(TestNode) = .{},
+    subtree_size: usize = 1,
+
+    fn compare(a: *const TestNode, b: *const TestNode) std.math.Order {
+        return std.math.order(a.value, b.value);
+    }
+
+    fn augment(node: *TestNode) void {
+        node.subtree_size = 1;
+        if (node.links.left) |l| node.subtree_size += l.subtree_size;
+        if (node.links.right) |r| node.subtree_size += r.subtree_size;
+    }
+};
+const TestTree = AvlTree(TestNode, .links, TestNode.compare, TestNode.augment);
+
+test "AvlTree stays sorted and balanced through inserts and removes" {
+    const count = 1000;
+    var nodes: [count]TestNode = undefined;
+    var prng: std.Random.DefaultPrng = .init(42);
+    const random = prng.random();
+    var tree: TestTree = .{};
+    for (&nodes, 0..) |*node, index| {
+        node.* = .{ .value = @intCast((index * 7919) % count) };
+        tree.insert(node);
+    }
+    try std.testing.expectEqual(@as(usize, count), tree.count);
+    try std.testing.expectEqual(@as(usize, count), tree.root.?.subtree_size);
+    try std.testing.expect(try tree.validate() <= 15);
+
+    var expected: u32 = 0;
+    var iter = tree.iter();
+    while (iter.next()) |node| : (expected += 1) try std.testing.expectEqual(expected, node.value);
+
+    random.shuffle(TestNode, &nodes);
+    // NOTE: shuffling moved the nodes, rebuild before removing half of them
+    tree = .{};
+    for (&nodes) |*node| tree.insert(node);
+    for (nodes[0 .. count / 2]) |*node| tree.remove(node);
+    try std.testing.expectEqual(@as(usize, count / 2), tree.count);
+    try std.testing.expectEqual(@as(usize, count / 2), tree.root.?.subtree_size);
+    _ = try tree.validate();
+
+    const key: TestNode = .{ .value = nodes[count / 2].value };
+    try std.testing.expectEqual(&nodes[count / 2], tree.floor(&key).?);
+    try std.testing.expectEqual(&nodes[count / 2], tree.ceiling(&key).?);
+}
@@ -0,0 +1,354 @@
+const std = @import("std");
+const builtin = @import("builtin");
+const options = @import("options");
+const pmm = @import("pmm.zig");
+
+const log = std.log.scoped(.buddy);
+
+pub const BuddyConfig = struct {
+    min_size: u64,
+    safety: bool = builtin.mode == .Debug or builtin.mode == .ReleaseSafe,
+};
+
+// NOTE: buddy allocator that keeps its free lists inside the free blocks themselves.
+// the only metadata is allocated in init (node_state + the safety bitmap), allocating and
+// freeing never touch `alloc` again. `link_offset` is added to a block address to get a
+// pointer we can write the links through (e.g. the direct mapping for physical memory)
+pub fn BuddyAllocator(comptime config: BuddyConfig) type {
+    const min_block_size_log = std.math.log2(config.min_size);
+    const max_orders = @bitSizeOf(u64) - min_block_size_log;
+    return struct {
+        const Self = @This();
+        const Order = u6;
+        const FreeBlock = struct {
+            prev: ?*FreeBlock,
+            next: ?*FreeBlock,
+        };
+        const FreeList = struct {
+            head: ?*FreeBlock = null,
+            count: u64 = 0,
+        };
+
+        alloc: std.mem.Allocator,
+        memory_start: u64,
+        memory_length: u64,
+        // NOTE: the tree is aligned to its own size so every block is naturally aligned
+        tree_start: u64,
+        max_order: Order,
+        link_offset: u64,
+        free_lists: [max_orders]FreeList = .{FreeList{}} ** max_orders,
+        // NOTE: bit n is set when the free list of order n is not empty
+        free_orders: u64 = 0,
+        free_size: u64 = 0,
+        // NOTE: one bit per parent node, set when exactly one of its children is free
+        node_state: std.bit_set.DynamicBitSetUnmanaged,
+        allocated: if (config.safety) std.bit_set.DynamicBitSetUnmanaged else void,
+
+        pub fn init(alloc: std.mem.Allocator, start: u64, length: u64, link_offset: u64) !Self {
+            if (!std.mem.Alignment.fromByteUnits(config.min_size).check(start)) {
+                @panic("Expected page aligned memory");
+            }
+            const usable_length = std.mem.alignBackward(u64, length, config.min_size);
+            if (usable_length == 0) return error.RegionTooSmall;
+            const end = start + usable_length;
+
+            var tree_size_log: Order = @intCast(std.math.log2_int_ceil(u64, usable_length));
+            var tree_start = std.mem.alignBackward(u64, start, @as(u64, 1) << tree_size_log);
+            while (tree_start + (@as(u64, 1) << tree_size_log) < end) {
+                tree_size_log += 1;
+                tree_start = std.mem.alignBackward(u64, start, @as(u64, 1) << tree_size_log);
+            }
+            const max_order: Order = @intCast(tree_size_log - min_block_size_log + 1);
+            const node_state_count = (@as(u64, 1) << (max_order - 1)) - 1;
+            const num_nodes = (@as(u64, 1) << max_order) - 1;
+
+            var buddy: Self = .{
+                .alloc = alloc,
+                .memory_start = start,
+                .memory_length = usable_length,
+                .tree_start = tree_start,
+                .max_order = max_order,
+                .link_offset = link_offset,
+                .node_state = try .initEmpty(alloc, node_state_count),
+                .allocated = if (config.safety) try .initEmpty(alloc, num_nodes) else {},
+            };
+
+            // NOTE: an all clear node_state is a tree where everything is allocated,
+            // releasing the usable memory in the biggest aligned blocks we can fit builds the free lists
+            var addr = start;
+            while (addr < end) {
+                var order: Order = max_order - 1;
+                while (!std.mem.isAligned(addr - tree_start, blockSize(order)) or addr + blockSize(order) > end) {
+                    order -= 1;
+                }
+                buddy.freeBlock(addr, order);
+                addr += blockSize(order);
+            }
+            return buddy;
+        }
+
+        pub fn deinit(self: *Self) void {
+            if (config.safety) {
+                if (self.free_size != self.memory_length) {
+                    log.err("leaked {d} bytes", .{self.memory_length - self.free_size});
+                }
+                self.allocated.deinit(self.alloc);
+            }
+            self.node_state.deinit(self.alloc);
+        }
+
+        inline fn blockSize(order: Order) u64 {
+            return @as(u64, config.min_size) << order;
+        }
+
+        fn orderForLength(length: u64) ?Order {
+            const order = std.math.log2_int_ceil(u64, @max(length, config.min_size)) - min_block_size_log;
+            if (order >= max_orders) return null;
+            return @intCast(order);
+        }
+
+        fn nodeIdx(self: *const Self, addr: u64, order: Order) u64 {
+            const first_node_idx = (@as(u64, 1) << (self.max_order - 1 - order)) - 1;
+            return first_node_idx + ((addr - self.tree_start) >> @as(u6, @intCast(min_block_size_log + @as(u64, order))));
+        }
+
+        fn parentStateIdx(self: *const Self, addr: u64, order: Order) u64 {
+            return (self.nodeIdx(addr, order) - 1) >> 1;
+        }
+
+        fn buddyOf(self: *const Self, addr: u64, order: Order) u64 {
+            return self.tree_start + ((addr - self.tree_start) ^ blockSize(order));
+        }
+
+        fn blockPtr(self: *const Self, addr: u64) *FreeBlock {
+            return @ptrFromInt(addr + self.link_offset);
+        }
+
+        fn pushFree(self: *Self, addr: u64, order: Order) void {
+            const block = self.blockPtr(addr);
+            const list = &self.free_lists[order];
+            block.* = .{ .prev = null, .next = list.head };
+            if (list.head) |head| head.prev = block;
+            list.head = block;
+            list.count += 1;
+            self.free_orders |= @as(u64, 1) << order;
+        }
+
+        fn removeFree(self: *Self, addr: u64, order: Order) void {
+            const block = self.blockPtr(addr);
+            const list = &self.free_lists[order];
+            if (block.prev) |prev| prev.next = block.next else list.head = block.next;
+            if (block.next) |next| next.prev = block.prev;
+            list.count -= 1;
+            if (list.head == null) self.free_orders &= ~(@as(u64, 1) << order);
+        }
+
+        fn popFree(self: *Self, order: Order) u64 {
+            const addr = @intFromPtr(self.free_lists[order].head.?) - self.link_offset;
+            self.removeFree(addr, order);
+            return addr;
+        }
+
+        fn allocateBlock(self: *Self, order: Order) ?u64 {
+            const available_orders = self.free_orders >> order;
+            if (available_orders == 0) return null;
+            var current: Order = @intCast(order + @ctz(available_orders));
+            const addr = self.popFree(current);
+            if (current < self.max_order - 1) self.node_state.toggle(self.parentStateIdx(addr, current));
+            while (current > order) {
+                current -= 1;
+                // NOTE: keep the lower half, the upper half is now the only free child of the block we split
+                self.pushFree(addr + blockSize(current), current);
+                self.node_state.toggle(self.parentStateIdx(addr, current));
+            }
+            self.free_size -= blockSize(order);
+            return addr;
+        }
+
+        fn freeBlock(self: *Self, block_addr: u64, block_order: Order) void {
+            self.free_size += blockSize(block_order);
+            var addr = block_addr;
+            var order = block_order;
+            while (order < self.max_order - 1) : (order += 1) {
+                const parent_idx = self.parentStateIdx(addr, order);
+                // NOTE: our block isn't free, so if exactly one child is free it's our buddy
+                if (!self.node_state.isSet(parent_idx)) break;
+                self.node_state.unset(parent_idx);
+                const buddy_addr = self.buddyOf(addr, order);
+                self.removeFree(buddy_addr, order);
+                addr = @min(addr, buddy_addr);
+            }
+            if (order < self.max_order - 1) self.node_state.toggle(self.parentStateIdx(addr, order));
+            self.pushFree(addr, order);
+        }
+
+        pub fn freeMemory(self: *const Self) u64 {
+            return self.free_size;
+        }
+
+        pub fn canAlloc(self: *const Self, requested_length: usize, alignment: std.mem.Alignment) bool {
+            const order = orderForLength(alignment.forward(requested_length)) orelse return false;
+            if (order >= self.max_order) return false;
+            return (self.free_orders >> order) != 0;
+        }
+
+        pub fn allocate(self: *Self, requested_length: u64, alignment: std.mem.Alignment, _: usize) !pmm.PhysMemRange {
+            const length = alignment.forward(std.mem.alignForward(u64, requested_length, config.min_size));
+            const order = orderForLength(length) orelse return error.OutOfMemory;
+            if (order >= self.max_order) return error.OutOfMemory;
+            const addr = self.allocateBlock(order) orelse return error.OutOfMemory;
+            if (config.safety) self.allocated.set(self.nodeIdx(addr, order));
+            return .{ .start = addr, .length = length, .typ = .free };
+        }
+
+        pub fn free(self: *Self, range: pmm.PhysMemRange, _: usize) !void {
+            const order = orderForLength(range.length) orelse return error.BadLength;
+            if (config.safety) {
+                if (order >= self.max_order or range.start < self.memory_start or range.start + blockSize(order) > self.memory_start + self.memory_length) {
+                    return error.OutOfRange;
+                }
+                if (!std.mem.isAligned(range.start - self.tree_start, blockSize(order))) return error.BadAlignment;
+                const node_idx = self.nodeIdx(range.start, order);
+                if (!self.allocated.isSet(node_idx)) {
+                    log.err("double free of 0x{x} ({d} bytes)", .{ range.start, range.length });
+                    return error.DoubleFree;
+                }
+                self.allocated.unset(node_idx);
+            }
+            self.freeBlock(range.start, order);
+        }
+    };
+}
+
+const TestBuddy = BuddyAllocator(.{ .min_size = 4096 });
+const test_pages = 250;
+var test_memory: [test_pages * 4096]u8 align(4096) = undefined;
+
+test "Buddy3 manages regions that are not a power of two" {
+    var buddy = try TestBuddy.init(std.testing.allocator, @intFromPtr(&test_memory), test_memory.len, 0);
+    defer buddy.deinit();
+    try std.testing.expectEqual(test_memory.len, buddy.freeMemory());
+
+    var ranges: [test_pages]pmm.PhysMemRange = undefined;
+    for (&ranges) |*range| {
+        range.* = try buddy.allocate(4096, .fromByteUnits(4096), 0);
+    }
+    try std.testing.expect(!buddy.canAlloc(4096, .fromByteUnits(4096)));
+    try std.testing.expectError(error.OutOfMemory, buddy.allocate(4096, .fromByteUnits(4096), 0));
+
+    for (ranges) |range| {
+        try buddy.free(range, 0);
+    }
+    try std.testing.expectEqual(test_memory.len, buddy.freeMemory());
+    try std.testing.expectError(error.DoubleFree, buddy.free(ranges[0], 0));
+
+    const block = try buddy.allocate(64 * 4096, .fromByteUnits(4096), 0);
+    try std.testing.expect(std.mem.isAligned(block.start - buddy.tree_start, 64 * 4096));
+    try buddy.free(block, 0);
+}
+
+const CountingAllocator = struct {
+    parent: std.mem.Allocator,
+    allocations: u64 = 0,
+
+    fn allocator(self: *CountingAllocator) std.mem.Allocator {
+        return .{
+            .ptr = self,
+            .vtable = &.{
+                .alloc = _alloc,
+                .resize = _resize,
+                .remap = _remap,
+                .free = _free,
+            },
+        };
+    }
+
+    fn _alloc(ptr: *anyopaque, len: usize, alignment: std.mem.Alignment, ret_addr: usize) ?[*]u8 {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ptr));
+        self.allocations += 1;
+        return self.parent.rawAlloc(len, alignment, ret_addr);
+    }
+
+    fn _resize(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) bool {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ptr));
+        return self.parent.rawResize(memory, alignment, new_len, ret_addr);
+    }
+
+    fn _remap(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) ?[*]u8 {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ptr));
+        return self.parent.rawRemap(memory, alignment, new_len, ret_addr);
+    }
+
+    fn _free(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, ret_addr: usize) void {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ptr));
+        self.parent.rawFree(memory, alignment, ret_addr);
+    }
+};
+
+fn churn(buddy: anytype) !void {
+    const alignment: std.mem.Alignment = .fromByteUnits(4096);
+    var ranges: [32]pmm.PhysMemRange = undefined;
+    for (0..16) |_| {
+        for (&ranges, 0..) |*range, i| {
+            range.* = try buddy.allocate(@as(u64, 4096) << @intCast(i % 3), alignment, 0);
+        }
+        var i: usize = 0;
+        while (i < ranges.len) : (i += 2) try buddy.free(ranges[i], 0);
+        i = 1;
+        while (i < ranges.len) : (i += 2) try buddy.free(ranges[i], 0);
+    }
+}
+
+test "Buddy3 does not allocate metadata after init (buddy2 comparison)" {
+    const Buddy2 = @import("buddy2.zig").BuddyAllocator(.{ .min_size = 4096, .safety = false });
+    const Buddy3 = BuddyAllocator(.{ .min_size = 4096, .safety = false });
+    const start = @intFromPtr(&test_memory);
+    const length = 128 * 4096;
+
+    var before: CountingAllocator = .{ .parent = std.testing.allocator };
+    var buddy2 = try Buddy2.init(before.allocator(), start, length);
+    defer buddy2.deinit();
+    const buddy2_init_allocations = before.allocations;
+    try churn(&buddy2);
+
+    var after: CountingAllocator = .{ .parent = std.testing.allocator };
+    var buddy3 = try Buddy3.init(after.allocator(), start, length, 0);
+    defer buddy3.deinit();
+    const buddy3_init_allocations = after.allocations;
+    try churn(&buddy3);
+
+    // NOTE: buddy2 creates a list node on every split, buddy3 only allocates its bitmaps in init
+    try std.testing.expectEqual(buddy3_init_allocations, after.allocations);
+    try std.testing.expect(before.allocations > buddy2_init_allocations);
+    try std.testing.expect(after.allocations < before.allocations);
+}
+
+// NOTE: only runs with -Dbuddy_bench_rounds=N, each round is one churn of 512 allocations and 512 frees
+test "Buddy3 churn benchmark (buddy2 comparison)" {
+    const rounds = options.buddy_bench_rounds;
+    if (rounds == 0) return error.SkipZigTest;
+    const arch = @import("arch");
+    const Buddy2 = @import("buddy2.zig").BuddyAllocator(.{ .min_size = 4096, .safety = false });
+    const Buddy3 = BuddyAllocator(.{ .min_size = 4096, .safety = false });
+    const start = @intFromPtr(&test_memory);
+    const length = 128 * 4096;
+    const operations = rounds * 16 * 32 * 2;
+
+    var buddy2 = try Buddy2.init(std.testing.allocator, start, length);
+    defer buddy2.deinit();
+    var tsc = arch.assembly.rdtsc();
+    for (0..rounds) |_| try churn(&buddy2);
+    const buddy2_cycles = arch.assembly.rdtsc() - tsc;
+
+    var buddy3 = try Buddy3.init(std.testing.allocator, start, length, 0);
+    defer buddy3.deinit();
+    tsc = arch.assembly.rdtsc();
+    for (0..rounds) |_| try churn(&buddy3);
+    const buddy3_cycles = arch.assembly.rdtsc() - tsc;
+
+    log.info("churn: {d} operations, buddy2 {d} cycles per operation, buddy3 {d} cycles per operation", .{
+        operations,
+        buddy2_cycles / operations,
+        buddy3_cycles / operations,
+    });
+}
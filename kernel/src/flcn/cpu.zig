@@ -2,6 +2,9 @@ const std = @import("std");
 const arch = @import("arch");
 const options = @import("options");
 const mem = @import("memory.zig");
+const numa = @import("numa.zig");
+const rcu = @import("rcu.zig");
+const SpinLock = @import("synchronization.zig").SpinLock;
 
 pub const CpuData = arch.cpu.CpuData;
 pub const CpuId = arch.cpu.CpuId;
@@ -13,8 +16,19 @@ pub var present_cpus_mask: std.bit_set.ArrayBitSet(u64, possible_cpus_count) = .
 pub var online_cpus_count: u16 = 1;
 pub var online_cpus_mask: std.bit_set.ArrayBitSet(u64, possible_cpus_count) = .initEmpty();
 
-pub var cpu_count: std.atomic.Value(CpuId) align(std.atomic.cache_line) = .init(0);
+// NOTE: cpus done with their bring up, the bsp included. the aps bump it last thing before idling
+pub var cpu_count: std.atomic.Value(CpuId) align(std.atomic.cache_line) = .init(1);
 pub var cpu_data: [possible_cpus_count]CpuData align(arch.constants.default_page_size) = undefined;
+var per_cpu_ready: bool = false;
+// NOTE: the aps come online in parallel
+var online_lock: SpinLock = .create();
+
+// NOTE: background work run by idle cpus. a hook returns true when it did some work, a cpu only
+// halts once a full pass over the hooks found nothing to do. hooks must keep their work short
+pub const IdleHook = *const fn () bool;
+const max_idle_hooks = 8;
+var idle_hooks: [max_idle_hooks]IdleHook = undefined;
+var idle_hooks_count: usize = 0;
 
 pub fn earlyInit() !void {
     possible_cpus_mask.setRangeValue(.{ .start = 0, .end = possible_cpus_count }, true);
@@ -22,13 +36,46 @@ pub fn earlyInit() !void {
     try arch.cpu.doCpuChecks();
 }
 
-pub fn initCore() !void {
-    const cpu_id = cpu_count.fetchAdd(1, .monotonic);
+// NOTE: the bsp is cpu 0, an ap gets its id from the boot stub. the cpu only goes online once its
+// per-cpu data and local apic are set up, cross-cpu work (shootdowns, grace periods) targets it from then on
+pub fn initCore(cpu_id: CpuId) !void {
     if (cpu_id >= possible_cpus_count or !possible_cpus_mask.isSet(cpu_id)) return error.ImpossibleCpu;
     if (!present_cpus_mask.isSet(cpu_id)) return error.CpuNotPresent;
 
-    setCpuOnline(cpu_id);
     try arch.cpu.initCore(cpu_id);
+    per_cpu_ready = true;
+    setCpuOnline(cpu_id);
+}
+
+pub fn currentId() CpuId {
+    // NOTE: until the bsp sets up its per-cpu data it is the only cpu running
+    if (!per_cpu_ready) {
+        @branchHint(.unlikely);
+        return 0;
+    }
+    return perCpu(.id);
+}
+
+pub fn registerIdleHook(hook: IdleHook) !void {
+    if (idle_hooks_count == max_idle_hooks) return error.TooManyIdleHooks;
+    idle_hooks[idle_hooks_count] = hook;
+    idle_hooks_count += 1;
+}
+
+pub fn idle() noreturn {
+    while (true) {
+        var worked = false;
+        rcu.quiescent();
+        for (idle_hooks[0..idle_hooks_count]) |hook| {
+            worked = hook() or worked;
+        }
+        if (!worked) {
+            // NOTE: interrupts stay off until the halt so a wake up can't slip in between
+            _ = arch.cpu.saveAndDisableInterrupts();
+            rcu.enterIdle();
+            arch.cpu.waitForInterrupt();
+        }
+    }
 }
 
 pub fn setCpuPresent(cpu_id: arch.cpu.CpuId, id_data: arch.cpu.IdentificationData) !void {
@@ -37,9 +84,12 @@ pub fn setCpuPresent(cpu_id: arch.cpu.CpuId, id_data: arch.cpu.IdentificationDat
     present_cpus_count = @intCast(present_cpus_mask.count());
 
     cpu_data[cpu_id] = .init(cpu_id, id_data);
+    numa.setCpuNode(cpu_id, numa.apicNode(id_data.apic_id));
 }
 
 pub fn setCpuOnline(cpu_id: arch.cpu.CpuId) void {
+    online_lock.lock();
+    defer online_lock.unlock();
     online_cpus_mask.set(cpu_id);
     online_cpus_count = @intCast(online_cpus_mask.count());
 }
@@ -47,3 +97,5 @@ pub fn setCpuOnline(cpu_id: arch.cpu.CpuId) void {
 pub const hasFeature = arch.cpu.hasFeature;
 pub const perCpu = arch.cpu.perCpu;
 pub const perCpuPtr = arch.cpu.perCpuPtr;
+pub const saveAndDisableInterrupts = arch.cpu.saveAndDisableInterrupts;
+pub const restoreInterrupts = arch.cpu.restoreInterrupts;
@@ -0,0 +1,260 @@
+const std = @import("std");
+const arch = @import("arch");
+const acpi = @import("acpi.zig");
+const acpi_events = @import("acpi/acpi_events.zig");
+const memory = @import("memory.zig");
+const timer = @import("timer.zig");
+const irq = @import("irq.zig");
+
+const vmem = memory.vmem;
+const log = std.log.scoped(.hpet);
+
+// NOTE: high precision event timer. a free running main counter (>= 10MHz, 64 bit on anything recent)
+// plus a few comparators that raise an interrupt when the counter reaches them.
+// * tick source between the pit and the tsc: no port io and no wrap around, but each read is an
+//   uncached mmio load. it's the calibration reference of the tsc when present
+// * comparator 0 in one-shot mode is a tick notifier, routed through one of the ioapic inputs the
+//   comparator advertises (legacy replacement is left off, gsi 2 stays with the pit)
+// * the comparator fires on an exact match, a deadline the counter already went past would only fire
+//   after a wrap around so programming checks the counter afterwards and pushes the deadline back
+const page_size = arch.constants.default_page_size;
+const max_period_fs = 100_000_000;
+const femtoseconds_per_second = 1_000_000_000_000_000;
+const notifier_comparator = 0;
+
+const Registers = enum(u16) {
+    capabilities = 0x000,
+    configuration = 0x010,
+    interrupt_status = 0x020,
+    main_counter = 0x0F0,
+};
+
+const Capabilities = packed struct(u64) {
+    rev_id: u8,
+    last_comparator: u5,
+    counter_64bit: bool,
+    _reserved0: u1,
+    legacy_replacement: bool,
+    vendor_id: u16,
+    period_fs: u32,
+};
+
+const Configuration = packed struct(u64) {
+    enabled: bool,
+    legacy_replacement: bool,
+    _reserved0: u62,
+};
+
+const ComparatorConfiguration = packed struct(u64) {
+    _reserved0: u1 = 0,
+    level_triggered: bool,
+    interrupt_enabled: bool,
+    periodic: bool,
+    periodic_capable: bool,
+    is_64bit: bool,
+    value_set: bool,
+    _reserved1: u1 = 0,
+    force_32bit: bool,
+    route: u5,
+    fsb_enabled: bool,
+    fsb_capable: bool,
+    _reserved2: u16 = 0,
+    route_capabilities: u32,
+};
+
+fn comparatorConfigurationOffset(comparator: u5) u16 {
+    return 0x100 + @as(u16, comparator) * 0x20;
+}
+
+fn comparatorValueOffset(comparator: u5) u16 {
+    return 0x108 + @as(u16, comparator) * 0x20;
+}
+
+var base: ?u64 = null;
+var counter_frequency: timer.TickFreq = 0;
+var counter_max: u64 = 0;
+var comparator_max: u64 = 0;
+var minimum_delta: u64 = 1;
+var irq_handle: ?irq.IrqHandle = null;
+
+const HpetIterationContext = struct {
+    pub fn acpiIterationContext(self: *const HpetIterationContext) acpi.AcpiTableIterationContext {
+        return .{
+            .ptr = self,
+            .cb = onCallback,
+        };
+    }
+
+    fn onCallback(_: *const anyopaque, args: *const anyopaque) !void {
+        const msg: *const acpi_events.HpetParsingEvent = @ptrCast(@alignCast(args));
+        log.debug("found hpet #{d} at 0x{x} (minimum tick {d})", .{ msg.hpet_number, msg.address, msg.minimum_tick });
+        if (base != null) return;
+        try map(msg.address);
+        minimum_delta = @max(msg.minimum_tick, 1);
+    }
+};
+
+// NOTE: needs the irq manager and the timer subsystem, runs before the tsc gets calibrated
+pub fn init() !void {
+    const hpetIterationContext = HpetIterationContext{};
+    acpi.iterateTable(.hpet, hpetIterationContext.acpiIterationContext()) catch |err| switch (err) {
+        error.TableNotFound => {
+            log.info("no HPET, keeping the current tick source", .{});
+            return;
+        },
+        else => return err,
+    };
+    if (base == null) return;
+
+    const capabilities: Capabilities = @bitCast(readRegister(@intFromEnum(Registers.capabilities)));
+    if (capabilities.period_fs == 0 or capabilities.period_fs > max_period_fs) {
+        log.warn("ignoring hpet with a bogus period ({d}fs)", .{capabilities.period_fs});
+        base = null;
+        return;
+    }
+    counter_frequency = femtoseconds_per_second / capabilities.period_fs;
+    counter_max = if (capabilities.counter_64bit) std.math.maxInt(u64) else std.math.maxInt(u32);
+
+    // NOTE: the counter is halted while the comparators get reset, it starts back from 0
+    var configuration: Configuration = @bitCast(readRegister(@intFromEnum(Registers.configuration)));
+    configuration.enabled = false;
+    configuration.legacy_replacement = false;
+    writeRegister(@intFromEnum(Registers.configuration), @bitCast(configuration));
+    for (0..@as(usize, capabilities.last_comparator) + 1) |comparator| {
+        const offset = comparatorConfigurationOffset(@intCast(comparator));
+        var comparator_config: ComparatorConfiguration = @bitCast(readRegister(offset));
+        comparator_config.interrupt_enabled = false;
+        comparator_config.periodic = false;
+        writeRegister(offset, @bitCast(comparator_config));
+    }
+    writeRegister(@intFromEnum(Registers.main_counter), 0);
+    configuration.enabled = true;
+    writeRegister(@intFromEnum(Registers.configuration), @bitCast(configuration));
+
+    log.info("hpet running at {d}Hz ({d} bit counter, {d} comparators)", .{
+        counter_frequency,
+        if (capabilities.counter_64bit) @as(u8, 64) else 32,
+        @as(u8, capabilities.last_comparator) + 1,
+    });
+    timer._registerTickSource(tickSource());
+    initNotifier() catch |err| log.warn("no hpet tick notifier: {t}", .{err});
+}
+
+pub fn isPresent() bool {
+    return base != null;
+}
+
+pub fn frequency() timer.TickFreq {
+    return counter_frequency;
+}
+
+pub fn readCounter() timer.TickCount {
+    return readRegister(@intFromEnum(Registers.main_counter)) & counter_max;
+}
+
+// NOTE: ticks between two counter reads, the counter wrapped at most once in between
+pub fn elapsed(from: timer.TickCount, to: timer.TickCount) timer.TickCount {
+    return (to -% from) & counter_max;
+}
+
+fn map(paddr: u64) !void {
+    const va = &memory.kernel_vmem;
+    const offset = paddr % page_size;
+    const vrange = try va.allocateRange(1, .{ .typ = .mmio });
+    errdefer va.freeRange(vrange, .{ .typ = .mmio }) catch {};
+    try va.mmap(
+        .{ .start = paddr - offset, .length = page_size, .typ = .acpi },
+        vrange,
+        vmem.DefaultFlags.extend(.{
+            .read_write = .read_write,
+            .cache_control = .uncacheable,
+        }),
+        .{ .max_page_size = .page },
+    );
+    base = vrange.start.toAddr() + offset;
+    log.debug("mapped hpet registers at 0x{x}", .{base.?});
+}
+
+fn readRegister(offset: u16) u64 {
+    const register: *volatile u64 = @ptrFromInt(base.? + offset);
+    return register.*;
+}
+
+fn writeRegister(offset: u16, value: u64) void {
+    const register: *volatile u64 = @ptrFromInt(base.? + offset);
+    register.* = value;
+}
+
+// NOTE: tries the inputs the comparator can drive from the top, the low ones are the isa irqs
+fn initNotifier() !void {
+    const offset = comparatorConfigurationOffset(notifier_comparator);
+    var comparator_config: ComparatorConfiguration = @bitCast(readRegister(offset));
+    comparator_max = if (comparator_config.is_64bit) counter_max else std.math.maxInt(u32);
+    var candidates = comparator_config.route_capabilities;
+    while (candidates != 0) {
+        const gsi: u5 = @intCast(31 - @clz(candidates));
+        candidates &= ~(@as(u32, 1) << gsi);
+        comparator_config.route = gsi;
+        comparator_config.level_triggered = false;
+        comparator_config.interrupt_enabled = true;
+        writeRegister(offset, @bitCast(comparator_config));
+        // NOTE: unsupported routes read back as something else
+        comparator_config = @bitCast(readRegister(offset));
+        if (comparator_config.route != gsi) continue;
+        irq_handle = irq.register(.{
+            .source = .{
+                .kind = .{ .ioapic = .{ .gsi = gsi } },
+            },
+            .config = .{ .masked = true },
+            .name = "HPET",
+            .route = .any,
+            .handler = .{ .handler_fn = timer.timerHandler },
+        }) catch |err| {
+            log.debug("hpet comparator can't use gsi {d}: {t}", .{ gsi, err });
+            continue;
+        };
+        log.info("hpet comparator {d} on gsi {d} (vector {d})", .{ notifier_comparator, gsi, irq_handle.?.vector });
+        timer._registerTickNotifier(tickNotifier());
+        return;
+    }
+    comparator_config.interrupt_enabled = false;
+    writeRegister(offset, @bitCast(comparator_config));
+    return error.NoUsableRoute;
+}
+
+fn programInterrupt(deadline: timer.Duration) !irq.IrqHandle {
+    const handle = irq_handle orelse return error.NoHpetNotifier;
+    const nanoseconds: u64 = @intCast(std.math.clamp(deadline.nanoseconds, 0, std.math.maxInt(u64)));
+    // NOTE: a deadline past half the comparator range fires early, the handler programs the rest
+    const wanted = @as(u128, nanoseconds) * counter_frequency / 1_000_000_000;
+    var delta: u64 = @intCast(std.math.clamp(wanted, minimum_delta, comparator_max / 2));
+    while (true) : (delta = @min(delta * 2, comparator_max / 2)) {
+        const now = readCounter();
+        writeRegister(comparatorValueOffset(notifier_comparator), (now +% delta) & comparator_max);
+        if (elapsed(now, readCounter()) < delta) return handle;
+    }
+}
+
+fn read() !timer.TickCount {
+    return readCounter();
+}
+
+fn freq() !timer.TickFreq {
+    return counter_frequency;
+}
+
+pub fn tickSource() timer.TickSource {
+    return .{
+        ._read = read,
+        ._freq = freq,
+        .max_counter = counter_max,
+        .priority = 1,
+    };
+}
+
+pub fn tickNotifier() timer.TickNotifier {
+    return .{
+        ._program_interrupt = programInterrupt,
+        .priority = 1,
+    };
+}
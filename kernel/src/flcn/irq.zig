@@ -17,12 +17,15 @@
 // * then once we send eoi we start handling the deferred work.
 // * maybe we have some budget that gets exhausted and forces us to move on
 
+const std = @import("std");
 pub const types = @import("irq/types.zig");
 pub const irq = @import("irq/irq.zig");
 const arch = @import("arch");
 const options = @import("options");
 const cpu = @import("cpu.zig");
 
+const log = std.log.scoped(.irq);
+
 pub const Polarity = types.Polarity;
 pub const TriggerMode = types.TriggerMode;
 pub const Config = irq.Config;
@@ -53,6 +56,13 @@ pub fn register(request: Request) !IrqHandle {
     return try manager.register(request);
 }
 
+// NOTE: takes a system exception over from the default handler installed by init()
+pub fn registerException(request: Request) !IrqHandle {
+    const vector = request.source.vector orelse return error.NoExceptionVector;
+    try manager.release(vector);
+    return try manager.registerReservedVector(request);
+}
+
 pub fn mask(handle: IrqHandle) !void {
     try manager.mask(handle.vector);
 }
@@ -73,7 +83,41 @@ pub fn dispatch(context: *Context) bool {
     return manager.dispatchContext(context);
 }
 
-pub fn metrics() Metrics {
+pub fn metrics() *const Metrics {
     if (!options.irq_metrics) @panic("IRQ metrics disabled");
-    return manager.metrics;
+    return &manager.metrics;
+}
+
+pub fn printMetrics() void {
+    if (!options.irq_metrics) return;
+    for (0..arch.irq.vector_count) |index| {
+        const vector: VectorId = @intCast(index);
+        const vector_metrics = manager.metrics.vectorMetrics(vector);
+        if (vector_metrics.interrupt_count == 0) continue;
+        var buffer: [512]u8 = undefined;
+        log.info("vector {d} ({s}): {d} interrupts, avg {d} / max {d} cycles, last on cpu {?d}{s}", .{
+            vector,
+            manager.records[vector].name,
+            vector_metrics.interrupt_count,
+            vector_metrics.total_handler_time / vector_metrics.interrupt_count,
+            vector_metrics.max_handler_time,
+            vector_metrics.last_cpu,
+            formatHistogram(&buffer, &vector_metrics.handler_times) catch "",
+        });
+    }
+}
+
+fn formatHistogram(buffer: []u8, counts: []const u32) ![]u8 {
+    var len: usize = 0;
+    for (counts, 0..) |count, bucket| {
+        if (count == 0) continue;
+        const last = bucket == counts.len - 1;
+        const written = try std.fmt.bufPrint(buffer[len..], " {s}2^{d}: {d}", .{
+            if (last) ">=" else "<",
+            bucket + irq.min_time_order - @intFromBool(last),
+            count,
+        });
+        len += written.len;
+    }
+    return buffer[0..len];
 }
@@ -3,6 +3,8 @@ const options = @import("options");
 const arch = @import("arch");
 const cpu = @import("../cpu.zig");
 const types = @import("types.zig");
+const rcu = @import("../rcu.zig");
+const SpinLock = @import("../synchronization.zig").SpinLock;
 
 pub const log = std.log.scoped(.irq);
 
@@ -22,12 +24,25 @@ pub const Source = struct {
 const Self = @This();
 pub const Manager = Self;
 
+// NOTE: handler times in tsc cycles, bucket i counts handlers that took less than 2^(i + min_time_order)
+// cycles, the last bucket everything slower
+pub const time_buckets = 16;
+pub const min_time_order = 6;
+pub const TimeHistogram = [time_buckets]u32;
+
+fn timeBucket(cycles: u64) usize {
+    const order = @as(usize, std.math.log2_int(u64, cycles | 1)) + 1;
+    return @min(order -| min_time_order, time_buckets - 1);
+}
+
+// NOTE: aggregated over every cpu when read, nothing here is written by the interrupt path
 pub const VectorMetrics = struct {
     interrupt_count: u64 = 0,
     total_handler_time: u64 = 0,
     max_handler_time: u64 = 0,
     last_handler_time: u64 = 0,
     last_cpu: ?cpu.CpuId = null,
+    handler_times: TimeHistogram = .{0} ** time_buckets,
 };
 
 pub const CpuVectorMetrics = struct {
@@ -35,30 +50,56 @@ pub const CpuVectorMetrics = struct {
     total_handler_time: u64 = 0,
     max_handler_time: u64 = 0,
     last_handler_time: u64 = 0,
+    last_timestamp: u64 = 0,
+    handler_times: TimeHistogram = .{0} ** time_buckets,
 };
 
+// NOTE: only written by its own cpu, cache line aligned so two cpus never share a line
 pub const CpuMetrics = struct {
-    total_interrupt_count: u64 = 0,
+    total_interrupt_count: u64 align(std.atomic.cache_line) = 0,
     total_handler_time: u64 = 0,
     max_handler_time: u64 = 0,
     per_vector: [arch.irq.vector_count]CpuVectorMetrics = [_]CpuVectorMetrics{.{}} ** arch.irq.vector_count,
 };
 
 pub const Metrics = struct {
-    per_vector: [arch.irq.vector_count]VectorMetrics = [_]VectorMetrics{.{}} ** arch.irq.vector_count,
     per_cpu: [cpu.possible_cpus_count]CpuMetrics = [_]CpuMetrics{.{}} ** cpu.possible_cpus_count,
 
-    pub fn recordInterrupt(self: *@This(), vector: VectorId) void {
+    pub fn recordInterrupt(self: *@This(), vector: VectorId, start: u64, end: u64) void {
         if (!options.irq_metrics) @panic("IRQ metrics disabled");
 
-        const cpu_id = cpu.perCpu(.id);
-        const cpu_metrics = &self.per_cpu[cpu_id];
-
-        self.per_vector[vector].interrupt_count += 1;
-        self.per_vector[vector].last_cpu = cpu_id;
-
+        const cycles = end -% start;
+        const cpu_metrics = &self.per_cpu[cpu.currentId()];
         cpu_metrics.total_interrupt_count += 1;
-        cpu_metrics.per_vector[vector].interrupt_count += 1;
+        cpu_metrics.total_handler_time += cycles;
+        cpu_metrics.max_handler_time = @max(cpu_metrics.max_handler_time, cycles);
+
+        const vector_metrics = &cpu_metrics.per_vector[vector];
+        vector_metrics.interrupt_count += 1;
+        vector_metrics.total_handler_time += cycles;
+        vector_metrics.max_handler_time = @max(vector_metrics.max_handler_time, cycles);
+        vector_metrics.last_handler_time = cycles;
+        vector_metrics.last_timestamp = end;
+        vector_metrics.handler_times[timeBucket(cycles)] += 1;
+    }
+
+    pub fn vectorMetrics(self: *const @This(), vector: VectorId) VectorMetrics {
+        var result: VectorMetrics = .{};
+        var last_timestamp: u64 = 0;
+        for (&self.per_cpu, 0..) |*cpu_metrics, cpu_id| {
+            const vector_metrics = &cpu_metrics.per_vector[vector];
+            if (vector_metrics.interrupt_count == 0) continue;
+            result.interrupt_count += vector_metrics.interrupt_count;
+            result.total_handler_time += vector_metrics.total_handler_time;
+            result.max_handler_time = @max(result.max_handler_time, vector_metrics.max_handler_time);
+            for (&result.handler_times, vector_metrics.handler_times) |*acc, count| acc.* += count;
+            if (vector_metrics.last_timestamp >= last_timestamp) {
+                last_timestamp = vector_metrics.last_timestamp;
+                result.last_handler_time = vector_metrics.last_handler_time;
+                result.last_cpu = @intCast(cpu_id);
+            }
+        }
+        return result;
     }
 };
 
@@ -180,8 +221,11 @@ const VectorAllocator = struct {
     }
 };
 
+// NOTE: dispatch reads the handler through an rcu pointer to the record's own storage, the storage
+// is only reused once a grace period has passed since the handler was unpublished
 const IrqRecord = struct {
-    handler: ?Handler = null,
+    handler: rcu.Pointer(Handler) = .{},
+    handler_storage: Handler = undefined,
     route: Route = .any,
     masked: bool = true,
     name: []const u8 = "",
@@ -198,6 +242,8 @@ backend: Backend,
 vector_allocator: VectorAllocator,
 records: [arch.irq.vector_count]IrqRecord,
 metrics: Metrics,
+// NOTE: serializes register/release, dispatch never takes it
+update_lock: SpinLock = .create(),
 
 pub fn init() !Self {
     return .{
@@ -228,15 +274,21 @@ fn registerWithOptions(self: *Self, irq_request: Request, register_options: Regi
         }
     };
     errdefer self.vector_allocator.free(vector) catch {};
-    if (self.records[vector].handler != null) return error.IrqHandlerAlreadyRegistered;
-    try self.backend.configureSource(irq_request.source.kind, irq_request.route, vector, irq_request.config.masked);
+    const record = &self.records[vector];
+    {
+        // NOTE: the check and the publication happen under the same lock, two cpus registering
+        // the same vector can't both see it free
+        self.update_lock.lock();
+        defer self.update_lock.unlock();
+        if (record.handler.read() != null) return error.IrqHandlerAlreadyRegistered;
+        try self.backend.configureSource(irq_request.source.kind, irq_request.route, vector, irq_request.config.masked);
+        record.handler_storage = irq_request.handler;
+        record.route = irq_request.route;
+        record.masked = irq_request.config.masked;
+        record.name = irq_request.name;
+        _ = record.handler.publish(&record.handler_storage);
+    }
     errdefer self.backend.releaseSource(vector) catch {};
-    self.records[vector] = .{
-        .handler = irq_request.handler,
-        .route = irq_request.route,
-        .masked = irq_request.config.masked,
-        .name = irq_request.name,
-    };
     if (options.irq_debug) self.vector_allocator.records[vector].debug.name = irq_request.name;
     if (!irq_request.config.masked) {
         try self.unmask(vector);
@@ -262,20 +314,28 @@ pub fn setRoute(self: *Self, vector: VectorId, route: Route) !void {
     self.records[vector].route = route;
 }
 
+// NOTE: once this returns no cpu runs the handler anymore, the caller can free its data
 pub fn release(self: *Self, vector: VectorId) !void {
-    self.records[vector] = .{};
+    const record = &self.records[vector];
+    {
+        self.update_lock.lock();
+        defer self.update_lock.unlock();
+        if (record.handler.publish(null) == null) return error.NoIrqHandler;
+    }
     try self.backend.releaseSource(vector);
+    rcu.synchronize();
+    record.* = .{};
     try self.vector_allocator.free(vector);
 }
 
 pub fn dispatchContext(self: *Self, context: *Context) bool {
     const vector: VectorId = std.math.cast(VectorId, context.vector) orelse return false;
-    var record = &self.records[vector];
-    if (record.handler) |*handler| {
-        handler.handle(context);
-        if (options.irq_metrics) self.metrics.recordInterrupt(vector);
-        self.backend.eoi(vector);
-        return true;
-    }
-    return false;
+    rcu.readLock();
+    defer rcu.readUnlock();
+    const handler = self.records[vector].handler.read() orelse return false;
+    const start = if (options.irq_metrics) arch.assembly.rdtsc() else 0;
+    handler.handle(context);
+    if (options.irq_metrics) self.metrics.recordInterrupt(vector, start, arch.assembly.rdtsc());
+    self.backend.eoi(vector);
+    return true;
 }
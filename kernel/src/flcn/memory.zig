@@ -1,6 +1,8 @@
 const std = @import("std");
 pub const pmem = @import("memory/pmem.zig");
 pub const vmem = @import("memory/vmem.zig");
+pub const pmem_stress = @import("memory/pmem_stress.zig");
+pub const lazy = @import("memory/lazy.zig");
 const Heap = @import("memory/heap.zig");
 const Cache = @import("memory/slab.zig");
 const arch = @import("arch");
@@ -38,6 +40,11 @@ pub fn lateInit() !void {
     try kernel_heap.init();
 }
 
+pub const ObjectCache = Heap.ObjectCache;
+pub fn createObjectCache(comptime T: type, name: []const u8, hooks: ObjectCache(T).Hooks) !*ObjectCache(T) {
+    return try kernel_heap.createObjectCache(T, name, hooks);
+}
+
 pub fn allocator() std.mem.Allocator {
     return kernel_heap.allocator();
 }
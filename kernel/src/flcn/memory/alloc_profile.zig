@@ -0,0 +1,184 @@
+const std = @import("std");
+const options = @import("options");
+const arch = @import("arch");
+const cpu = @import("../cpu.zig");
+const debug = @import("../debug.zig");
+const SpinLock = @import("../synchronization.zig").SpinLock;
+
+const log = std.log.scoped(.alloc_profile);
+
+// NOTE: per-cpu histograms of everything going through the heap allocator, always on.
+// sizes and lifetimes use log2 buckets, alignments one bucket per power of two
+const size_buckets = 24;
+const alignment_buckets = 13;
+const lifetime_buckets = 40;
+// NOTE: one allocation in every `lifetime_sample_rate` (per cpu) gets its lifetime measured. tracked
+// objects live in a small table indexed by address, so a free that isn't tracked costs a single load
+const lifetime_sample_rate = 64;
+const tracked_slots = 256;
+// NOTE: call sites are sampled with -Dalloc_sample_rate=N (one allocation in every N per cpu), 0 compiles it out
+const site_sample_rate = options.alloc_sample_rate;
+const max_sites = 64;
+const printed_sites = 16;
+
+const CpuProfile = struct {
+    allocations: u64 align(std.atomic.cache_line) = 0,
+    frees: u64 = 0,
+    allocated_bytes: u64 = 0,
+    freed_bytes: u64 = 0,
+    sizes: [size_buckets]u64 = .{0} ** size_buckets,
+    alignments: [alignment_buckets]u64 = .{0} ** alignment_buckets,
+    lifetimes: [lifetime_buckets]u64 = .{0} ** lifetime_buckets,
+};
+
+const TrackedObject = struct {
+    addr: std.atomic.Value(usize) = .init(0),
+    timestamp: u64 = 0,
+};
+
+const Site = struct {
+    ret_addr: usize = 0,
+    count: u64 = 0,
+    bytes: u64 = 0,
+};
+
+var cpu_profiles: [cpu.possible_cpus_count]CpuProfile = .{CpuProfile{}} ** cpu.possible_cpus_count;
+var tracked_objects: [tracked_slots]TrackedObject = .{TrackedObject{}} ** tracked_slots;
+var sites_lock: SpinLock = .create();
+var sites: [max_sites]Site = .{Site{}} ** max_sites;
+var dropped_sites: u64 = 0;
+
+fn log2Bucket(value: u64, comptime count: usize) usize {
+    return @min(std.math.log2_int_ceil(u64, @max(value, 1)), count - 1);
+}
+
+fn trackedSlot(addr: usize) *TrackedObject {
+    // NOTE: objects are at least 8 bytes apart, the low bits carry no information
+    return &tracked_objects[(addr >> 3) % tracked_slots];
+}
+
+pub fn recordAlloc(ptr: [*]u8, len: usize, alignment: std.mem.Alignment, ret_addr: usize) void {
+    const int_state = cpu.saveAndDisableInterrupts();
+    defer cpu.restoreInterrupts(int_state);
+    const profile = &cpu_profiles[cpu.currentId()];
+    profile.allocations += 1;
+    profile.allocated_bytes += len;
+    profile.sizes[log2Bucket(len, size_buckets)] += 1;
+    profile.alignments[@min(@intFromEnum(alignment), alignment_buckets - 1)] += 1;
+    if (profile.allocations % lifetime_sample_rate == 0) {
+        const slot = trackedSlot(@intFromPtr(ptr));
+        // NOTE: the slot keeps the object it already tracks, this sample is dropped
+        if (slot.addr.cmpxchgStrong(0, @intFromPtr(ptr), .monotonic, .monotonic) == null) {
+            slot.timestamp = arch.assembly.rdtsc();
+        }
+    }
+    if (site_sample_rate > 0 and profile.allocations % site_sample_rate == 0) {
+        @branchHint(.unlikely);
+        recordSite(ret_addr, len);
+    }
+}
+
+pub fn recordFree(ptr: [*]u8, len: usize) void {
+    const addr = @intFromPtr(ptr);
+    const slot = trackedSlot(addr);
+    const lifetime: ?u64 = blk: {
+        if (slot.addr.load(.monotonic) != addr) break :blk null;
+        const timestamp = slot.timestamp;
+        if (slot.addr.cmpxchgStrong(addr, 0, .monotonic, .monotonic) != null) break :blk null;
+        break :blk arch.assembly.rdtsc() -% timestamp;
+    };
+    const int_state = cpu.saveAndDisableInterrupts();
+    defer cpu.restoreInterrupts(int_state);
+    const profile = &cpu_profiles[cpu.currentId()];
+    profile.frees += 1;
+    profile.freed_bytes += len;
+    if (lifetime) |cycles| profile.lifetimes[log2Bucket(cycles, lifetime_buckets)] += 1;
+}
+
+// NOTE: an in place resize keeps the object, only the byte counts move
+pub fn recordResize(len: usize, new_len: usize) void {
+    const int_state = cpu.saveAndDisableInterrupts();
+    defer cpu.restoreInterrupts(int_state);
+    const profile = &cpu_profiles[cpu.currentId()];
+    if (new_len > len) {
+        profile.allocated_bytes += new_len - len;
+    } else {
+        profile.freed_bytes += len - new_len;
+    }
+}
+
+fn recordSite(ret_addr: usize, len: usize) void {
+    sites_lock.lock();
+    defer sites_lock.unlock();
+    var idx = (ret_addr >> 2) % max_sites;
+    for (0..max_sites) |_| {
+        const site = &sites[idx];
+        if (site.ret_addr == ret_addr or site.ret_addr == 0) {
+            site.ret_addr = ret_addr;
+            site.count += 1;
+            site.bytes += len;
+            return;
+        }
+        idx = (idx + 1) % max_sites;
+    }
+    dropped_sites += 1;
+}
+
+fn formatHistogram(buffer: []u8, name: []const u8, counts: []const u64) ![]u8 {
+    var written = try std.fmt.bufPrint(buffer, " {s}:", .{name});
+    var len = written.len;
+    for (counts, 0..) |count, bucket| {
+        if (count == 0) continue;
+        const last = bucket == counts.len - 1;
+        written = try std.fmt.bufPrint(buffer[len..], " {s}2^{d}: {d}", .{ if (last) ">" else "<=", if (last) bucket - 1 else bucket, count });
+        len += written.len;
+    }
+    return buffer[0..len];
+}
+
+pub fn printStats() void {
+    var total: CpuProfile = .{};
+    for (&cpu_profiles) |*profile| {
+        total.allocations += profile.allocations;
+        total.frees += profile.frees;
+        total.allocated_bytes += profile.allocated_bytes;
+        total.freed_bytes += profile.freed_bytes;
+        for (&total.sizes, profile.sizes) |*acc, count| acc.* += count;
+        for (&total.alignments, profile.alignments) |*acc, count| acc.* += count;
+        for (&total.lifetimes, profile.lifetimes) |*acc, count| acc.* += count;
+    }
+    log.info(" Allocations: {d}, frees: {d}, live: {d}B", .{
+        total.allocations,
+        total.frees,
+        total.allocated_bytes -| total.freed_bytes,
+    });
+    var buffer: [1024]u8 = undefined;
+    inline for (.{
+        .{ "Sizes (bytes)", &total.sizes },
+        .{ "Alignments (bytes)", &total.alignments },
+        .{ "Sampled lifetimes (tsc cycles)", &total.lifetimes },
+    }) |histogram| {
+        log.info("{s}", .{formatHistogram(&buffer, histogram[0], histogram[1]) catch "histogram too long"});
+    }
+    if (site_sample_rate == 0) return;
+
+    var sorted_sites: [max_sites]Site = undefined;
+    {
+        sites_lock.lock();
+        defer sites_lock.unlock();
+        sorted_sites = sites;
+    }
+    std.mem.sort(Site, &sorted_sites, {}, struct {
+        fn moreThan(_: void, lhs: Site, rhs: Site) bool {
+            return lhs.count > rhs.count;
+        }
+    }.moreThan);
+    log.info(" Hottest call sites (1 in {d} allocations sampled, {d} samples dropped):", .{ site_sample_rate, dropped_sites });
+    for (sorted_sites[0..printed_sites]) |site| {
+        if (site.count == 0) break;
+        var trace: debug.Stacktrace = .{};
+        trace.addresses[0] = site.ret_addr;
+        trace.index = 1;
+        log.info(" {d} samples, {d}B\n{f}", .{ site.count, site.bytes, trace });
+    }
+}
@@ -6,6 +6,9 @@ const vmem = @import("vmem.zig");
 const mem_allocator = @import("../allocator.zig");
 const DoubleLinkedList = @import("../list.zig").DoublyLinkedList;
 const Cache = @import("slab.zig");
+const zero_pool = @import("zero_pool.zig");
+const Vmalloc = @import("vmalloc.zig");
+const alloc_profile = @import("alloc_profile.zig");
 
 const log = std.log.scoped(.heap);
 var permanent_heap: [options.permanent_heap_size]u8 linksection(".kernel_heap") = undefined;
@@ -54,21 +57,27 @@ const SubHeap = struct {
 
 const SubHeapList = DoubleLinkedList(SubHeap, .prev, .next);
 const CacheManager = Cache.CacheManager(.{});
+const ObjectCacheList = DoubleLinkedList(Cache.ObjectCacheInfo, .prev, .next);
+pub const ObjectCache = Cache.ObjectCache;
 
 const Self = @This();
 virt_alloc: *vmem.VirtualAllocator,
 subheaps: SubHeapList = .{},
-allocated_pages: u64 = 0,
+// NOTE: subheap owning the pages of each kind, lets us route frees without asking every subheap
+page_owners: std.EnumArray(pmem.PageKind, ?*SubHeap) = .initFill(null),
+object_caches: ObjectCacheList = .{},
+// NOTE: pages handed out directly by allocatePages, updated by every cpu without a lock
+allocated_pages: std.atomic.Value(u64) = .init(0),
 total_memory: u64 = undefined,
 cache_manager: CacheManager,
-// TODO: build an allocation tracking that basically lets up build a histogram of sizes/alignments
-// so that we can think about optimizing our memory usage patterns
+vmalloc: Vmalloc,
 
 pub fn earlyInit() !Self {
     const perm_alloc = permanentAllocator();
     var heap: Self = .{
         .virt_alloc = undefined,
         .cache_manager = undefined,
+        .vmalloc = undefined,
     };
     const early_subheap = try perm_alloc.create(SubHeap);
     const subheap_allocator = try mem_allocator.adaptFixedBufferAllocator(perm_alloc, &_kernel_alloc);
@@ -88,6 +97,22 @@ pub fn init(self: *Self) !void {
     self.cache_manager = try .init(self.allocator(), self.pageAllocator());
     subheap.* = .init("slab allocator", self.cache_manager.subHeapAllocator());
     self.subheaps.append(subheap);
+    self.page_owners.set(.slab, subheap);
+    // NOTE: after the slabs, it takes whatever they can't serve
+    const vmalloc_subheap = try alloc.create(SubHeap);
+    self.vmalloc = .init(self.virt_alloc);
+    vmalloc_subheap.* = .init("vmalloc", self.vmalloc.subHeapAllocator());
+    self.subheaps.append(vmalloc_subheap);
+    self.page_owners.set(.vmalloc, vmalloc_subheap);
+    try zero_pool.init(self.virt_alloc);
+}
+
+// NOTE: object caches live for the lifetime of the kernel
+pub fn createObjectCache(self: *Self, comptime T: type, name: []const u8, hooks: ObjectCache(T).Hooks) !*ObjectCache(T) {
+    const object_cache = try permanentAllocator().create(ObjectCache(T));
+    object_cache.init(name, self.pageAllocator(), hooks);
+    self.object_caches.append(&object_cache.info);
+    return object_cache;
 }
 
 pub fn printMemoryStats(self: *Self) !void {
@@ -99,8 +124,9 @@ pub fn printMemoryStats(self: *Self) !void {
         @intFromPtr(Self._permanent_alloc.buffer.ptr) + Self._permanent_alloc.buffer.len,
         Self._permanent_alloc.end_index * 100 / Self._permanent_alloc.buffer.len,
     });
+    pmem.printNodeStats();
     const alloc = self.allocator();
-    const buffer = try alloc.alloc(u8, 2048);
+    const buffer = try alloc.alloc(u8, 4096);
     defer alloc.free(buffer);
     var iter = self.subheaps.iter();
     while (iter.next()) |subheap| {
@@ -111,6 +137,17 @@ pub fn printMemoryStats(self: *Self) !void {
         , .{ subheap.name, buffer });
         @memset(buffer, 0);
     }
+    log.info(
+        \\ {s}
+    , .{try zero_pool.memoryStats(buffer)});
+    alloc_profile.printStats();
+    var caches_iter = self.object_caches.iter();
+    while (caches_iter.next()) |object_cache| {
+        log.info(
+            \\ Object cache: {s}
+            \\ {s}
+        , .{ object_cache.name, try object_cache.memoryStats(buffer) });
+    }
 }
 
 // NOTE: allocatePages
@@ -118,9 +155,18 @@ pub fn printMemoryStats(self: *Self) !void {
 // NOTE: allocatePhysical
 // TODO: on top of allocatePages build a page_allocator (std.mem.Allocator)
 
-pub fn allocatePages(self: *Self, count: u64, args: struct { zero: bool = false, committed: bool = false }) ![*]align(arch.constants.default_page_size) u8 {
-    const pmem_range = try pmem.allocatePages(count, .{ .committed = args.committed });
-    self.allocated_pages += count;
+pub fn allocatePages(self: *Self, count: u64, args: struct { zero: bool = false, committed: bool = false, node: ?pmem.NodeId = null }) ![*]align(arch.constants.default_page_size) u8 {
+    // NOTE: single zeroed pages come pre-zeroed from the pool when it has some
+    if (args.zero and count == 1) {
+        if (zero_pool.take(args.node)) |paddr| {
+            // NOTE: pooled frames are already out of the uncommitted pages, the reservation isn't needed anymore
+            if (args.committed) pmem.uncommitPages(1);
+            _ = self.allocated_pages.fetchAdd(1, .monotonic);
+            return @ptrFromInt(self.virt_alloc.physToVirt(paddr).toAddr());
+        }
+    }
+    const pmem_range = try pmem.allocatePages(count, .{ .committed = args.committed, .node = args.node });
+    _ = self.allocated_pages.fetchAdd(count, .monotonic);
     const allocated_vaddr = self.virt_alloc.physToVirt(pmem_range.start);
     const allocated_range_addr: u64 = @bitCast(allocated_vaddr);
     var allocated_ptr: [*]align(arch.constants.default_page_size) u8 = @ptrFromInt(allocated_range_addr);
@@ -144,13 +190,29 @@ pub fn freePages(self: *Self, ptr: [*]align(arch.constants.default_page_size) u8
     }
     const vrange = vmem.VirtMemRange{ .start = @bitCast(@intFromPtr(ptr)), .length = count * arch.constants.default_page_size };
     const paddr = self.virt_alloc.virtToPhys(vrange.start);
+    var allocated = self.allocated_pages.load(.monotonic);
+    while (self.allocated_pages.cmpxchgWeak(allocated, allocated -| count, .monotonic, .monotonic)) |current| allocated = current;
+    // NOTE: single pages go back through the zero pool, they get zeroed when a cpu is idle
+    if (count == 1 and zero_pool.recycle(paddr)) return;
     pmem.freePages(.{ .start = paddr, .length = vrange.length, .typ = .free });
-    self.allocated_pages -|= count;
+}
+
+pub fn pageDescriptor(self: *Self, ptr: *const anyopaque) ?*pmem.PageDescriptor {
+    const addr = @intFromPtr(ptr);
+    // NOTE: vmalloc frames are found through the page tables
+    if (vmem.isVmallocAddress(addr)) {
+        return pmem.pageDescriptor(self.virt_alloc.translate(@bitCast(addr)) orelse return null);
+    }
+    // NOTE: only the direct mapping has page descriptors, the kernel image and the other
+    // windows above page_offset must not be taken for physical addresses
+    const page_offset = self.virt_alloc.impl.page_offset;
+    if (addr < page_offset or addr - page_offset >= pmem.describedMemoryEnd()) return null;
+    return pmem.pageDescriptor(self.virt_alloc.virtToPhys(@bitCast(addr)));
 }
 
 pub fn allocatedMemory(self: *Self) u64 {
     var acc: u64 = 0;
-    acc += self.allocated_pages * arch.constants.default_page_size;
+    acc += self.allocated_pages.load(.monotonic) * arch.constants.default_page_size;
     var iter = self.subheaps.iter();
     while (iter.next()) |subheap| {
         acc += subheap.allocatedMemory();
@@ -164,8 +226,8 @@ pub fn allocator(self: *Self) std.mem.Allocator {
         .vtable = &.{
             .alloc = _alloc,
             .free = _free,
-            .resize = std.mem.Allocator.noResize,
-            .remap = std.mem.Allocator.noRemap,
+            .resize = _resize,
+            .remap = _remap,
         },
     };
 }
@@ -176,6 +238,7 @@ pub fn pageAllocator(self: *Self) arch.memory.PageAllocator {
         .vtable = &.{
             .allocate = _allocPages,
             .free = _freePages,
+            .descriptor = _pageDescriptor,
         },
     };
 }
@@ -187,7 +250,9 @@ fn _alloc(ptr: *anyopaque, len: usize, alignment: std.mem.Alignment, ret_addr: u
         if (subheap.canAlloc(len, alignment)) {
             @branchHint(.likely);
             const subheap_alloc: std.mem.Allocator = subheap.allocator();
-            return subheap_alloc.rawAlloc(len, alignment, ret_addr);
+            const memory = subheap_alloc.rawAlloc(len, alignment, ret_addr) orelse return null;
+            alloc_profile.recordAlloc(memory, len, alignment, ret_addr);
+            return memory;
         }
     }
     log.err("could not allocate {d} bytes with alignment {d}", .{ len, alignment.toByteUnits() });
@@ -198,16 +263,54 @@ fn _alloc(ptr: *anyopaque, len: usize, alignment: std.mem.Alignment, ret_addr: u
 
 fn _free(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, ret_addr: usize) void {
     const self: *Self = @ptrCast(@alignCast(ptr));
+    const subheap = self.owningSubHeap(memory, alignment) orelse unreachable;
+    const subheap_alloc: std.mem.Allocator = subheap.allocator();
+    alloc_profile.recordFree(memory.ptr, memory.len);
+    subheap_alloc.rawFree(memory, alignment, ret_addr);
+}
+
+// NOTE: resize and remap stay within the subheap that owns the memory, moving to another
+// subheap is left to the caller (alloc + copy + free)
+fn _resize(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) bool {
+    const self: *Self = @ptrCast(@alignCast(ptr));
+    const subheap = self.owningSubHeap(memory, alignment) orelse unreachable;
+    const subheap_alloc: std.mem.Allocator = subheap.allocator();
+    if (!subheap_alloc.rawResize(memory, alignment, new_len, ret_addr)) return false;
+    alloc_profile.recordResize(memory.len, new_len);
+    return true;
+}
+
+fn _remap(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) ?[*]u8 {
+    const self: *Self = @ptrCast(@alignCast(ptr));
+    const subheap = self.owningSubHeap(memory, alignment) orelse unreachable;
+    const subheap_alloc: std.mem.Allocator = subheap.allocator();
+    const new_memory = subheap_alloc.rawRemap(memory, alignment, new_len, ret_addr) orelse return null;
+    // NOTE: an object that moved is profiled as freed and allocated again
+    if (new_memory == memory.ptr) {
+        alloc_profile.recordResize(memory.len, new_len);
+    } else {
+        alloc_profile.recordFree(memory.ptr, memory.len);
+        alloc_profile.recordAlloc(new_memory, new_len, alignment, ret_addr);
+    }
+    return new_memory;
+}
+
+fn owningSubHeap(self: *Self, memory: []u8, alignment: std.mem.Alignment) ?*SubHeap {
+    if (self.pageDescriptor(memory.ptr)) |descriptor| {
+        const owner = self.page_owners.get(descriptor.kind);
+        if (owner != null and owner.?.canFree(memory, alignment)) {
+            @branchHint(.likely);
+            return owner.?;
+        }
+    }
     var subheaps_iter = self.subheaps.iter();
     while (subheaps_iter.next()) |subheap| {
         if (subheap.canFree(memory, alignment)) {
             @branchHint(.likely);
-            const subheap_alloc: std.mem.Allocator = subheap.allocator();
-            subheap_alloc.rawFree(memory, alignment, ret_addr);
-            return;
+            return subheap;
         }
     }
-    unreachable;
+    return null;
 }
 
 fn _allocPages(ptr: *anyopaque, count: u64, args: arch.memory.PageAllocator.AllocateArgs) ![*]align(arch.constants.default_page_size) u8 {
@@ -222,6 +325,11 @@ fn _freePages(ptr: *anyopaque, memory: [*]align(arch.constants.default_page_size
     self.freePages(memory, count, .{ .poison = args.poison });
 }
 
+fn _pageDescriptor(ptr: *anyopaque, page: *const anyopaque) ?*pmem.PageDescriptor {
+    const self: *Self = @ptrCast(@alignCast(ptr));
+    return self.pageDescriptor(page);
+}
+
 test "Test subheap with fixed buffer allocator" {
     var buffer = [_]u8{0} ** 256;
     var fixed_buffer = std.heap.FixedBufferAllocator.init(&buffer);
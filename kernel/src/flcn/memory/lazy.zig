@@ -0,0 +1,158 @@
+const std = @import("std");
+const arch = @import("arch");
+const pmem = @import("pmem.zig");
+const vmem = @import("vmem.zig");
+const irq = @import("../irq.zig");
+const SpinLock = @import("../synchronization.zig").SpinLock;
+
+const log = std.log.scoped(.lazy);
+
+// NOTE: kernel ranges backed on first touch. reserving one takes virtual space from the vmalloc area and
+// commits its pages but maps nothing, the page fault handler maps a zeroed frame the first time a page
+// is touched. big sparse structures (per cpu buffers sized for max_cpu, hash tables) only take memory
+// for the pages actually used.
+// * the frames come out of the commitment so a fault never fails for lack of memory
+// * a lazy page must not be touched first while holding a memory lock (pmem, vmm or this module's),
+//   the fault handler takes them
+const page_size = arch.constants.default_page_size;
+const max_ranges = 64;
+const page_fault_vector = 14;
+const flags = vmem.DefaultFlags.extend(.{ .read_write = .read_write });
+
+// NOTE: #PF error code bits
+const fault_present: u64 = 1 << 0;
+const fault_user: u64 = 1 << 2;
+
+const LazyRange = struct {
+    start: u64,
+    count: u64,
+    // NOTE: pages backed so far, the rest is still committed and gets uncommitted on release
+    populated: u64 = 0,
+
+    fn contains(self: *const LazyRange, addr: u64) bool {
+        return addr >= self.start and addr < self.start + self.count * page_size;
+    }
+};
+
+pub const Stats = struct {
+    faults: std.atomic.Value(u64) = .init(0),
+    populated_pages: std.atomic.Value(u64) = .init(0),
+};
+
+var lock: SpinLock = .create();
+var ranges: [max_ranges]?LazyRange = .{null} ** max_ranges;
+var virt_alloc: ?*vmem.VirtualAllocator = null;
+pub var stats: Stats = .{};
+
+// NOTE: needs the irq manager, called once irq.init() installed the default exception handlers
+pub fn init(va: *vmem.VirtualAllocator) !void {
+    virt_alloc = va;
+    _ = try irq.registerException(.{
+        .source = .{
+            .domain = .system,
+            .vector = page_fault_vector,
+            .kind = .fixed,
+        },
+        .handler = .{ .handler_fn = handlePageFault },
+        .name = "#PF: Page fault",
+    });
+}
+
+pub fn reserve(count: u64) ![*]align(page_size) u8 {
+    const va = virt_alloc orelse return error.LazyRangesNotReady;
+    if (!pmem.commitPages(count)) return error.OutOfMemory;
+    errdefer pmem.uncommitPages(count);
+    const vrange = try va.allocateRange(count, .{ .typ = .vmalloc });
+    errdefer va.freeRange(vrange, .{ .typ = .vmalloc }) catch {};
+    const start = vrange.start.toAddr();
+
+    lock.lock();
+    defer lock.unlock();
+    for (&ranges) |*slot| {
+        if (slot.* != null) continue;
+        slot.* = .{ .start = start, .count = count };
+        log.debug("reserved lazy range 0x{x} ({d} pages)", .{ start, count });
+        return @ptrFromInt(start);
+    }
+    return error.TooManyLazyRanges;
+}
+
+pub fn release(ptr: [*]align(page_size) u8) void {
+    const va = virt_alloc orelse unreachable;
+    const range = blk: {
+        lock.lock();
+        defer lock.unlock();
+        const slot = findSlot(@intFromPtr(ptr)) orelse @panic("releasing an unknown lazy range");
+        const range = slot.*.?;
+        slot.* = null;
+        break :blk range;
+    };
+
+    // NOTE: the frames are chained through their first word, the range is unmapped with a single
+    // shootdown before any of them goes back to pmem
+    var frames: u64 = 0;
+    var head: pmem.PAddr = undefined;
+    var page: u64 = 0;
+    while (page < range.count) : (page += 1) {
+        const paddr = va.translate(@bitCast(range.start + page * page_size)) orelse continue;
+        frameLink(va, paddr).* = head;
+        head = paddr;
+        frames += 1;
+    }
+    va.munmap(.{ .start = @bitCast(range.start), .length = range.count * page_size });
+    for (0..frames) |_| {
+        const next = frameLink(va, head).*;
+        // NOTE: freed frames are uncommitted pages again, which returns the commitment of the populated pages
+        pmem.freePages(.{ .start = head, .length = page_size, .typ = .free });
+        head = next;
+    }
+    pmem.uncommitPages(range.count - range.populated);
+    va.freeRange(.{ .start = @bitCast(range.start), .length = range.count * page_size }, .{ .typ = .vmalloc }) catch |err| {
+        log.warn("leaked virtual range 0x{x} ({d} pages): {t}", .{ range.start, range.count, err });
+    };
+}
+
+fn frameLink(va: *vmem.VirtualAllocator, paddr: pmem.PAddr) *pmem.PAddr {
+    return @ptrFromInt(va.physToVirt(paddr).toAddr());
+}
+
+fn findSlot(addr: u64) ?*?LazyRange {
+    for (&ranges) |*slot| {
+        if (slot.*) |range| {
+            if (range.contains(addr)) return slot;
+        }
+    }
+    return null;
+}
+
+// NOTE: returns false when the fault isn't a first touch of a lazy page
+fn populate(fault_addr: u64) bool {
+    const va = virt_alloc orelse return false;
+    lock.lock();
+    defer lock.unlock();
+    const slot = findSlot(fault_addr) orelse return false;
+    const range = &slot.*.?;
+    const vaddr: vmem.VAddr = @bitCast(std.mem.alignBackward(u64, fault_addr, page_size));
+    // NOTE: another cpu touched the same page first
+    if (va.translate(vaddr) != null) return true;
+
+    const frame = pmem.allocatePages(1, .{ .committed = true }) catch return false;
+    const frame_ptr: [*]u8 = @ptrFromInt(va.physToVirt(frame.start).toAddr());
+    @memset(frame_ptr[0..page_size], 0);
+    va.mmap(frame, .{ .start = vaddr, .length = page_size }, flags, .{ .max_page_size = .page }) catch {
+        // NOTE: the page is still part of the range's commitment, take it back from the frame just freed
+        pmem.freePages(frame);
+        _ = pmem.commitPages(1);
+        return false;
+    };
+    range.populated += 1;
+    _ = stats.populated_pages.fetchAdd(1, .monotonic);
+    return true;
+}
+
+fn handlePageFault(context: *const irq.Context, _: ?*anyopaque) void {
+    const fault_addr = arch.registers.readCR(.cr2);
+    _ = stats.faults.fetchAdd(1, .monotonic);
+    if (context.error_code & (fault_present | fault_user) == 0 and populate(fault_addr)) return;
+    arch.interrupts.defaultExceptionIrqHandler(context, null);
+}
@@ -3,10 +3,14 @@ const options = @import("options");
 const arch = @import("arch");
 const BootInfo = @import("../bootinfo.zig").BootInfo;
 const DoublyLinkedList = @import("../list.zig").DoublyLinkedList;
-const SpinLock = @import("../synchronization.zig").SpinLock;
+const ListIterator = @import("../list.zig").Iterator;
+const McsLock = @import("../synchronization.zig").McsLock;
 const mem_allocator = @import("../allocator");
-const buddy2 = @import("../buddy2.zig");
+const buddy3 = @import("../buddy3.zig");
 const pmm = @import("../pmm.zig");
+const sizes = @import("sizes.zig");
+const cpu = @import("../cpu.zig");
+const numa = @import("../numa.zig");
 
 extern var bootinfo: BootInfo;
 var mmap_entries: []BootInfo.MmapEntry = undefined;
@@ -16,25 +20,77 @@ const Error = error{OutOfPhysMemory};
 
 pub const PAddr = arch.memory.PAddr;
 pub const PAddrSize = arch.memory.PAddrSize;
-const PageAllocator = buddy2.BuddyAllocator(.{ .min_size = arch.constants.default_page_size, .safety = false });
+const PageAllocator = buddy3.BuddyAllocator(.{ .min_size = arch.constants.default_page_size, .safety = false });
 pub const PhysicalMemoryManager = pmm.PhysicalMemoryManager;
 pub const PhysMemRange = pmm.PhysMemRange;
 pub const PhysRangeType = pmm.PhysRangeType;
+pub const PageDescriptor = pmm.PageDescriptor;
+pub const PageKind = pmm.PageKind;
+pub const NodeId = numa.NodeId;
 
 const PhysMemRangeListItem = pmm.PhysMemRangeListItem;
 const PhysMemRangeAllocator = pmm.PhysMemRangeAllocator(PageAllocator);
 const PhysMemRangeAllocatorList = pmm.PhysMemRangeAllocatorList(PageAllocator);
 
 var mm: PhysicalMemoryManager = undefined;
-var page_allocators: PhysMemRangeAllocatorList = .{};
+// NOTE: one list of buddy regions per numa node, regions never straddle a node boundary
+var page_allocators: [numa.max_nodes]PhysMemRangeAllocatorList = .{PhysMemRangeAllocatorList{}} ** numa.max_nodes;
+var node_stats: [numa.max_nodes]NodeStats = .{NodeStats{}} ** numa.max_nodes;
+
+const NodeStats = struct {
+    // NOTE: served by the preferred node / served by a fallback node
+    local_allocations: std.atomic.Value(u64) = .init(0),
+    remote_allocations: std.atomic.Value(u64) = .init(0),
+    // NOTE: frames moved from the buddies into the cpu caches / back from the cpu caches to the buddies
+    cpu_cache_refills: std.atomic.Value(u64) = .init(0),
+    cpu_cache_drains: std.atomic.Value(u64) = .init(0),
+};
 var alloc: std.mem.Allocator = undefined;
 
+// NOTE: page descriptors are stored in one array per large page sized section of physical memory,
+// so looking a page up is two loads. sections without usable memory have no array
+const page_section_shift = std.math.log2(arch.constants.large_page_size);
+const page_shift = std.math.log2(arch.constants.default_page_size);
+const pages_per_section = arch.constants.large_page_size / arch.constants.default_page_size;
+const section_descriptors_size = std.mem.alignForward(u64, pages_per_section * @sizeOf(PageDescriptor), arch.constants.default_page_size);
+// NOTE: sized from the memory map at init so every frame the buddies hand out has a descriptor
+var page_sections: []?[*]PageDescriptor = &.{};
+var direct_map_offset: u64 = undefined;
+
+// NOTE: per-cpu hot lists of small blocks (up to 2^cpu_cache_max_order pages) so the common
+// single page allocations don't take the global lock. an empty list is refilled with
+// `cpu_cache_batch` blocks, a list going over the high watermark gives its coldest
+// `cpu_cache_batch` blocks back to the buddies
+const cpu_cache_max_order = 3;
+const cpu_cache_high_watermark = 64;
+const cpu_cache_low_watermark = 0;
+const cpu_cache_batch = 16;
+const CpuFrameList = struct {
+    count: u32 = 0,
+    frames: [cpu_cache_high_watermark + 1]PAddr = undefined,
+
+    fn push(self: *CpuFrameList, frame: PAddr) void {
+        self.frames[self.count] = frame;
+        self.count += 1;
+    }
+
+    fn pop(self: *CpuFrameList) PAddr {
+        self.count -= 1;
+        return self.frames[self.count];
+    }
+};
+const CpuFrameCache = struct {
+    lists: [cpu_cache_max_order + 1]CpuFrameList align(std.atomic.cache_line) = .{CpuFrameList{}} ** (cpu_cache_max_order + 1),
+};
+var cpu_frame_caches: [cpu.possible_cpus_count]CpuFrameCache = .{CpuFrameCache{}} ** cpu.possible_cpus_count;
+
 pub fn init(a: std.mem.Allocator) !void {
     alloc = a;
     mm = .init();
 
-    mm.lock.lock();
-    defer mm.lock.unlock();
+    var lock_node: McsLock.Node = .{};
+    mm.lock.lock(&lock_node);
+    defer mm.lock.unlock(&lock_node);
 
     log.debug("bootinfo ptr: {*}, size: {d}", .{ &bootinfo, bootinfo.size });
     const mmaps: [*]BootInfo.MmapEntry = @ptrCast(&bootinfo.mmap);
@@ -48,9 +104,11 @@ pub fn init(a: std.mem.Allocator) !void {
     mmap_entries = mmaps[0..mmap_count];
 
     reclaimFreeableMemory();
+    direct_map_offset = try arch.memory.PageMapManager.readPageOffset();
     try initRanges();
+    try initPageDescriptors();
 
-    mm.uncommitted_pages_count = mm.free_pages_count;
+    mm.uncommitted_pages_count.store(mm.free_pages_count, .monotonic);
 }
 
 pub fn printRanges() void {
@@ -119,104 +177,327 @@ pub fn initRanges() !void {
         pages_count.* += @divExact(len, arch.constants.default_page_size);
 
         if (typ == .free) {
-            const phys_range_allocator = try alloc.create(PhysMemRangeAllocator);
-            phys_range_allocator.* = .{
-                .alloc = try .init(alloc, range.start, range.length),
-                .region = range_list_item,
-                .memory_start = range.start,
-                .memory_len = range.length,
-            };
-            page_allocators.append(phys_range_allocator);
+            var start = range.start;
+            const end = range.start + range.length;
+            while (start < end) {
+                const node_range = numa.memoryNode(start);
+                const piece_end = @min(end, std.mem.alignBackward(u64, node_range.end, arch.constants.default_page_size));
+                if (piece_end <= start) break;
+                const phys_range_allocator = try alloc.create(PhysMemRangeAllocator);
+                phys_range_allocator.* = .{
+                    // NOTE: the buddy keeps its free lists in the free pages, through the direct mapping
+                    .alloc = try .init(alloc, start, piece_end - start, direct_map_offset),
+                    .region = range_list_item,
+                    .memory_start = start,
+                    .memory_len = piece_end - start,
+                    .node = node_range.node,
+                };
+                page_allocators[node_range.node].append(phys_range_allocator);
+                start = piece_end;
+            }
         }
     }
 }
 
-pub fn totalMemory() u64 {
-    return mm.total_memory;
+fn allocatorsIterator() AllocatorsIterator {
+    return .{ .iter = page_allocators[0].iter() };
 }
 
-pub fn commitPages(count: PAddrSize) bool {
-    mm.lock.lock();
-    defer mm.lock.unlock();
+const AllocatorsIterator = struct {
+    node: numa.NodeId = 0,
+    iter: ListIterator(PhysMemRangeAllocator, .next),
+
+    fn next(self: *AllocatorsIterator) ?*PhysMemRangeAllocator {
+        while (true) {
+            if (self.iter.next()) |a| return a;
+            self.node += 1;
+            if (self.node >= numa.node_count) return null;
+            self.iter = page_allocators[self.node].iter();
+        }
+    }
+};
 
-    if (mm.uncommitted_pages_count < count) {
-        return false;
+fn initPageDescriptors() !void {
+    var sections_count: u64 = 0;
+    var allocators_iter = allocatorsIterator();
+    while (allocators_iter.next()) |a| {
+        sections_count = @max(sections_count, ((a.memory_start + a.memory_len - 1) >> page_section_shift) + 1);
+    }
+    // NOTE: the table grows with the machine, take it from the buddies rather than the fixed permanent heap
+    const table_size = std.mem.alignForward(u64, sections_count * @sizeOf(?[*]PageDescriptor), arch.constants.default_page_size);
+    const table_range = try allocateBootPages(table_size, 0);
+    const table: [*]?[*]PageDescriptor = @ptrFromInt(table_range.start + direct_map_offset);
+    page_sections = table[0..sections_count];
+    @memset(page_sections, null);
+
+    allocators_iter = allocatorsIterator();
+    while (allocators_iter.next()) |a| {
+        const first_section = a.memory_start >> page_section_shift;
+        const last_section = (a.memory_start + a.memory_len - 1) >> page_section_shift;
+        for (first_section..last_section + 1) |section| {
+            if (page_sections[section] != null) continue;
+            // NOTE: keep the descriptors on the node of the memory they describe when possible
+            const descriptors_range = try allocateBootPages(section_descriptors_size, a.node);
+            const descriptors: [*]PageDescriptor = @ptrFromInt(descriptors_range.start + direct_map_offset);
+            @memset(descriptors[0..pages_per_section], .{});
+            page_sections[section] = descriptors;
+        }
+    }
+}
+
+fn allocateBootPages(size: u64, preferred_node: numa.NodeId) !PhysMemRange {
+    const alignment: std.mem.Alignment = .fromByteUnits(arch.constants.default_page_size);
+    for (numa.fallbackOrder(preferred_node)) |node| {
+        var iter = page_allocators[node].iter();
+        while (iter.next()) |a| {
+            if (a.canAlloc(size, alignment)) {
+                const range = a.alloc.allocate(size, alignment, 0) catch return error.OutOfPhysMemory;
+                mm.free_pages_count -= @divExact(size, arch.constants.default_page_size);
+                return range;
+            }
+        }
     }
+    return error.OutOfPhysMemory;
+}
+
+pub fn pageDescriptor(paddr: PAddr) ?*PageDescriptor {
+    const section = paddr >> page_section_shift;
+    if (section >= page_sections.len) return null;
+    const descriptors = page_sections[section] orelse return null;
+    return &descriptors[(paddr >> page_shift) & (pages_per_section - 1)];
+}
+
+// NOTE: end of the physical memory that has page descriptors
+pub fn describedMemoryEnd() PAddr {
+    return page_sections.len << page_section_shift;
+}
 
-    mm.uncommitted_pages_count -= count;
-    mm.committed_pages_count += count;
+pub fn totalMemory() u64 {
+    return mm.total_memory;
+}
+
+pub fn commitPages(count: PAddrSize) bool {
+    if (!takePages(&mm.uncommitted_pages_count, count)) return false;
+    _ = mm.committed_pages_count.fetchAdd(count, .monotonic);
     return true;
 }
 
 pub fn uncommitPages(count: PAddrSize) void {
-    mm.lock.lock();
-    defer mm.lock.unlock();
-
-    if (mm.committed_pages_count < count) {
+    if (!takePages(&mm.committed_pages_count, count)) {
         log.warn("Could not uncommit {d} pages. Not enough committed pages", .{count});
         return;
     }
+    _ = mm.uncommitted_pages_count.fetchAdd(count, .monotonic);
+}
 
-    mm.committed_pages_count -= count;
-    mm.uncommitted_pages_count += count;
+// NOTE: uncommitted pages are the ones nobody holds or reserved, committed pages are reserved but not
+// allocated yet. allocating takes the pages out of one of them, freeing gives them back as uncommitted
+fn takePages(counter: *std.atomic.Value(usize), count: PAddrSize) bool {
+    var available = counter.load(.monotonic);
+    while (true) {
+        if (available < count) return false;
+        available = counter.cmpxchgWeak(available, available - count, .monotonic, .monotonic) orelse return true;
+    }
 }
 
-pub fn allocatePages(count: PAddrSize, args: struct { committed: bool = false }) Error!PhysMemRange {
-    // log.debug("allocating {d} pages", .{count});
-    mm.lock.lock();
-    defer mm.lock.unlock();
+fn pagesOrder(count: PAddrSize) u64 {
+    return std.math.log2_int_ceil(u64, @max(count, 1));
+}
 
-    if (args.committed) {
-        mm.committed_pages_count -= count;
-    } else {
-        mm.uncommitted_pages_count -= count;
+pub const AllocateArgs = struct {
+    committed: bool = false,
+    // NOTE: node to allocate from, defaults to the node of the current cpu. other nodes are
+    // tried by increasing distance when it runs out of memory
+    node: ?numa.NodeId = null,
+};
+
+pub fn allocatePages(count: PAddrSize, args: AllocateArgs) Error!PhysMemRange {
+    // log.debug("allocating {d} pages", .{count});
+    const counter = if (args.committed) &mm.committed_pages_count else &mm.uncommitted_pages_count;
+    if (!takePages(counter, count)) {
+        @branchHint(.unlikely);
+        if (args.committed) log.warn("Could not allocate {d} committed pages. Not enough committed pages", .{count});
+        return error.OutOfPhysMemory;
     }
+    errdefer _ = counter.fetchAdd(count, .monotonic);
 
     const requested_size = count * arch.constants.default_page_size;
+    const order = pagesOrder(count);
+    const local_node = numa.currentNode();
+    const node = args.node orelse local_node;
+    // NOTE: the cpu caches only hold local memory
+    if (order <= cpu_cache_max_order and node == local_node) {
+        @branchHint(.likely);
+        if (allocateFromCpuCache(order)) |start| {
+            return .{ .start = start, .length = requested_size, .typ = .free };
+        }
+    }
+
+    var lock_node: McsLock.Node = .{};
+    mm.lock.lock(&lock_node);
+    defer mm.lock.unlock(&lock_node);
+    return allocateLocked(requested_size, node);
+}
+
+fn allocateLocked(requested_size: u64, node: numa.NodeId) Error!PhysMemRange {
+    for (numa.fallbackOrder(node)) |fallback_node| {
+        if (allocateFromNode(requested_size, fallback_node)) |range| {
+            @branchHint(.likely);
+            if (fallback_node == node) {
+                _ = node_stats[node].local_allocations.fetchAdd(1, .monotonic);
+            } else {
+                _ = node_stats[node].remote_allocations.fetchAdd(1, .monotonic);
+            }
+            return range;
+        }
+    }
+    return error.OutOfPhysMemory;
+}
+
+fn allocateFromNode(requested_size: u64, node: numa.NodeId) ?PhysMemRange {
     const alignment: std.mem.Alignment = .fromByteUnits(arch.constants.default_page_size);
 
-    var allocators_iter = page_allocators.iter();
+    var allocators_iter = page_allocators[node].iter();
     while (allocators_iter.next()) |a| {
         if (a.canAlloc(requested_size, alignment)) {
             @branchHint(.likely);
             // log.debug("allocating from region {f}", .{a.region});
-            var allocator = a.alloc;
-            const range = allocator.allocate(requested_size, alignment, 0) catch return error.OutOfPhysMemory;
-            return range;
+            return a.alloc.allocate(requested_size, alignment, 0) catch null;
             // FIXME: we lost tracking free ranges/committed pages here
         }
     }
-    // return null;
-
-    // var iter = mm.free_ranges.iter();
-    // while (iter.next()) |list_item| {
-    //     if (list_item.range.length == requested_size) {
-    //         const range = list_item.range;
-    //         mm.free_ranges.remove(list_item);
-    //         alloc.destroy(list_item);
-    //         return range;
-    //     } else if (list_item.range.length > requested_size) {
-    //         const range = PhysMemRange{ .start = list_item.range.start, .length = requested_size, .typ = .used };
-    //         list_item.range.start += requested_size;
-    //         list_item.range.length -= requested_size;
-    //         return range;
-    //     }
-    // }
-    return error.OutOfPhysMemory;
+    return null;
 }
 
 pub fn freePages(range: PhysMemRange) void {
-    var allocators_iter = page_allocators.iter();
-    const memory_addr = range.start;
+    const count = std.math.divCeil(u64, range.length, arch.constants.default_page_size) catch unreachable;
+    _ = mm.uncommitted_pages_count.fetchAdd(count, .monotonic);
+    const order = pagesOrder(count);
+    if (order <= cpu_cache_max_order and isLocalMemory(range.start)) {
+        @branchHint(.likely);
+        freeToCpuCache(range.start, order);
+        return;
+    }
+
+    var lock_node: McsLock.Node = .{};
+    mm.lock.lock(&lock_node);
+    defer mm.lock.unlock(&lock_node);
+    freeLocked(range);
+}
+
+fn isLocalMemory(paddr: PAddr) bool {
+    if (numa.node_count == 1) return true;
+    return numa.memoryNode(paddr).node == numa.currentNode();
+}
+
+fn freeLocked(range: PhysMemRange) void {
+    const a = owningAllocator(range.start) orelse unreachable;
+    a.alloc.free(range, 0) catch @panic("Failed to free");
+}
+
+fn owningAllocator(memory_addr: PAddr) ?*PhysMemRangeAllocator {
+    var allocators_iter = page_allocators[numa.memoryNode(memory_addr).node].iter();
     while (allocators_iter.next()) |a| {
         const allocator_mem_start = a.memory_start;
         const allocator_mem_end = allocator_mem_start + a.memory_len;
-        if (allocator_mem_start <= memory_addr and memory_addr <= allocator_mem_end) {
+        if (allocator_mem_start <= memory_addr and memory_addr < allocator_mem_end) {
             @branchHint(.likely);
-            var allocator = a.alloc;
-            allocator.free(range, 0) catch @panic("Failed to free");
-            return;
+            return a;
+        }
+    }
+    return null;
+}
+
+pub fn printNodeStats() void {
+    var lock_node: McsLock.Node = .{};
+    mm.lock.lock(&lock_node);
+    defer mm.lock.unlock(&lock_node);
+    for (0..numa.node_count) |node| {
+        var free_memory: u64 = 0;
+        var iter = page_allocators[node].iter();
+        while (iter.next()) |a| free_memory += a.alloc.freeMemory();
+        log.info("node {d}: {d}KiB free, {d} local / {d} remote allocations, {d} frames refilled / {d} drained by the cpu caches", .{
+            node,
+            free_memory / sizes.kb,
+            node_stats[node].local_allocations.load(.monotonic),
+            node_stats[node].remote_allocations.load(.monotonic),
+            node_stats[node].cpu_cache_refills.load(.monotonic),
+            node_stats[node].cpu_cache_drains.load(.monotonic),
+        });
+    }
+    if (options.lock_stats) log.info("mm lock: {f}", .{mm.lock.stats});
+}
+
+fn allocateFromCpuCache(order: u64) ?PAddr {
+    const int_state = cpu.saveAndDisableInterrupts();
+    defer cpu.restoreInterrupts(int_state);
+    const list = &cpu_frame_caches[cpu.currentId()].lists[order];
+    if (list.count <= cpu_cache_low_watermark) {
+        @branchHint(.unlikely);
+        refillCpuFrameList(list, order);
+        if (list.count == 0) return null;
+    }
+    return list.pop();
+}
+
+fn freeToCpuCache(start: PAddr, order: u64) void {
+    const int_state = cpu.saveAndDisableInterrupts();
+    defer cpu.restoreInterrupts(int_state);
+    const list = &cpu_frame_caches[cpu.currentId()].lists[order];
+    list.push(start);
+    if (list.count > cpu_cache_high_watermark) {
+        @branchHint(.unlikely);
+        drainCpuFrameList(list, order);
+    }
+}
+
+fn refillCpuFrameList(list: *CpuFrameList, order: u64) void {
+    const block_size = @as(u64, arch.constants.default_page_size) << @intCast(order);
+    const node = numa.currentNode();
+    var lock_node: McsLock.Node = .{};
+    mm.lock.lock(&lock_node);
+    defer mm.lock.unlock(&lock_node);
+    var refilled: u64 = 0;
+    for (0..cpu_cache_batch) |_| {
+        const range = allocateFromNode(block_size, node) orelse break;
+        list.push(range.start);
+        refilled += 1;
+    }
+    // NOTE: the cpu caches only hold local memory, every refill is a local allocation
+    _ = node_stats[node].local_allocations.fetchAdd(refilled, .monotonic);
+    _ = node_stats[node].cpu_cache_refills.fetchAdd(refilled, .monotonic);
+}
+
+fn drainCpuFrameList(list: *CpuFrameList, order: u64) void {
+    const block_size = @as(u64, arch.constants.default_page_size) << @intCast(order);
+    {
+        var lock_node: McsLock.Node = .{};
+        mm.lock.lock(&lock_node);
+        defer mm.lock.unlock(&lock_node);
+        // NOTE: the bottom of the list holds the blocks that were freed the longest ago
+        for (list.frames[0..cpu_cache_batch]) |frame| {
+            freeLocked(.{ .start = frame, .length = block_size, .typ = .free });
+        }
+    }
+    _ = node_stats[numa.currentNode()].cpu_cache_drains.fetchAdd(cpu_cache_batch, .monotonic);
+    std.mem.copyForwards(PAddr, list.frames[0 .. list.count - cpu_cache_batch], list.frames[cpu_cache_batch..list.count]);
+    list.count -= cpu_cache_batch;
+}
+
+// NOTE: gives every block cached by the current cpu back to the buddies
+pub fn drainLocalCpuCache() void {
+    const int_state = cpu.saveAndDisableInterrupts();
+    defer cpu.restoreInterrupts(int_state);
+    var lock_node: McsLock.Node = .{};
+    mm.lock.lock(&lock_node);
+    defer mm.lock.unlock(&lock_node);
+    var drained: u64 = 0;
+    for (&cpu_frame_caches[cpu.currentId()].lists, 0..) |*list, order| {
+        const block_size = @as(u64, arch.constants.default_page_size) << @intCast(order);
+        drained += list.count;
+        while (list.count > 0) {
+            freeLocked(.{ .start = list.pop(), .length = block_size, .typ = .free });
         }
     }
-    unreachable;
+    _ = node_stats[numa.currentNode()].cpu_cache_drains.fetchAdd(drained, .monotonic);
 }
@@ -0,0 +1,108 @@
+const std = @import("std");
+const options = @import("options");
+const arch = @import("arch");
+const pmem = @import("pmem.zig");
+const memory = @import("../memory.zig");
+const cpu = @import("../cpu.zig");
+
+const log = std.log.scoped(.pmem_stress);
+
+// NOTE: boot time stress of the physical allocator, enabled with -Dpmem_stress_rounds=N. every online
+// cpu keeps a window of blocks of random sizes, stamps each block with its owner and checks the stamp
+// before giving it back, a block handed out to two cpus at once ends up with the wrong stamp.
+// orders go past the cpu caches so both the cached path and the mm lock get hammered
+const rounds = options.pmem_stress_rounds;
+const window = 32;
+const max_order = 5;
+
+const Block = struct {
+    range: pmem.PhysMemRange,
+    tag: u64,
+};
+
+const CpuResult = struct {
+    cycles: u64 align(std.atomic.cache_line) = 0,
+    allocations: u64 = 0,
+    failures: u64 = 0,
+    corruptions: u64 = 0,
+};
+
+var arrived: std.atomic.Value(u32) align(std.atomic.cache_line) = .init(0);
+var finished: std.atomic.Value(u32) align(std.atomic.cache_line) = .init(0);
+var aborted: std.atomic.Value(bool) = .init(false);
+var results: [cpu.possible_cpus_count]CpuResult = .{CpuResult{}} ** cpu.possible_cpus_count;
+
+fn stampOf(paddr: pmem.PAddr) *volatile u64 {
+    return @ptrFromInt(memory.kernel_vmem.physToVirt(paddr).toAddr());
+}
+
+fn release(block: Block, result: *CpuResult) void {
+    if (stampOf(block.range.start).* != block.tag) {
+        @branchHint(.cold);
+        result.corruptions += 1;
+    }
+    pmem.freePages(block.range);
+}
+
+// NOTE: called by every online cpu, they all start together and the last one to finish reports
+pub fn run() void {
+    if (rounds == 0) return;
+    const participants = cpu.online_cpus_count;
+    const cpu_id = cpu.currentId();
+    _ = arrived.fetchAdd(1, .acq_rel);
+    while (arrived.load(.acquire) < participants) {
+        if (aborted.load(.acquire)) return;
+        std.atomic.spinLoopHint();
+    }
+
+    const result = &results[cpu_id];
+    var prng: std.Random.DefaultPrng = .init(cpu_id);
+    const random = prng.random();
+    var held: [window]?Block = .{null} ** window;
+    const start = arch.assembly.rdtsc();
+    for (0..rounds) |round| {
+        const slot = &held[round % window];
+        if (slot.*) |block| release(block, result);
+        slot.* = null;
+        const count = @as(u64, 1) << random.uintAtMost(u6, max_order);
+        const range = pmem.allocatePages(count, .{}) catch {
+            result.failures += 1;
+            continue;
+        };
+        const tag = (@as(u64, cpu_id) << 48) | round;
+        stampOf(range.start).* = tag;
+        slot.* = .{ .range = range, .tag = tag };
+        result.allocations += 1;
+    }
+    for (held) |maybe_block| {
+        if (maybe_block) |block| release(block, result);
+    }
+    result.cycles = arch.assembly.rdtsc() - start;
+
+    if (finished.fetchAdd(1, .acq_rel) + 1 == participants) report(participants);
+}
+
+// NOTE: lets the cpus already waiting at the start go on without running, for when the cpu that
+// would complete the barrier never calls run() (e.g. the bsp after a failed bring-up)
+pub fn abort() void {
+    if (rounds == 0) return;
+    aborted.store(true, .release);
+}
+
+fn report(participants: u32) void {
+    var corruptions: u64 = 0;
+    for (results, 0..) |result, cpu_id| {
+        if (result.allocations == 0 and result.failures == 0) continue;
+        log.info("cpu {d}: {d} allocations, {d} failures, {d} corrupted blocks in {d} cycles", .{
+            cpu_id,
+            result.allocations,
+            result.failures,
+            result.corruptions,
+            result.cycles,
+        });
+        corruptions += result.corruptions;
+    }
+    pmem.printNodeStats();
+    if (corruptions > 0) @panic("pmem stress: a block was handed out twice");
+    log.info("pmem stress passed on {d} cpus ({d} rounds each)", .{ participants, rounds });
+}
@@ -3,11 +3,18 @@ const builtin = @import("builtin");
 const arch = @import("arch");
 const DoublyLinkedList = @import("../list.zig").DoublyLinkedList;
 const mem_allocator = @import("../allocator.zig");
+const cpu = @import("../cpu.zig");
+const SpinLock = @import("../synchronization.zig").SpinLock;
 
 const log = std.log.scoped(.slab);
 const CacheManagerConfig = struct {
     min_allocation_size: comptime_int = 4,
     max_allocation_size: comptime_int = 4096,
+    // NOTE: size classes between two powers of two, must be a power of two itself
+    classes_per_order: comptime_int = 4,
+    // NOTE: caches of objects bigger than this skip the per-cpu magazines
+    max_magazine_object_size: comptime_int = 1024,
+    magazine_size: comptime_int = 32,
 };
 const CacheConfig = struct {
     max_free: comptime_int = 2,
@@ -22,58 +29,231 @@ pub fn CacheManager(comptime config: CacheManagerConfig) type {
     // TODO: maybe when safety is enabled embed alloc/free after the allocator object
     // more memory waste but more safety
 
-    const min_cache_order = std.math.log2(config.min_allocation_size);
-    const max_cache_order = std.math.log2(config.max_allocation_size);
-    const num_caches = max_cache_order - min_cache_order + 1;
+    // NOTE: size classes grow linearly by `granule` up to granule * classes_per_order, then each power
+    // of two is split in classes_per_order steps: 8 16 24 32 | 40 48 56 64 | 80 96 112 128 | 160 ...
+    // so an allocation wastes at most 1/classes_per_order of its class instead of half of it
+    const granule = @max(config.min_allocation_size, @sizeOf(usize));
+    const granule_order = std.math.log2(granule);
+    const class_bits = std.math.log2(config.classes_per_order);
+    const linear_order = granule_order + class_bits;
+    const SizeClass = struct {
+        // NOTE: branch-free, the power of two group comes from the highest bit of len - 1 and
+        // the class inside the group from the class_bits bits below it
+        fn index(len: u64) u64 {
+            const n = len -| 1;
+            const order: u64 = std.math.log2_int(u64, n | (1 << linear_order));
+            return ((order - linear_order) << class_bits) + (n >> @intCast(order - class_bits));
+        }
+
+        fn size(idx: u64) Size {
+            const group = idx >> class_bits;
+            const step_count = (idx & (config.classes_per_order - 1)) + 1;
+            if (group == 0) return step_count << granule_order;
+            const base = @as(Size, 1) << @intCast(linear_order + group - 1);
+            return base + step_count * (base >> class_bits);
+        }
+    };
+    const num_caches = SizeClass.index(config.max_allocation_size) + 1;
+    const num_magazines = @min(num_caches, SizeClass.index(config.max_magazine_object_size) + 1);
+    const class_sizes = blk: {
+        var sizes: [num_caches]Size = undefined;
+        for (&sizes, 0..) |*size, idx| size.* = SizeClass.size(idx);
+        break :blk sizes;
+    };
+    const magazine_batch = config.magazine_size / 2;
+
+    // NOTE: a magazine is a per-cpu stack of objects borrowed from a cache.
+    // allocations and frees hit the magazine without touching the shared cache
+    // and only a refill/flush of `magazine_batch` objects takes the cache lock
+    const Magazine = struct {
+        count: u32 = 0,
+        objects: [config.magazine_size]usize = undefined,
+
+        fn isEmpty(self: *const @This()) bool {
+            return self.count == 0;
+        }
+
+        fn isFull(self: *const @This()) bool {
+            return self.count == config.magazine_size;
+        }
+
+        fn push(self: *@This(), object: usize) void {
+            self.objects[self.count] = object;
+            self.count += 1;
+        }
+
+        fn pop(self: *@This()) usize {
+            self.count -= 1;
+            return self.objects[self.count];
+        }
+    };
+
+    const CpuCache = struct {
+        magazines: [num_magazines]Magazine align(std.atomic.cache_line) = .{Magazine{}} ** num_magazines,
+        hits: u64 = 0,
+        misses: u64 = 0,
+        // NOTE: bytes asked for by the callers of each class, frees can happen on another cpu
+        // so a single cpu's count can go negative, only the sum means something
+        requested_bytes: [num_caches]i64 = .{0} ** num_caches,
+    };
+
     return struct {
         const Self = @This();
         alloc: std.mem.Allocator,
         caches: [num_caches]Cache(.{}),
         page_alloc: arch.memory.PageAllocator,
+        cpu_caches: *[cpu.possible_cpus_count]CpuCache,
 
         pub fn init(alloc: std.mem.Allocator, page_alloc: arch.memory.PageAllocator) !Self {
+            const cpu_caches = try alloc.create([cpu.possible_cpus_count]CpuCache);
+            @memset(cpu_caches, .{});
             var self: Self = .{
                 .alloc = alloc,
                 .page_alloc = page_alloc,
                 .caches = .{undefined} ** num_caches,
+                .cpu_caches = cpu_caches,
             };
 
-            inline for (&self.caches, 0..) |*c, i| {
-                const size = config.min_allocation_size * (1 << i);
-                c.* = .init(size, .fromByteUnits(size));
-            }
-
-            for (&self.caches) |*c| {
-                try c.create_slab(alloc, page_alloc);
+            inline for (&self.caches, class_sizes) |*c, size| {
+                // NOTE: the biggest power of two dividing the class size, every object of the slab is aligned to it
+                c.* = .init(size, .fromByteUnits(size & -%size));
             }
+            // NOTE: slabs keep a pointer to their cache so they are only created
+            // on first allocation, once the manager has reached its final address
 
             return self;
         }
 
         pub fn _alloc(ptr: *anyopaque, len: usize, alignment: std.mem.Alignment, _: usize) ?[*]u8 {
             const self: *Self = @ptrCast(@alignCast(ptr));
-            const aligned_size = alignment.forward(len);
-            var allocation_order = std.math.log2_int_ceil(u64, aligned_size);
-            // log.debug("allocation requested {d} bytes: computed order {d}", .{ len, allocation_order });
-            if (allocation_order < min_cache_order) {
-                allocation_order = min_cache_order;
-            }
-            const cache_idx = allocation_order - min_cache_order;
+            const cache_idx = cacheIndex(len, alignment);
             if (cache_idx >= num_caches) @panic("Allocation too large");
-            return self.caches[cache_idx].allocate(self.alloc, self.page_alloc) catch unreachable;
+            if (cache_idx < num_magazines) {
+                @branchHint(.likely);
+                const int_state = cpu.saveAndDisableInterrupts();
+                defer cpu.restoreInterrupts(int_state);
+                const cpu_cache = &self.cpu_caches[cpu.currentId()];
+                const magazine = &cpu_cache.magazines[cache_idx];
+                if (magazine.isEmpty()) {
+                    @branchHint(.unlikely);
+                    cpu_cache.misses += 1;
+                    self.refillMagazine(cache_idx, magazine) catch return null;
+                } else {
+                    cpu_cache.hits += 1;
+                }
+                cpu_cache.requested_bytes[cache_idx] += @intCast(len);
+                return @ptrFromInt(magazine.pop());
+            }
+            const object = blk: {
+                const cache = &self.caches[cache_idx];
+                cache.lock.lock();
+                defer cache.lock.unlock();
+                break :blk cache.allocate(self.page_alloc) catch return null;
+            };
+            self.trackRequested(cache_idx, @intCast(len));
+            return object;
         }
 
         pub fn _free(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, _: usize) void {
             const self: *Self = @ptrCast(@alignCast(ptr));
-            const aligned_size = alignment.forward(memory.len);
-            var allocation_order = std.math.log2_int_ceil(u64, aligned_size);
-            // log.debug("free requested for memory {*} {d} bytes: computed order {d}", .{ memory.ptr, memory.len, allocation_order });
-            if (allocation_order < min_cache_order) {
-                allocation_order = min_cache_order;
-            }
-            const cache_idx = allocation_order - min_cache_order;
+            const cache_idx = cacheIndex(memory.len, alignment);
             if (cache_idx >= num_caches) @panic("Unexistant cache");
-            self.caches[cache_idx].free(memory.ptr, self.alloc, self.page_alloc) catch unreachable;
+            if (cache_idx < num_magazines) {
+                @branchHint(.likely);
+                const int_state = cpu.saveAndDisableInterrupts();
+                defer cpu.restoreInterrupts(int_state);
+                const cpu_cache = &self.cpu_caches[cpu.currentId()];
+                const magazine = &cpu_cache.magazines[cache_idx];
+                if (magazine.isFull()) {
+                    @branchHint(.unlikely);
+                    self.flushMagazine(cache_idx, magazine);
+                }
+                cpu_cache.requested_bytes[cache_idx] -= @intCast(memory.len);
+                magazine.push(@intFromPtr(memory.ptr));
+                return;
+            }
+            self.trackRequested(cache_idx, -@as(i64, @intCast(memory.len)));
+            const cache = &self.caches[cache_idx];
+            cache.lock.lock();
+            defer cache.lock.unlock();
+            cache.free(memory.ptr, self.page_alloc) catch unreachable;
+        }
+
+        // NOTE: a length aligned to a power of two that is at least a class step is a class size itself,
+        // so objects of the class it maps to are aligned too
+        fn cacheIndex(len: usize, alignment: std.mem.Alignment) u64 {
+            return SizeClass.index(alignment.forward(len));
+        }
+
+        fn trackRequested(self: *Self, cache_idx: u64, delta: i64) void {
+            const int_state = cpu.saveAndDisableInterrupts();
+            defer cpu.restoreInterrupts(int_state);
+            self.cpu_caches[cpu.currentId()].requested_bytes[cache_idx] += delta;
+        }
+
+        // NOTE: objects are as big as their cache's size class, any length in that class fits in place.
+        // the requested bytes follow the new length so the fragmentation stats stay right
+        pub fn _resize(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, _: usize) bool {
+            const self: *Self = @ptrCast(@alignCast(ptr));
+            const cache_idx = cacheIndex(memory.len, alignment);
+            if (cache_idx >= num_caches or cacheIndex(new_len, alignment) != cache_idx) return false;
+            self.trackRequested(cache_idx, @as(i64, @intCast(new_len)) - @as(i64, @intCast(memory.len)));
+            return true;
+        }
+
+        pub fn _remap(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) ?[*]u8 {
+            return if (_resize(ptr, memory, alignment, new_len, ret_addr)) memory.ptr else null;
+        }
+
+        fn refillMagazine(self: *Self, cache_idx: usize, magazine: *Magazine) !void {
+            const cache = &self.caches[cache_idx];
+            cache.lock.lock();
+            defer cache.lock.unlock();
+            var i: usize = 0;
+            while (i < magazine_batch) : (i += 1) {
+                const object = cache.allocate(self.page_alloc) catch |err| {
+                    // NOTE: a partial refill is still good enough to serve this allocation
+                    if (!magazine.isEmpty()) return;
+                    return err;
+                };
+                magazine.push(@intFromPtr(object));
+            }
+        }
+
+        fn flushMagazine(self: *Self, cache_idx: usize, magazine: *Magazine) void {
+            const cache = &self.caches[cache_idx];
+            cache.lock.lock();
+            defer cache.lock.unlock();
+            var i: usize = 0;
+            while (i < magazine_batch) : (i += 1) {
+                const object: *anyopaque = @ptrFromInt(magazine.pop());
+                cache.free(object, self.page_alloc) catch unreachable;
+            }
+        }
+
+        // NOTE: returns every object cached in the current cpu's magazines to their caches
+        pub fn drainLocalMagazines(self: *Self) void {
+            const int_state = cpu.saveAndDisableInterrupts();
+            defer cpu.restoreInterrupts(int_state);
+            const cpu_cache = &self.cpu_caches[cpu.currentId()];
+            for (&cpu_cache.magazines, 0..) |*magazine, cache_idx| {
+                const cache = &self.caches[cache_idx];
+                cache.lock.lock();
+                defer cache.lock.unlock();
+                while (!magazine.isEmpty()) {
+                    const object: *anyopaque = @ptrFromInt(magazine.pop());
+                    cache.free(object, self.page_alloc) catch unreachable;
+                }
+            }
+        }
+
+        fn magazineObjects(self: *const Self, cache_idx: usize) u64 {
+            if (cache_idx >= num_magazines) return 0;
+            var acc: u64 = 0;
+            for (self.cpu_caches) |*cpu_cache| {
+                acc += cpu_cache.magazines[cache_idx].count;
+            }
+            return acc;
         }
 
         fn _allocator(ptr: *anyopaque) std.mem.Allocator {
@@ -83,36 +263,29 @@ pub fn CacheManager(comptime config: CacheManagerConfig) type {
                 .vtable = &.{
                     .alloc = _alloc,
                     .free = _free,
-                    .remap = std.mem.Allocator.noRemap,
-                    .resize = std.mem.Allocator.noResize,
+                    .remap = _remap,
+                    .resize = _resize,
                 },
             };
         }
 
-        fn _canAlloc(_: *anyopaque, _: u64, _: std.mem.Alignment) bool {
-            return true;
+        fn _canAlloc(_: *anyopaque, len: u64, alignment: std.mem.Alignment) bool {
+            return cacheIndex(len, alignment) < num_caches;
         }
 
-        fn _canFree(_: *anyopaque, _: []u8, _: std.mem.Alignment) bool {
-            // TODO: impl this
-            return true;
+        fn _canFree(ptr: *anyopaque, memory: []u8, _: std.mem.Alignment) bool {
+            const self: *const Self = @ptrCast(@alignCast(ptr));
+            const slab = slabFromPtr(self.page_alloc, memory.ptr) orelse return false;
+            const cache_addr = @intFromPtr(slab.cache);
+            const caches_addr = @intFromPtr(&self.caches);
+            return cache_addr >= caches_addr and cache_addr < caches_addr + @sizeOf(@TypeOf(self.caches));
         }
 
         fn _allocatedMemory(ptr: *anyopaque) u64 {
             const self: *const Self = @ptrCast(@alignCast(ptr));
             var acc: u64 = 0;
             for (&self.caches) |*cache| {
-                var objects_count: u64 = 0;
-                var iter = cache.full_list.iter();
-                while (iter.next()) |_| {
-                    objects_count += cache.objects_count;
-                }
-                iter = cache.partial_list.iter();
-                while (iter.next()) |s| {
-                    objects_count += s.inuse;
-                }
-
-                acc += objects_count * cache.size;
+                acc += cache.objectsInUse() * cache.size;
             }
             return acc;
         }
@@ -120,31 +293,54 @@ pub fn CacheManager(comptime config: CacheManagerConfig) type {
         fn _memoryStats(ptr: *anyopaque, buffer: []u8) !void {
             const self: *const Self = @ptrCast(@alignCast(ptr));
             var buf = buffer;
-            for (&self.caches) |*cache| {
-                var objects_count: u64 = 0;
-                var iter = cache.full_list.iter();
-                while (iter.next()) |_| {
-                    objects_count += cache.objects_count;
-                }
-                iter = cache.partial_list.iter();
-                while (iter.next()) |s| {
-                    objects_count += s.inuse;
-                }
+            var hits: u64 = 0;
+            var misses: u64 = 0;
+            var requested_bytes: [num_caches]i64 = .{0} ** num_caches;
+            for (self.cpu_caches) |*cpu_cache| {
+                hits += cpu_cache.hits;
+                misses += cpu_cache.misses;
+                for (&requested_bytes, cpu_cache.requested_bytes) |*acc, requested| acc.* += requested;
+            }
+            var written = try std.fmt.bufPrint(buf,
+                \\ Magazines: hits {d} misses {d}
+                \\
+            , .{ hits, misses });
+            buf = buf[written.len..];
+            var total_requested: u64 = 0;
+            var total_used: u64 = 0;
+            for (&self.caches, 0..) |*cache, cache_idx| {
+                const objects_count = cache.objectsInUse();
+                // NOTE: one line per class would not fit the buffer, classes that never had a slab are skipped
+                if (objects_count == 0 and cache.free_list_count == 0) continue;
+                const cached_count = self.magazineObjects(cache_idx);
+                const used = (objects_count - cached_count) * cache.size;
+                const requested: u64 = @intCast(@max(requested_bytes[cache_idx], 0));
+                total_requested += requested;
+                total_used += used;
 
-                const written = try std.fmt.bufPrint(buf,
-                    \\ Type: Slab {d}. Objects in use: {d}. Allocated size: {d}
-                    \\     Free Slabs {d} Pages per slab: {d} Objects per slab {d}
+                written = try std.fmt.bufPrint(buf,
+                    \\ Slab {d}: {d} in use (+{d} in magazines), {d}/{d}B requested, {d} free slabs of {d} pages/{d} objects
                     \\
                 , .{
                     cache.object_size,
-                    objects_count,
-                    objects_count * cache.size,
+                    objects_count - cached_count,
+                    cached_count,
+                    requested,
+                    used,
                     cache.free_list_count,
                     cache.page_count,
                     cache.objects_count,
                 });
                 buf = buf[written.len..];
             }
+            // NOTE: internal fragmentation, the bytes objects occupy but callers did not ask for
+            _ = try std.fmt.bufPrint(buf,
+                \\ Fragmentation: {d}B requested, {d}B used, {d}% wasted
+            , .{
+                total_requested,
+                total_used,
+                if (total_used == 0) 0 else (total_used -| total_requested) * 100 / total_used,
+            });
         }
 
         pub fn subHeapAllocator(self: *Self) mem_allocator.SubHeapAllocator {
@@ -159,6 +355,85 @@ pub fn CacheManager(comptime config: CacheManagerConfig) type {
         }
     };
 }
+// NOTE: type erased view of an ObjectCache, the heap keeps a list of these for its stats
+pub const ObjectCacheInfo = struct {
+    name: []const u8,
+    ptr: *anyopaque,
+    memory_stats: *const fn (*anyopaque, []u8) anyerror![]u8,
+    prev: ?*ObjectCacheInfo = null,
+    next: ?*ObjectCacheInfo = null,
+
+    pub fn memoryStats(self: *ObjectCacheInfo, buffer: []u8) ![]u8 {
+        return try self.memory_stats(self.ptr, buffer);
+    }
+};
+
+// NOTE: a named cache of objects of type T, sized and aligned exactly for T.
+// ctor runs on every create and dtor on every destroy, the first word of a free
+// object holds the slab freelist so objects don't keep their state while free
+pub fn ObjectCache(comptime T: type) type {
+    return struct {
+        const Self = @This();
+        pub const Hooks = struct {
+            ctor: ?*const fn (*T) void = null,
+            dtor: ?*const fn (*T) void = null,
+        };
+        cache: Cache(.{}),
+        page_alloc: arch.memory.PageAllocator,
+        hooks: Hooks,
+        info: ObjectCacheInfo,
+
+        // NOTE: the cache must not move after init, slabs point back to it
+        pub fn init(self: *Self, name: []const u8, page_alloc: arch.memory.PageAllocator, hooks: Hooks) void {
+            self.* = .{
+                .cache = .init(@sizeOf(T), .of(T)),
+                .page_alloc = page_alloc,
+                .hooks = hooks,
+                .info = .{
+                    .name = name,
+                    .ptr = self,
+                    .memory_stats = _memoryStats,
+                },
+            };
+        }
+
+        pub fn create(self: *Self) !*T {
+            const object: *T = blk: {
+                self.cache.lock.lock();
+                defer self.cache.lock.unlock();
+                break :blk @ptrCast(@alignCast(try self.cache.allocate(self.page_alloc)));
+            };
+            if (self.hooks.ctor) |ctor| ctor(object);
+            return object;
+        }
+
+        pub fn destroy(self: *Self, object: *T) void {
+            if (self.hooks.dtor) |dtor| dtor(object);
+            self.cache.lock.lock();
+            defer self.cache.lock.unlock();
+            self.cache.free(object, self.page_alloc) catch unreachable;
+        }
+
+        fn _memoryStats(ptr: *anyopaque, buffer: []u8) ![]u8 {
+            const self: *Self = @ptrCast(@alignCast(ptr));
+            const objects_count = self.cache.objectsInUse();
+            return try std.fmt.bufPrint(buffer,
+                \\ Type: {s} (size {d} align {d}). Objects in use: {d}. Allocated size: {d}
+                \\     Free Slabs {d} Pages per slab: {d} Objects per slab {d}
+            , .{
+                @typeName(T),
+                self.cache.size,
+                self.cache.alignment.toByteUnits(),
+                objects_count,
+                objects_count * self.cache.size,
+                self.cache.free_list_count,
+                self.cache.page_count,
+                self.cache.objects_count,
+            });
+        }
+    };
+}
+
 pub fn Cache(comptime config: CacheConfig) type {
     // has Slab creation data
     // has slab lists (free, partial, full)
@@ -175,13 +450,14 @@ pub fn Cache(comptime config: CacheConfig) type {
         free_list_count: u16,
         partial_list: SlabList,
         full_list: SlabList,
+        lock: SpinLock = .create(),
 
         pub fn init(size: u64, alignment: std.mem.Alignment) Self {
             const object_size = size;
             const required_alignment = alignment.max(.of(*anyopaque));
             const aligned_size = required_alignment.forward(object_size);
             const page_count = getPageCount(aligned_size, 4, 16);
-            const objects_count: Count = @intCast((@as(Count, @intCast(page_count)) * arch.constants.default_page_size) / aligned_size);
+            const objects_count: Count = @intCast((slabSize(page_count) - @sizeOf(Slab)) / aligned_size);
             return .{
                 .object_size = object_size,
                 .object_alignment = alignment,
@@ -197,11 +473,29 @@ pub fn Cache(comptime config: CacheConfig) type {
             };
         }
 
-        pub fn create_slab(self: *Self, alloc: std.mem.Allocator, page_alloc: arch.memory.PageAllocator) !void {
+        pub fn objectsInUse(self: *const Self) u64 {
+            var objects_count: u64 = 0;
+            var iter = self.full_list.iter();
+            while (iter.next()) |_| {
+                objects_count += self.objects_count;
+            }
+            iter = self.partial_list.iter();
+            while (iter.next()) |s| {
+                objects_count += s.inuse;
+            }
+            return objects_count;
+        }
+
+        pub fn create_slab(self: *Self, page_alloc: arch.memory.PageAllocator) !void {
             const pages = try page_alloc.allocate(self.page_count, .{});
+            errdefer page_alloc.free(pages, self.page_count, .{}) catch unreachable;
             // log.debug("[slab#{d}] Allocated {d} pages for slab {*}", .{ self.object_size, self.page_count, pages });
-            const slab = try alloc.create(Slab);
-            slab.* = .{ .pages = pages, .freelist = @intFromPtr(pages) };
+            const slab: *Slab = @ptrFromInt(@intFromPtr(pages) + slabSize(self.page_count) - @sizeOf(Slab));
+            slab.* = .{ .pages = pages, .freelist = @intFromPtr(pages), .cache = self };
+            for (0..self.page_count) |page_idx| {
+                const descriptor = page_alloc.descriptor(pages + page_idx * arch.constants.default_page_size) orelse return error.NoPageDescriptor;
+                descriptor.set(.slab, slab);
+            }
             self.free_list.append(slab);
             self.free_list_count += 1;
             var current = slab.freelist;
@@ -215,7 +509,7 @@ pub fn Cache(comptime config: CacheConfig) type {
             }
         }
 
-        fn cull_slabs(self: *Self, alloc: std.mem.Allocator, page_alloc: arch.memory.PageAllocator) !void {
+        fn cull_slabs(self: *Self, page_alloc: arch.memory.PageAllocator) !void {
             // TODO: some logic to better chose which slab to cull
             const slabs_to_cull = self.free_list_count - config.max_free;
             // log.info("culling {d} free slabs", .{slabs_to_cull});
@@ -223,15 +517,19 @@ pub fn Cache(comptime config: CacheConfig) type {
             while (i > 0) : (i -= 1) {
                 const free_slab = self.free_list.pop();
                 if (free_slab) |slab| {
-                    try page_alloc.free(slab.pages, self.page_count, .{});
-                    alloc.destroy(slab);
+                    const pages = slab.pages;
+                    for (0..self.page_count) |page_idx| {
+                        const descriptor = page_alloc.descriptor(pages + page_idx * arch.constants.default_page_size) orelse unreachable;
+                        descriptor.clear();
+                    }
+                    try page_alloc.free(pages, self.page_count, .{});
                 }
             }
             self.free_list_count -= slabs_to_cull;
             // log.info("culled {d} free slabs, remaining {d}", .{ slabs_to_cull, self.free_list_count });
         }
 
-        pub fn allocate(self: *Self, alloc: std.mem.Allocator, page_alloc: arch.memory.PageAllocator) ![*]u8 {
+        pub fn allocate(self: *Self, page_alloc: arch.memory.PageAllocator) ![*]u8 {
             const list: *SlabList = &self.partial_list;
             if (self.partial_list.isEmpty()) {
                 // log.debug("partial list empty", .{});
@@ -239,7 +537,7 @@ pub fn Cache(comptime config: CacheConfig) type {
                     @branchHint(.unlikely);
                     std.debug.assert(self.free_list_count == 0);
                     // log.debug("free list empty", .{});
-                    try self.create_slab(alloc, page_alloc);
+                    try self.create_slab(page_alloc);
                 }
                 const free_slab: ?*Slab = self.free_list.popFirst();
                 if (free_slab) |f| {
@@ -280,32 +578,19 @@ pub fn Cache(comptime config: CacheConfig) type {
             return error.Allocate;
         }
 
-        pub fn free(self: *Self, ptr: *anyopaque, alloc: std.mem.Allocator, page_alloc: arch.memory.PageAllocator) !void {
+        pub fn free(self: *Self, ptr: *anyopaque, page_alloc: arch.memory.PageAllocator) !void {
             const ptr_addr = @intFromPtr(ptr);
-            var slab: *Slab = blk: {
-                var iter = self.partial_list.iter();
-                while (iter.next()) |s| {
-                    // log.debug("free: checking partial slab {*} ({x})", .{ s.pages, self.page_count });
-                    if (ptr_addr >= @intFromPtr(s.pages) and ptr_addr <= @intFromPtr(s.pages) + arch.constants.default_page_size * @as(u64, @intCast(self.page_count))) {
-                        // log.debug("found slab to free from in partial list {*}", .{s.pages});
-                        break :blk s;
-                    }
-                }
-
-                iter = self.full_list.iter();
-                while (iter.next()) |s| {
-                    // log.debug("free: checking full slab {*}", .{s.pages});
-                    if (ptr_addr >= @intFromPtr(s.pages) and ptr_addr <= @intFromPtr(s.pages) + arch.constants.default_page_size * self.page_count) {
-                        // NOTE: premature, but we move this slab to the partial list because we are freeing from it
-                        self.full_list.remove(s);
-                        self.partial_list.append(s);
-                        // log.debug("free: partial list tail {*} {*}", .{ self.partial_list.tail.?.prev, self.partial_list.tail.?.next });
-                        // log.debug("found slab to free from in full list, moved to partial {*} {*}", .{ s, s.pages });
-                        break :blk s;
-                    }
-                }
-                unreachable;
-            };
+            const slab = slabFromPtr(page_alloc, ptr) orelse return error.NotASlabObject;
+            if (config.safety and slab.cache != @as(*anyopaque, self)) {
+                log.err("object {*} freed to the wrong cache (size {d})", .{ ptr, self.object_size });
+                return error.WrongCache;
+            }
+            if (slab.inuse == self.objects_count) {
+                // NOTE: premature, but we move this slab to the partial list because we are freeing from it
+                self.full_list.remove(slab);
+                self.partial_list.append(slab);
+                // log.debug("found slab to free from in full list, moved to partial {*} {*}", .{ slab, slab.pages });
+            }
             const old_freepointer = slab.freelist;
             const object: *u64 = @ptrCast(@alignCast(ptr));
             object.* = old_freepointer;
@@ -320,14 +605,26 @@ pub fn Cache(comptime config: CacheConfig) type {
                 self.free_list_count += 1;
             }
 
-            if (self.free_list_count > config.max_free) try self.cull_slabs(alloc, page_alloc);
+            if (self.free_list_count > config.max_free) try self.cull_slabs(page_alloc);
         }
     };
 }
 
+// NOTE: the slab header lives at the end of its own pages, the page descriptors point back to it
+fn slabFromPtr(page_alloc: arch.memory.PageAllocator, ptr: *const anyopaque) ?*Slab {
+    const descriptor = page_alloc.descriptor(ptr) orelse return null;
+    if (descriptor.kind != .slab) return null;
+    return @ptrFromInt(descriptor.owner);
+}
+
+fn slabSize(page_count: u16) u64 {
+    return @as(u64, page_count) * arch.constants.default_page_size;
+}
+
+// NOTE: the page allocator hands out power of two blocks, so only those page counts are considered
 fn getPageCount(size: Size, min_count: u64, max_waste_divisor: u16) u16 {
     var page_count: u64 = 1;
-    while (true) : (page_count += 1) {
+    while (true) : (page_count *= 2) {
         const slab_size = page_count * arch.constants.default_page_size - @sizeOf(Slab);
         if (slab_size < min_count * size) continue;
         const wasted_size = slab_size % size;
@@ -343,4 +640,5 @@ const Slab = extern struct {
     prev: ?*Self = null,
     next: ?*Self = null,
     pages: [*]align(arch.constants.default_page_size) u8,
+    cache: *anyopaque,
 };
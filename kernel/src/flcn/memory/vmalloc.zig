@@ -0,0 +1,267 @@
+const std = @import("std");
+const arch = @import("arch");
+const pmem = @import("pmem.zig");
+const vmem = @import("vmem.zig");
+const mem_allocator = @import("../allocator.zig");
+const SpinLock = @import("../synchronization.zig").SpinLock;
+
+const log = std.log.scoped(.vmalloc);
+
+// NOTE: allocations too big for the slabs. each one gets its own range of the vmalloc area backed by
+// frames that don't need to be contiguous. frames are allocated in blocks as big as the offset in the
+// range and the remaining length allow (up to a large page), so big ranges get mapped with large pages
+const page_size = arch.constants.default_page_size;
+const max_block_order = std.math.log2(arch.constants.large_page_size / page_size);
+// NOTE: freed ranges keep their frames and mappings for a while, an allocation of the same
+// page count takes one back without touching pmem or the page tables
+const cached_ranges_capacity = 8;
+// NOTE: blocks unmapped at once (one tlb flush) when a range is released
+const release_batch = 32;
+const flags = vmem.DefaultFlags.extend(.{ .read_write = .read_write });
+
+const CachedRange = struct {
+    start: u64,
+    count: u64,
+};
+
+const Self = @This();
+virt_alloc: *vmem.VirtualAllocator,
+lock: SpinLock = .create(),
+// NOTE: oldest first, the oldest range is released when a new one needs the slot
+cached_ranges: [cached_ranges_capacity]CachedRange = undefined,
+cached_count: usize = 0,
+// NOTE: updated outside the lock (populate and release run without it)
+allocated_pages: std.atomic.Value(u64) = .init(0),
+cache_hits: u64 = 0,
+cache_misses: u64 = 0,
+large_blocks: std.atomic.Value(u64) = .init(0),
+
+pub fn init(virt_alloc: *vmem.VirtualAllocator) Self {
+    return .{ .virt_alloc = virt_alloc };
+}
+
+fn pageCount(len: usize) u64 {
+    return std.math.divCeil(u64, @max(len, 1), page_size) catch unreachable;
+}
+
+fn rangeAlignment(count: u64, alignment: std.mem.Alignment) u64 {
+    const min_alignment: u64 = if (count * page_size >= arch.constants.large_page_size) arch.constants.large_page_size else page_size;
+    return @max(min_alignment, alignment.toByteUnits());
+}
+
+fn _alloc(ptr: *anyopaque, len: usize, alignment: std.mem.Alignment, _: usize) ?[*]u8 {
+    const self: *Self = @ptrCast(@alignCast(ptr));
+    const count = pageCount(len);
+    if (self.takeCachedRange(count, alignment)) |start| {
+        return @ptrFromInt(start);
+    }
+    const start = self.createRange(count, alignment) catch |err| {
+        log.err("could not allocate {d} pages: {t}", .{ count, err });
+        return null;
+    };
+    _ = self.allocated_pages.fetchAdd(count, .monotonic);
+    return @ptrFromInt(start);
+}
+
+fn _free(ptr: *anyopaque, memory: []u8, _: std.mem.Alignment, _: usize) void {
+    const self: *Self = @ptrCast(@alignCast(ptr));
+    const evicted = blk: {
+        self.lock.lock();
+        defer self.lock.unlock();
+        const range: CachedRange = .{ .start = @intFromPtr(memory.ptr), .count = pageCount(memory.len) };
+        _ = self.allocated_pages.fetchSub(range.count, .monotonic);
+        if (self.cached_count < cached_ranges_capacity) {
+            self.cached_ranges[self.cached_count] = range;
+            self.cached_count += 1;
+            return;
+        }
+        const oldest = self.cached_ranges[0];
+        std.mem.copyForwards(CachedRange, self.cached_ranges[0 .. cached_ranges_capacity - 1], self.cached_ranges[1..]);
+        self.cached_ranges[cached_ranges_capacity - 1] = range;
+        break :blk oldest;
+    };
+    self.destroyRange(evicted.start, evicted.count);
+}
+
+// NOTE: the range is already mapped with whole pages, any length with the same page count fits
+fn _resize(_: *anyopaque, memory: []u8, _: std.mem.Alignment, new_len: usize, _: usize) bool {
+    return pageCount(new_len) == pageCount(memory.len);
+}
+
+// NOTE: growing moves the frames to a bigger range by mapping them again, nothing is copied.
+// shrinking is left to the caller, the blocks can't always be split where the range would end
+fn _remap(ptr: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, _: usize) ?[*]u8 {
+    const self: *Self = @ptrCast(@alignCast(ptr));
+    const count = pageCount(memory.len);
+    const new_count = pageCount(new_len);
+    if (new_count == count) return memory.ptr;
+    if (new_count < count) return null;
+    const start = self.growRange(@intFromPtr(memory.ptr), count, new_count, alignment) catch |err| {
+        log.debug("could not grow range at {*} to {d} pages: {t}", .{ memory.ptr, new_count, err });
+        return null;
+    };
+    _ = self.allocated_pages.fetchAdd(new_count - count, .monotonic);
+    return @ptrFromInt(start);
+}
+
+fn takeCachedRange(self: *Self, count: u64, alignment: std.mem.Alignment) ?u64 {
+    self.lock.lock();
+    defer self.lock.unlock();
+    // NOTE: newest first, its frames are the most likely to still be cache hot
+    var idx = self.cached_count;
+    while (idx > 0) {
+        idx -= 1;
+        const range = self.cached_ranges[idx];
+        if (range.count != count or !alignment.check(range.start)) continue;
+        std.mem.copyForwards(CachedRange, self.cached_ranges[idx .. self.cached_count - 1], self.cached_ranges[idx + 1 .. self.cached_count]);
+        self.cached_count -= 1;
+        self.cache_hits += 1;
+        _ = self.allocated_pages.fetchAdd(count, .monotonic);
+        return range.start;
+    }
+    self.cache_misses += 1;
+    return null;
+}
+
+fn createRange(self: *Self, count: u64, alignment: std.mem.Alignment) !u64 {
+    const vrange = try self.virt_alloc.allocateRange(count, .{ .typ = .vmalloc, .alignment = rangeAlignment(count, alignment) });
+    errdefer self.virt_alloc.freeRange(vrange, .{ .typ = .vmalloc }) catch {};
+    const start = vrange.start.toAddr();
+    try self.populate(start, 0, count);
+    return start;
+}
+
+fn destroyRange(self: *Self, start: u64, count: u64) void {
+    self.release(start, 0, count);
+    self.virt_alloc.freeRange(.{ .start = @bitCast(start), .length = count * page_size }, .{ .typ = .vmalloc }) catch |err| {
+        log.warn("leaked virtual range 0x{x} ({d} pages): {t}", .{ start, count, err });
+    };
+}
+
+fn growRange(self: *Self, start: u64, count: u64, new_count: u64, alignment: std.mem.Alignment) !u64 {
+    const vrange = try self.virt_alloc.allocateRange(new_count, .{ .typ = .vmalloc, .alignment = rangeAlignment(new_count, alignment) });
+    errdefer self.virt_alloc.freeRange(vrange, .{ .typ = .vmalloc }) catch {};
+    const new_start = vrange.start.toAddr();
+
+    // NOTE: blocks keep their offset so they stay aligned to their size in the new range
+    var page: u64 = 0;
+    errdefer if (page > 0) self.virt_alloc.munmap(.{ .start = @bitCast(new_start), .length = page * page_size });
+    while (page < count) {
+        const block = self.blockAt(start, page);
+        try self.virt_alloc.mmap(block, .{ .start = @bitCast(new_start + page * page_size), .length = block.length }, flags, .{});
+        page += block.length / page_size;
+    }
+    try self.populate(new_start, count, new_count);
+
+    self.virt_alloc.munmap(.{ .start = @bitCast(start), .length = count * page_size });
+    self.virt_alloc.freeRange(.{ .start = @bitCast(start), .length = count * page_size }, .{ .typ = .vmalloc }) catch |err| {
+        log.warn("leaked virtual range 0x{x} ({d} pages): {t}", .{ start, count, err });
+    };
+    return new_start;
+}
+
+// NOTE: maps fresh frames at pages [from, to) of the range, on failure the pages mapped so far are released
+fn populate(self: *Self, start: u64, from: u64, to: u64) !void {
+    var page = from;
+    errdefer self.release(start, from, page);
+    while (page < to) {
+        const offset_order = if (page == 0) max_block_order else @min(@ctz(page), max_block_order);
+        var order: u6 = @intCast(@min(offset_order, std.math.log2_int(u64, to - page)));
+        const block = while (true) {
+            if (pmem.allocatePages(@as(u64, 1) << order, .{})) |range| break range else |_| {}
+            if (order == 0) return error.OutOfMemory;
+            order -= 1;
+        };
+        self.virt_alloc.mmap(block, .{ .start = @bitCast(start + page * page_size), .length = block.length }, flags, .{}) catch |err| {
+            pmem.freePages(block);
+            return err;
+        };
+        const descriptor = pmem.pageDescriptor(block.start) orelse @panic("vmalloc frame without a page descriptor");
+        descriptor.set(.vmalloc, self);
+        descriptor.order = order;
+        if (order == max_block_order) _ = self.large_blocks.fetchAdd(1, .monotonic);
+        page += @as(u64, 1) << order;
+    }
+}
+
+fn blockAt(self: *Self, start: u64, page: u64) pmem.PhysMemRange {
+    const paddr = self.virt_alloc.translate(@bitCast(start + page * page_size)) orelse @panic("vmalloc page is not mapped");
+    const descriptor = pmem.pageDescriptor(paddr) orelse @panic("vmalloc frame without a page descriptor");
+    return .{ .start = paddr, .length = @as(u64, page_size) << @intCast(descriptor.order), .typ = .free };
+}
+
+// NOTE: unmaps pages [from, to) of the range and frees their frames, `release_batch` blocks per tlb flush
+fn release(self: *Self, start: u64, from: u64, to: u64) void {
+    var page = from;
+    while (page < to) {
+        var blocks: [release_batch]pmem.PhysMemRange = undefined;
+        var count: usize = 0;
+        const batch_start = page;
+        while (page < to and count < release_batch) : (count += 1) {
+            blocks[count] = self.blockAt(start, page);
+            page += blocks[count].length / page_size;
+        }
+        self.virt_alloc.munmap(.{ .start = @bitCast(start + batch_start * page_size), .length = (page - batch_start) * page_size });
+        for (blocks[0..count]) |block| {
+            if (block.length == arch.constants.large_page_size) _ = self.large_blocks.fetchSub(1, .monotonic);
+            pmem.pageDescriptor(block.start).?.clear();
+            pmem.freePages(block);
+        }
+    }
+}
+
+fn _allocator(ptr: *anyopaque) std.mem.Allocator {
+    const self: *Self = @ptrCast(@alignCast(ptr));
+    return .{
+        .ptr = self,
+        .vtable = &.{
+            .alloc = _alloc,
+            .free = _free,
+            .remap = _remap,
+            .resize = _resize,
+        },
+    };
+}
+
+fn _canAlloc(_: *anyopaque, _: u64, _: std.mem.Alignment) bool {
+    return true;
+}
+
+fn _canFree(_: *anyopaque, memory: []u8, _: std.mem.Alignment) bool {
+    return vmem.isVmallocAddress(@intFromPtr(memory.ptr));
+}
+
+fn _allocatedMemory(ptr: *anyopaque) u64 {
+    const self: *const Self = @ptrCast(@alignCast(ptr));
+    return self.allocated_pages.load(.monotonic) * page_size;
+}
+
+fn _memoryStats(ptr: *anyopaque, buffer: []u8) !void {
+    const self: *Self = @ptrCast(@alignCast(ptr));
+    self.lock.lock();
+    defer self.lock.unlock();
+    var cached_pages: u64 = 0;
+    for (self.cached_ranges[0..self.cached_count]) |range| cached_pages += range.count;
+    _ = try std.fmt.bufPrint(buffer,
+        \\ Pages in use: {d}. Large page blocks: {d}
+        \\ Cached ranges: {d} ({d} pages). Hits/misses: {d}/{d}
+    , .{
+        self.allocated_pages.load(.monotonic),
+        self.large_blocks.load(.monotonic),
+        self.cached_count,
+        cached_pages,
+        self.cache_hits,
+        self.cache_misses,
+    });
+}
+
+pub fn subHeapAllocator(self: *Self) mem_allocator.SubHeapAllocator {
+    return .{
+        .ptr = self,
+        .can_alloc = _canAlloc,
+        .can_free = _canFree,
+        .allocated_memory = _allocatedMemory,
+        .memory_stats = _memoryStats,
+        .create_allocator = _allocator,
+    };
+}
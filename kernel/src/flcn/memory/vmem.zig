@@ -6,6 +6,7 @@ const sizes = @import("sizes.zig");
 const DoublyLinkedList = @import("../list.zig").DoublyLinkedList;
 const SpinLock = @import("../synchronization.zig").SpinLock;
 const vmem_manager = @import("../vmm.zig");
+const cpu = @import("../cpu.zig");
 
 // TODO: make this great again
 const pmem = @import("pmem.zig");
@@ -26,9 +27,17 @@ pub const MMapArgs = arch.memory.MMapArgs;
 const VirtualMemoryManager = arch.memory.VirtualMemoryManager;
 const PlatformVirtualMapper = arch.memory.PageMapManager;
 
+// NOTE: virtual space handed out by the vmalloc subheap, right after the direct mapping
+pub const vmalloc_start: VAddrSize = 0xffffc80000000000;
+pub const vmalloc_size = 1 * sizes.tb;
+const ptes_per_table = arch.constants.default_page_size / @sizeOf(PageMapping.Entry);
+const quickmap_flags = DefaultFlags.extend(.{ .read_write = .read_write });
+
 pub const VirtualAllocator = @This();
 impl: PlatformVirtualMapper,
 vmm: VirtualMemoryManager,
+// NOTE: the pte of each cpu's quickmap slot, seen through the quickmap_pte window
+quickmap_ptes: [options.max_cpu]*u64 = undefined,
 
 extern const _kernel_end: u64;
 extern const fb: u64;
@@ -43,7 +52,9 @@ pub fn init(alloc: Allocator, page_allocator: arch.memory.PageAllocator) !Virtua
     vmm.quickmap.length = quickmap_length;
 
     const stack_start = -%(@as(u64, arch.constants.core_stack_size) * options.max_cpu);
-    const quickmap_pt_entry_length = std.mem.alignForward(u64, options.max_cpu * @sizeOf(PageMapping.Entry), arch.constants.default_page_size);
+    // NOTE: the slots don't start at the top of their page table, the window covers every table they use
+    const quickmap_first_pte = (quickmap_start / arch.constants.default_page_size) % ptes_per_table;
+    const quickmap_pt_entry_length = std.mem.alignForward(u64, (quickmap_first_pte + options.max_cpu) * @sizeOf(PageMapping.Entry), arch.constants.default_page_size);
     const quickmap_pt_entry_start = stack_start - quickmap_pt_entry_length - 2 * arch.constants.default_page_size;
     vmm.quickmap_pt_entry.start = @bitCast(quickmap_pt_entry_start);
     vmm.quickmap_pt_entry.length = quickmap_pt_entry_length;
@@ -51,7 +62,8 @@ pub fn init(alloc: Allocator, page_allocator: arch.memory.PageAllocator) !Virtua
     // NOTE: kernel memory map (N = cpu count, padding = 2 pages)
     // HIGH_MEM_LIMIT    unused                   (0xffff800000000000 => 0xffff880000000000)
     // -120tb            direct mapping           (0xffff880000000000 => 0xffffc80000000000)
-    // -56tb             free area                (0xffffc80000000000 => 0xffffffff80000000)
+    // -56tb             vmalloc area             (0xffffc80000000000 => 0xffffc90000000000)
+    // -55tb             free area                (0xffffc90000000000 => 0xffffffff80000000)
     //  -2g              boot header structure    (0xffffffff80000000 => 0xffffffff80001000)
     //  -2g+1p           environment string       (0xffffffff80001000 => 0xffffffff80002000)
     //  -2g+2p           kernel code              (0xffffffff80002000 => 0xffffffff80002000 + kernel_size)
@@ -72,6 +84,7 @@ pub fn init(alloc: Allocator, page_allocator: arch.memory.PageAllocator) !Virtua
         defer vmm.lock.unlock();
         try vmm.registerRange(0xfffffffff0000000, 128 * sizes.mb, .{ .typ = .mmio });
         try vmm.registerRange(@intFromPtr(&fb), 64 * sizes.mb, .{ .typ = .framebuffer });
+        try vmm.registerRange(vmalloc_start, vmalloc_size, .{ .typ = .vmalloc });
         const kernel_range_start = 0xffffffff80000000;
         const kernel_end_addr = @intFromPtr(&_kernel_end);
         const kernel_range_size = kernel_end_addr -% kernel_range_start;
@@ -97,10 +110,84 @@ pub fn init(alloc: Allocator, page_allocator: arch.memory.PageAllocator) !Virtua
             .length = arch.constants.default_page_size,
         },
     );
+    try self.initQuickmap();
+    if (options.quickmap_selftest) try self.checkQuickmap();
 
     return self;
 }
 
+// NOTE: maps the page tables holding the quickmap ptes into the quickmap_pte window, so every slot's
+// pte sits at a fixed address and kmapLocal only has to write it. the bootloader already maps the window
+// and points every slot at a placeholder frame, the slots are cleared here
+fn initQuickmap(self: *VirtualAllocator) !void {
+    const page_size = arch.constants.default_page_size;
+    const quickmap_start: VAddrSize = @bitCast(self.vmm.quickmap.start);
+    const window_start: VAddrSize = @bitCast(self.vmm.quickmap_pt_entry.start);
+    const first_pte = (quickmap_start / page_size) % ptes_per_table;
+    for (&self.quickmap_ptes, 0..) |*slot_pte, slot| {
+        const pte = try self.impl.locatePageEntry(@bitCast(quickmap_start + slot * page_size));
+        const pte_index = first_pte + slot;
+        if (slot == 0 or pte_index % ptes_per_table == 0) {
+            const table_paddr = self.virtToPhys(@bitCast(std.mem.alignBackward(u64, @intFromPtr(pte), page_size)));
+            try self.mmap(
+                .{ .start = table_paddr, .length = page_size, .typ = .free },
+                .{ .start = @bitCast(window_start + (pte_index / ptes_per_table) * page_size), .length = page_size },
+                quickmap_flags,
+                .{ .max_page_size = .page, .remap = true },
+            );
+        }
+        slot_pte.* = @ptrFromInt(window_start + pte_index * @sizeOf(PageMapping.Entry));
+        const entry: *volatile u64 = slot_pte.*;
+        entry.* = 0;
+        arch.assembly.invalidateVirtualAddress(quickmap_start + slot * page_size);
+    }
+}
+
+// NOTE: only runs with -Dquickmap_selftest=true, goes through a slot once at boot. a frame seen
+// through the quickmap has to match the direct mapping
+fn checkQuickmap(self: *VirtualAllocator) !void {
+    const frame = try pmem.allocatePages(1, .{});
+    defer pmem.freePages(frame);
+    const direct: *volatile u64 = @ptrFromInt(self.physToVirt(frame.start).toAddr());
+    direct.* = 0x0123456789abcdef;
+    const mapping = self.kmapLocal(frame.start);
+    const quick: *volatile u64 = @ptrCast(mapping.ptr);
+    const seen = quick.*;
+    quick.* = 0xfedcba9876543210;
+    self.kunmapLocal(mapping);
+    if (seen != 0x0123456789abcdef or direct.* != 0xfedcba9876543210) {
+        log.err("quickmap slot doesn't alias the direct mapping (read 0x{x}, wrote back 0x{x})", .{ seen, direct.* });
+        return error.QuickmapMismatch;
+    }
+}
+
+pub const LocalMapping = struct {
+    ptr: [*]align(arch.constants.default_page_size) u8,
+    int_state: bool,
+};
+
+// NOTE: maps a frame at the current cpu's quickmap slot until kunmapLocal, without going through
+// mmap and without a shootdown. interrupts stay disabled in between since the slot belongs to the
+// cpu, local mappings don't nest
+pub fn kmapLocal(self: *VirtualAllocator, paddr: pmem.PAddr) LocalMapping {
+    const int_state = cpu.saveAndDisableInterrupts();
+    const slot = cpu.currentId();
+    const pte: *volatile u64 = self.quickmap_ptes[slot];
+    if (options.safety and pte.* != 0) @panic("quickmap slot already in use");
+    // NOTE: the slot is left unmapped between uses (initQuickmap and kunmapLocal invalidate it) and not
+    // present entries are never cached, so there is nothing to invalidate here
+    pte.* = PlatformVirtualMapper.pageEntry(paddr, quickmap_flags);
+    const vaddr = @as(VAddrSize, @bitCast(self.vmm.quickmap.start)) + slot * arch.constants.default_page_size;
+    return .{ .ptr = @ptrFromInt(vaddr), .int_state = int_state };
+}
+
+pub fn kunmapLocal(self: *VirtualAllocator, mapping: LocalMapping) void {
+    const pte: *volatile u64 = self.quickmap_ptes[cpu.currentId()];
+    pte.* = 0;
+    arch.assembly.invalidateVirtualAddress(@intFromPtr(mapping.ptr));
+    cpu.restoreInterrupts(mapping.int_state);
+}
+
 pub fn printRanges(self: *const @This()) void {
     for (self.vmm.memory_map, 0..) |range_list, typ_idx| {
         const typ: VirtRangeType = @enumFromInt(typ_idx);
@@ -117,21 +204,28 @@ pub fn reserveRange(self: *VirtualAllocator, start: u64, length: u64, typ: VirtR
     try self.vmm.reserveRange(start, length, .free, typ);
 }
 
-const VirtualAllocArgs = struct { typ: ?VirtRangeType = null };
+const VirtualAllocArgs = struct {
+    typ: ?VirtRangeType = null,
+    alignment: u64 = arch.constants.default_page_size,
+};
 
 pub fn allocateRange(self: *VirtualAllocator, count: u64, args: VirtualAllocArgs) !VirtMemRange {
     const length = count * arch.constants.default_page_size;
-    return try self.vmm.allocateRange(length, .{ .typ = args.typ });
+    self.vmm.lock.lock();
+    defer self.vmm.lock.unlock();
+    return try self.vmm.allocateRange(length, .{ .typ = args.typ, .alignment = args.alignment });
 }
 
-pub fn freeRange(self: *VirtualAllocator, vrange: VirtMemRange, args: VirtualAllocArgs) void {
-    _ = self; // autofix
-    _ = vrange; // autofix
-    _ = args; // autofix
-    // the only cases we should have here are:
-    // - we create a new range
-    // - we extend an existing range (change start or length but not both)
-    // all other cases should be errors
+// NOTE: gives the range back to the pool it was allocated from (args.typ), merging it with its neighbours
+pub fn freeRange(self: *VirtualAllocator, vrange: VirtMemRange, args: VirtualAllocArgs) !void {
+    log.debug("freeing vrange {f}", .{vrange});
+    self.vmm.lock.lock();
+    defer self.vmm.lock.unlock();
+    try self.vmm.registerRange(@bitCast(vrange.start), vrange.length, .{ .typ = args.typ });
+}
+
+pub fn isVmallocAddress(addr: VAddrSize) bool {
+    return addr >= vmalloc_start and addr < vmalloc_start + vmalloc_size;
 }
 
 pub fn mmap(self: *VirtualAllocator, prange: pmem.PhysMemRange, vrange: VirtMemRange, flags: MmapFlags, args: MMapArgs) !void {
@@ -154,6 +248,10 @@ pub fn mremap2(self: *VirtualAllocator, vrange: VirtMemRange, flags: MmapFlags)
     try self.impl.remap(vrange, flags);
 }
 
+pub fn translate(self: *VirtualAllocator, vaddr: VAddr) ?arch.memory.PAddr {
+    return self.impl.translate(vaddr);
+}
+
 pub fn virtToPhys(self: *VirtualAllocator, vaddr: VAddr) arch.memory.PAddr {
     return self.impl.virtToPhys(vaddr);
 }
@@ -0,0 +1,135 @@
+const std = @import("std");
+const arch = @import("arch");
+const pmem = @import("pmem.zig");
+const vmem = @import("vmem.zig");
+const cpu = @import("../cpu.zig");
+const numa = @import("../numa.zig");
+const SpinLock = @import("../synchronization.zig").SpinLock;
+
+const log = std.log.scoped(.zero_pool);
+
+// NOTE: frames zeroed ahead of time by idle cpus so zeroed single page allocations skip the memset.
+// freed frames are parked on the dirty list and zeroed lazily, when it overflows they go back to pmem
+const zeroed_capacity = 256;
+const dirty_capacity = 256;
+// NOTE: idle cpus stop filling once this many frames are ready
+const zeroed_high_watermark = 192;
+const fill_batch = 8;
+
+pub const Stats = struct {
+    hits: std.atomic.Value(u64) = .init(0),
+    misses: std.atomic.Value(u64) = .init(0),
+    zeroed: std.atomic.Value(u64) = .init(0),
+    recycled: std.atomic.Value(u64) = .init(0),
+};
+
+// NOTE: one pool per numa node, frames are always parked in the pool of the node they belong to
+const Pool = struct {
+    lock: SpinLock = .create(),
+    zeroed: [zeroed_capacity]pmem.PAddr = undefined,
+    zeroed_count: usize = 0,
+    dirty: [dirty_capacity]pmem.PAddr = undefined,
+    dirty_count: usize = 0,
+};
+
+var pools: [numa.max_nodes]Pool = .{Pool{}} ** numa.max_nodes;
+var virt_alloc: ?*vmem.VirtualAllocator = null;
+pub var stats: Stats = .{};
+
+pub fn init(va: *vmem.VirtualAllocator) !void {
+    virt_alloc = va;
+    try cpu.registerIdleHook(idleHook);
+}
+
+// NOTE: a zeroed frame of `node`, the node of the current cpu by default
+pub fn take(node: ?numa.NodeId) ?pmem.PAddr {
+    if (virt_alloc == null) return null;
+    const pool = &pools[node orelse numa.currentNode()];
+    pool.lock.lock();
+    defer pool.lock.unlock();
+    if (pool.zeroed_count == 0) {
+        @branchHint(.unlikely);
+        _ = stats.misses.fetchAdd(1, .monotonic);
+        return null;
+    }
+    _ = stats.hits.fetchAdd(1, .monotonic);
+    pool.zeroed_count -= 1;
+    return pool.zeroed[pool.zeroed_count];
+}
+
+// NOTE: returns false when the dirty list is full, the caller frees the frame itself
+pub fn recycle(paddr: pmem.PAddr) bool {
+    if (virt_alloc == null) return false;
+    const pool = &pools[numa.memoryNode(paddr).node];
+    pool.lock.lock();
+    defer pool.lock.unlock();
+    if (pool.dirty_count == dirty_capacity) return false;
+    pool.dirty[pool.dirty_count] = paddr;
+    pool.dirty_count += 1;
+    _ = stats.recycled.fetchAdd(1, .monotonic);
+    return true;
+}
+
+// NOTE: idle cpus only fill the pool of their own node
+fn idleHook() bool {
+    const node = numa.currentNode();
+    var worked = false;
+    for (0..fill_batch) |_| {
+        if (!fillOne(node)) break;
+        worked = true;
+    }
+    return worked;
+}
+
+fn fillOne(node: numa.NodeId) bool {
+    const pool = &pools[node];
+    const recycled_frame = blk: {
+        pool.lock.lock();
+        defer pool.lock.unlock();
+        if (pool.zeroed_count >= zeroed_high_watermark) return false;
+        if (pool.dirty_count == 0) break :blk null;
+        pool.dirty_count -= 1;
+        break :blk pool.dirty[pool.dirty_count];
+    };
+    const paddr = recycled_frame orelse (pmem.allocatePages(1, .{ .node = node }) catch return false).start;
+    // NOTE: the allocation may have fallen back to another node, keep that frame out of this pool
+    if (recycled_frame == null and numa.memoryNode(paddr).node != node) {
+        pmem.freePages(.{ .start = paddr, .length = arch.constants.default_page_size, .typ = .free });
+        return false;
+    }
+
+    // NOTE: zeroing happens with interrupts enabled and without the lock, the frame is private here
+    const page: [*]align(arch.constants.default_page_size) u8 = @ptrFromInt(virt_alloc.?.physToVirt(paddr).toAddr());
+    arch.assembly.zeroNonTemporal(page, arch.constants.default_page_size);
+    _ = stats.zeroed.fetchAdd(1, .monotonic);
+
+    pool.lock.lock();
+    defer pool.lock.unlock();
+    if (pool.zeroed_count == zeroed_capacity) {
+        pmem.freePages(.{ .start = paddr, .length = arch.constants.default_page_size, .typ = .free });
+        return false;
+    }
+    pool.zeroed[pool.zeroed_count] = paddr;
+    pool.zeroed_count += 1;
+    return true;
+}
+
+pub fn memoryStats(buffer: []u8) ![]u8 {
+    var zeroed_count: usize = 0;
+    var dirty_count: usize = 0;
+    for (pools[0..numa.node_count]) |*pool| {
+        zeroed_count += pool.zeroed_count;
+        dirty_count += pool.dirty_count;
+    }
+    return try std.fmt.bufPrint(buffer,
+        \\ Zero pool: {d} ready, {d} dirty
+        \\ Hits/misses: {d}/{d}, zeroed in background: {d}, recycled: {d}
+    , .{
+        zeroed_count,
+        dirty_count,
+        stats.hits.load(.monotonic),
+        stats.misses.load(.monotonic),
+        stats.zeroed.load(.monotonic),
+        stats.recycled.load(.monotonic),
+    });
+}
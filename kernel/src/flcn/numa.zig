@@ -0,0 +1,219 @@
+const std = @import("std");
+const acpi = @import("acpi.zig");
+const acpi_events = @import("acpi/acpi_events.zig");
+const cpu = @import("cpu.zig");
+
+const log = std.log.scoped(.numa);
+
+pub const NodeId = u8;
+pub const max_nodes = 8;
+const max_memory_affinities = 64;
+const max_processor_affinities = 256;
+// NOTE: SLIT distances are relative to the local distance (10), unreachable localities report 0xff
+pub const local_distance = 10;
+pub const remote_distance = 20;
+
+const MemoryAffinity = struct {
+    base: u64,
+    end: u64,
+    node: NodeId,
+};
+const ProcessorAffinity = struct {
+    apic_id: u32,
+    node: NodeId,
+};
+
+pub const MemoryNodeRange = struct {
+    node: NodeId,
+    // NOTE: first address past start that may belong to another node
+    end: u64,
+};
+
+pub var node_count: NodeId = 1;
+var node_domains: [max_nodes]u32 = .{0} ** max_nodes;
+var distances: [max_nodes][max_nodes]u8 = defaultDistances();
+// NOTE: for each node, every node ordered by distance (itself first); this is the allocation fallback order
+var fallback_orders: [max_nodes][max_nodes]NodeId = defaultFallbackOrders();
+var memory_affinities_buffer: [max_memory_affinities]MemoryAffinity = undefined;
+var memory_affinities: std.ArrayList(MemoryAffinity) = .initBuffer(&memory_affinities_buffer);
+var processor_affinities_buffer: [max_processor_affinities]ProcessorAffinity = undefined;
+var processor_affinities: std.ArrayList(ProcessorAffinity) = .initBuffer(&processor_affinities_buffer);
+var cpu_nodes: [cpu.possible_cpus_count]NodeId = .{0} ** cpu.possible_cpus_count;
+var slit_locality_count: u64 = 0;
+
+const SratIterationContext = struct {
+    pub fn acpiIterationContext(self: *const SratIterationContext) acpi.AcpiTableIterationContext {
+        return .{
+            .ptr = self,
+            .cb = onCallback,
+        };
+    }
+
+    fn onCallback(_: *const anyopaque, args: *const anyopaque) !void {
+        const msg: *const acpi_events.SratParsingEvent = @ptrCast(@alignCast(args));
+        switch (msg.*) {
+            .processor_affinity => |pa| {
+                const node = nodeForDomain(pa.proximity_domain) catch return;
+                try processor_affinities.appendBounded(.{ .apic_id = pa.apic_id, .node = node });
+            },
+            .memory_affinity => |ma| {
+                if (ma.length == 0) return;
+                const node = nodeForDomain(ma.proximity_domain) catch return;
+                try memory_affinities.appendBounded(.{ .base = ma.base, .end = ma.base + ma.length, .node = node });
+            },
+        }
+    }
+};
+
+const SlitIterationContext = struct {
+    pub fn acpiIterationContext(self: *const SlitIterationContext) acpi.AcpiTableIterationContext {
+        return .{
+            .ptr = self,
+            .cb = onCallback,
+        };
+    }
+
+    fn onCallback(_: *const anyopaque, args: *const anyopaque) !void {
+        const msg: *const acpi_events.SlitParsingEvent = @ptrCast(@alignCast(args));
+        switch (msg.*) {
+            .locality_count => |count| slit_locality_count = count,
+            .distance => |d| {
+                const from = findNode(std.math.cast(u32, d.from) orelse return) orelse return;
+                const to = findNode(std.math.cast(u32, d.to) orelse return) orelse return;
+                distances[from][to] = d.distance;
+            },
+        }
+    }
+};
+
+// NOTE: needs the acpi tables but no memory, it runs before the physical memory manager
+// so the buddy regions can be split at node boundaries
+pub fn init() !void {
+    node_count = 0;
+    const sratIterationContext = SratIterationContext{};
+    acpi.iterateTable(.srat, sratIterationContext.acpiIterationContext()) catch |err| switch (err) {
+        error.TableNotFound => log.debug("no SRAT, assuming a single memory node", .{}),
+        else => return err,
+    };
+    if (node_count == 0) {
+        node_count = 1;
+        memory_affinities.clearRetainingCapacity();
+        processor_affinities.clearRetainingCapacity();
+        log.info("numa subsystem initialized with 1 node", .{});
+        return;
+    }
+
+    const slitIterationContext = SlitIterationContext{};
+    acpi.iterateTable(.slit, slitIterationContext.acpiIterationContext()) catch |err| switch (err) {
+        error.TableNotFound => log.debug("no SLIT, using default distances", .{}),
+        else => return err,
+    };
+
+    std.sort.insertion(MemoryAffinity, memory_affinities.items, {}, struct {
+        fn lessThan(_: void, lhs: MemoryAffinity, rhs: MemoryAffinity) bool {
+            return lhs.base < rhs.base;
+        }
+    }.lessThan);
+    computeFallbackOrders();
+
+    for (memory_affinities.items) |ma| {
+        log.debug("memory [0x{x} - 0x{x}) -> node {d}", .{ ma.base, ma.end, ma.node });
+    }
+    for (0..node_count) |node| {
+        log.debug("node {d} (domain {d}): distances {any}, fallback {any}", .{ node, node_domains[node], distances[node][0..node_count], fallback_orders[node][0..node_count] });
+    }
+    log.info("numa subsystem initialized with {d} nodes", .{node_count});
+}
+
+fn findNode(domain: u32) ?NodeId {
+    for (node_domains[0..node_count], 0..) |d, node| {
+        if (d == domain) return @intCast(node);
+    }
+    return null;
+}
+
+fn nodeForDomain(domain: u32) !NodeId {
+    if (findNode(domain)) |node| return node;
+    if (node_count == max_nodes) {
+        log.warn("too many proximity domains, domain {d} is ignored", .{domain});
+        return error.TooManyNodes;
+    }
+    node_domains[node_count] = domain;
+    node_count += 1;
+    return node_count - 1;
+}
+
+fn defaultDistances() [max_nodes][max_nodes]u8 {
+    var result: [max_nodes][max_nodes]u8 = undefined;
+    for (0..max_nodes) |from| {
+        for (0..max_nodes) |to| {
+            result[from][to] = if (from == to) local_distance else remote_distance;
+        }
+    }
+    return result;
+}
+
+fn defaultFallbackOrders() [max_nodes][max_nodes]NodeId {
+    var result: [max_nodes][max_nodes]NodeId = undefined;
+    for (0..max_nodes) |node| {
+        for (0..max_nodes) |idx| {
+            result[node][idx] = @intCast((node + idx) % max_nodes);
+        }
+    }
+    return result;
+}
+
+fn computeFallbackOrders() void {
+    for (0..node_count) |node| {
+        const order = fallback_orders[node][0..node_count];
+        for (order, 0..) |*n, idx| n.* = @intCast(idx);
+        // NOTE: stable, so nodes at the same distance keep their id order
+        std.sort.insertion(NodeId, order, &distances[node], struct {
+            fn lessThan(node_distances: *const [max_nodes]u8, lhs: NodeId, rhs: NodeId) bool {
+                return node_distances[lhs] < node_distances[rhs];
+            }
+        }.lessThan);
+    }
+}
+
+pub fn distance(from: NodeId, to: NodeId) u8 {
+    return distances[from][to];
+}
+
+pub fn fallbackOrder(node: NodeId) []const NodeId {
+    return fallback_orders[node][0..node_count];
+}
+
+// NOTE: memory not described by the SRAT belongs to node 0
+pub fn memoryNode(start: u64) MemoryNodeRange {
+    var end: u64 = std.math.maxInt(u64);
+    for (memory_affinities.items) |ma| {
+        if (ma.base <= start and start < ma.end) return .{ .node = ma.node, .end = ma.end };
+        if (ma.base > start) {
+            end = ma.base;
+            break;
+        }
+    }
+    return .{ .node = 0, .end = end };
+}
+
+pub fn apicNode(apic_id: u32) NodeId {
+    for (processor_affinities.items) |pa| {
+        if (pa.apic_id == apic_id) return pa.node;
+    }
+    return 0;
+}
+
+pub fn setCpuNode(cpu_id: cpu.CpuId, node: NodeId) void {
+    cpu_nodes[cpu_id] = node;
+}
+
+// NOTE: node hint for memory that belongs to a given cpu (per-cpu data, stacks, ...)
+pub fn cpuNode(cpu_id: cpu.CpuId) NodeId {
+    return cpu_nodes[cpu_id];
+}
+
+pub fn currentNode() NodeId {
+    if (node_count == 1) return 0;
+    return cpu_nodes[cpu.currentId()];
+}
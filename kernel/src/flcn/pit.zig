@@ -65,8 +65,7 @@ var irq_handle: irq.IrqHandle = undefined;
 
 pub fn init() void {
     setCounter(.Channel1, std.math.maxInt(u16));
-    timer._registerTickSource(tickSource());
-    timer._registerTickNotifier(tickNotifier());
+    // NOTE: registering the notifier may program it right away, the irq has to exist by then
     irq_handle = irq.register(.{
         .source = .{
             .kind = .{ .ioapic = .{ .gsi = 2 } },
@@ -77,6 +76,8 @@ pub fn init() void {
         .route = .any,
         .handler = .{ .handler_fn = timer.timerHandler },
     }) catch unreachable;
+    timer._registerTickSource(tickSource());
+    timer._registerTickNotifier(tickNotifier());
 }
 
 pub fn millis(ms: u64) u16 {
@@ -142,6 +143,7 @@ pub fn tickSource() timer.TickSource {
         ._read = read,
         ._freq = freq,
         .max_counter = std.math.maxInt(u16),
+        .counts_down = true,
         .priority = 0,
     };
 }
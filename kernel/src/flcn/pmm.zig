@@ -1,7 +1,7 @@
 const std = @import("std");
 const BootInfo = @import("bootinfo.zig").BootInfo;
 const DoublyLinkedList = @import("list.zig").DoublyLinkedList;
-const SpinLock = @import("synchronization.zig").SpinLock;
+const McsLock = @import("synchronization.zig").McsLock;
 const mem_allocator = @import("allocator.zig");
 const buddy = @import("buddy.zig");
 
@@ -33,6 +33,26 @@ pub const PhysMemRange = struct {
         try writer.print("{*}[0x{X} -> 0x{X} (sz={X}) {s}]", .{ self, self.start, self.start + self.length, self.length, @tagName(self.typ) });
     }
 };
+pub const PageKind = enum(u8) {
+    none,
+    slab,
+    vmalloc,
+};
+// NOTE: one per physical page frame, lets us go from an address back to whoever owns its page
+pub const PageDescriptor = struct {
+    owner: usize = 0,
+    kind: PageKind = .none,
+    // NOTE: order of the block of frames starting at this page, for owners that allocate blocks they later free one by one
+    order: u8 = 0,
+
+    pub fn set(self: *PageDescriptor, kind: PageKind, owner: *const anyopaque) void {
+        self.* = .{ .owner = @intFromPtr(owner), .kind = kind };
+    }
+
+    pub fn clear(self: *PageDescriptor) void {
+        self.* = .{};
+    }
+};
 pub const PhysMemRangeListItem = struct {
     range: PhysMemRange,
     prev: ?*PhysMemRangeListItem = null,
@@ -52,6 +72,8 @@ pub fn PhysMemRangeAllocator(comptime T: type) type {
         region: *PhysMemRangeListItem,
         memory_start: u64,
         memory_len: u64,
+        // NOTE: numa node (dense id of the SRAT proximity domain) the range belongs to
+        node: u8 = 0,
         prev: ?*PhysMemRangeAllocator(T) = null,
         next: ?*PhysMemRangeAllocator(T) = null,
 
@@ -73,15 +95,15 @@ pub fn PhysMemRangeAllocatorList(comptime T: type) type {
 }
 pub const PhysicalMemoryManager = struct {
     const Self = @This();
-    lock: SpinLock,
+    lock: McsLock,
     memory_ranges: PhysMemRangeList,
     free_ranges: PhysMemRangeList,
     reserved_ranges: PhysMemRangeList,
     total_memory: usize,
     free_pages_count: usize,
     reserved_pages_count: usize,
-    uncommitted_pages_count: usize,
-    committed_pages_count: usize,
+    uncommitted_pages_count: std.atomic.Value(usize),
+    committed_pages_count: std.atomic.Value(usize),
 
     pub fn init() Self {
         return .{
@@ -92,8 +114,8 @@ pub const PhysicalMemoryManager = struct {
             .total_memory = 0,
             .free_pages_count = 0,
             .reserved_pages_count = 0,
-            .uncommitted_pages_count = 0,
-            .committed_pages_count = 0,
+            .uncommitted_pages_count = .init(0),
+            .committed_pages_count = .init(0),
         };
     }
 };
@@ -0,0 +1,147 @@
+const std = @import("std");
+const builtin = @import("builtin");
+const cpu = @import("cpu.zig");
+
+const log = std.log.scoped(.rcu);
+
+// NOTE: quiescent state based reclamation for read-mostly tables (irq handlers, ...).
+// * readers bracket their accesses with readLock/readUnlock, which only touch the cpu's own state,
+//   and load the data through a Pointer (a single acquire load)
+// * a cpu leaving its outermost read section or going around the idle loop has passed a quiescent
+//   point, a halted cpu is in an extended quiescent state and never holds a grace period back
+// * writers publish the new version, call synchronize() and reclaim the old version once it returns:
+//   every other online cpu has passed a quiescent point by then so none can still reference it
+// * synchronize() spins until the other cpus report, it must run with interrupts enabled and no spin
+//   lock held (a cpu spinning on that lock with interrupts disabled would never report)
+
+const idle_seq = std.math.maxInt(u64);
+
+const CpuState = struct {
+    // NOTE: last grace period the cpu went through, idle_seq while it is halted
+    seen: std.atomic.Value(u64) align(std.atomic.cache_line) = .init(0),
+    nesting: u32 = 0,
+};
+
+var gp_seq: std.atomic.Value(u64) align(std.atomic.cache_line) = .init(0);
+var cpu_states: [cpu.possible_cpus_count]CpuState = .{CpuState{}} ** cpu.possible_cpus_count;
+
+pub fn Pointer(comptime T: type) type {
+    return struct {
+        const Self = @This();
+        ptr: std.atomic.Value(?*T) = .init(null),
+
+        // NOTE: the result can only be used until the end of the read section
+        pub fn read(self: *const Self) ?*T {
+            return self.ptr.load(.acquire);
+        }
+
+        // NOTE: returns the previous version, it can be reclaimed once synchronize() returns
+        pub fn publish(self: *Self, new: ?*T) ?*T {
+            return self.ptr.swap(new, .acq_rel);
+        }
+    };
+}
+
+pub fn readLock() void {
+    const state = &cpu_states[cpu.currentId()];
+    state.nesting += 1;
+    if (state.nesting == 1 and state.seen.load(.monotonic) == idle_seq) {
+        @branchHint(.unlikely);
+        // NOTE: woken up from a halt, a writer may be checking this cpu right now. the swap is a
+        // full barrier, either the writer sees us busy or we see what it published before
+        _ = state.seen.swap(gp_seq.load(.monotonic), .seq_cst);
+    }
+}
+
+pub fn readUnlock() void {
+    const state = &cpu_states[cpu.currentId()];
+    std.debug.assert(state.nesting > 0);
+    state.nesting -= 1;
+    if (state.nesting == 0) quiescentState(state);
+}
+
+fn quiescentState(state: *CpuState) void {
+    state.seen.store(gp_seq.load(.monotonic), .release);
+}
+
+// NOTE: the idle loop between two passes, the cpu holds no reference
+pub fn quiescent() void {
+    const state = &cpu_states[cpu.currentId()];
+    if (state.nesting == 0) quiescentState(state);
+}
+
+pub fn enterIdle() void {
+    idleState(&cpu_states[cpu.currentId()]);
+}
+
+fn idleState(state: *CpuState) void {
+    state.seen.store(idle_seq, .release);
+}
+
+pub fn synchronize() void {
+    const target = gp_seq.fetchAdd(1, .seq_cst) + 1;
+    const self_id = cpu.currentId();
+    std.debug.assert(cpu_states[self_id].nesting == 0);
+    var spins: u64 = 0;
+    var iter = cpu.online_cpus_mask.iterator(.{});
+    while (iter.next()) |cpu_id| {
+        if (cpu_id == self_id) continue;
+        const state = &cpu_states[cpu_id];
+        while (true) : (spins += 1) {
+            const seen = state.seen.load(.seq_cst);
+            if (seen == idle_seq or seen >= target) break;
+            std.atomic.spinLoopHint();
+        }
+    }
+    log.debug("grace period {d} over after {d} spins", .{ target, spins });
+}
+
+test "Pointer publishes and hands back the previous version" {
+    var first: u64 = 1;
+    var second: u64 = 2;
+    var pointer: Pointer(u64) = .{};
+    try std.testing.expectEqual(@as(?*u64, null), pointer.publish(&first));
+    readLock();
+    try std.testing.expectEqual(@as(u64, 1), pointer.read().?.*);
+    readUnlock();
+    try std.testing.expectEqual(@as(?*u64, &first), pointer.publish(&second));
+    synchronize();
+    try std.testing.expectEqual(@as(u64, 2), pointer.read().?.*);
+    try std.testing.expect(cpu_states[0].seen.load(.monotonic) < gp_seq.load(.monotonic));
+}
+
+fn synchronizeAndFlag(done: *std.atomic.Value(bool)) void {
+    synchronize();
+    done.store(true, .release);
+}
+
+// NOTE: the host has no per-cpu data, the test thread plays the other cpu and reports through its state directly
+fn expectGracePeriodWaits(other: *CpuState, report: *const fn (*CpuState) void) !void {
+    var done: std.atomic.Value(bool) = .init(false);
+    const start_seq = gp_seq.load(.seq_cst);
+    const writer = try std.Thread.spawn(.{}, synchronizeAndFlag, .{&done});
+    while (gp_seq.load(.seq_cst) == start_seq) std.atomic.spinLoopHint();
+    for (0..100_000) |_| std.atomic.spinLoopHint();
+    const finished_early = done.load(.acquire);
+    report(other);
+    writer.join();
+    try std.testing.expect(!finished_early);
+    try std.testing.expect(done.load(.acquire));
+}
+
+test "synchronize waits for the other online cpus" {
+    if (builtin.single_threaded or cpu.possible_cpus_count < 2) return error.SkipZigTest;
+    const other_id = cpu.possible_cpus_count - 1;
+    const saved_mask = cpu.online_cpus_mask;
+    defer cpu.online_cpus_mask = saved_mask;
+    cpu.online_cpus_mask.set(other_id);
+    const other = &cpu_states[other_id];
+    other.seen.store(gp_seq.load(.monotonic), .release);
+
+    try expectGracePeriodWaits(other, quiescentState);
+    other.seen.store(gp_seq.load(.monotonic), .release);
+    try expectGracePeriodWaits(other, idleState);
+    // NOTE: a halted cpu doesn't hold grace periods back
+    synchronize();
+    other.seen.store(0, .release);
+}
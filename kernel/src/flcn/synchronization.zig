@@ -1,31 +1,344 @@
 const std = @import("std");
+const builtin = @import("builtin");
+const options = @import("options");
+const arch = @import("arch");
+const cpu = @import("cpu.zig");
 
 const log = std.log.scoped(.spin_lock);
 
 const INVALID_CPU_ID = std.math.maxInt(u32);
+// NOTE: host tests run every thread as cpu 0 with no control over interrupts
+const track_owner = options.safety and !builtin.is_test;
+
+// NOTE: contention counters, only kept with -Dlock_stats=true. they are updated by the
+// holder after it got the lock so they need no atomics of their own
+pub const LockStats = struct {
+    acquisitions: u64 = 0,
+    contended: u64 = 0,
+    spins: u64 = 0,
+    max_wait_cycles: u64 = 0,
+
+    fn record(self: *LockStats, spins: u64, wait_cycles: u64) void {
+        self.acquisitions += 1;
+        if (spins == 0) return;
+        self.contended += 1;
+        self.spins += spins;
+        self.max_wait_cycles = @max(self.max_wait_cycles, wait_cycles);
+    }
+
+    pub fn format(self: *const LockStats, w: *std.Io.Writer) std.Io.Writer.Error!void {
+        try w.print("{d} acquisitions, {d} contended, {d} spins, max wait {d} cycles", .{
+            self.acquisitions,
+            self.contended,
+            self.spins,
+            self.max_wait_cycles,
+        });
+    }
+};
+const Stats = if (options.lock_stats) LockStats else void;
+const no_stats: Stats = if (options.lock_stats) .{} else {};
+
+fn saveAndDisableInterrupts() bool {
+    if (builtin.is_test) return false;
+    return cpu.saveAndDisableInterrupts();
+}
+
+fn restoreInterrupts(state: bool) void {
+    if (builtin.is_test) return;
+    cpu.restoreInterrupts(state);
+}
+
+fn timestamp() u64 {
+    if (!options.lock_stats) return 0;
+    return arch.assembly.rdtsc();
+}
+
+// NOTE: locks held by each cpu, a cpu holding one runs with interrupts disabled so plain counters do
+var held_locks: [cpu.possible_cpus_count]u32 = .{0} ** cpu.possible_cpus_count;
+
+// NOTE: spin locks (of either kind) held by the current cpu, always 0 when owners aren't tracked
+pub fn heldLocksCount() u32 {
+    if (!track_owner) return 0;
+    return held_locks[cpu.currentId()];
+}
+
+// NOTE: common part of the locks below, who holds the lock and the interrupt state to restore
+const Owner = struct {
+    cpu_id: std.atomic.Value(u32) = .init(INVALID_CPU_ID),
+    saved_int_state: bool = false,
+
+    fn checkNotHeld(self: *const Owner) void {
+        if (!track_owner) return;
+        if (self.cpu_id.load(.monotonic) == cpu.currentId()) @panic("spin lock taken recursively");
+    }
+
+    fn acquired(self: *Owner, int_state: bool) void {
+        if (track_owner) {
+            self.cpu_id.store(cpu.currentId(), .monotonic);
+            held_locks[cpu.currentId()] += 1;
+        }
+        self.saved_int_state = int_state;
+    }
+
+    // NOTE: returns the interrupt state to restore once the lock is handed over
+    fn released(self: *Owner) bool {
+        if (track_owner) {
+            if (self.cpu_id.load(.monotonic) != cpu.currentId()) @panic("spin lock released by a cpu that doesn't hold it");
+            self.cpu_id.store(INVALID_CPU_ID, .monotonic);
+            held_locks[cpu.currentId()] -= 1;
+        }
+        return self.saved_int_state;
+    }
+};
+
+// NOTE: fair ticket lock. every cpu takes a ticket and waits for its number to be served, so the
+// lock is granted in arrival order. interrupts stay disabled from lock() to unlock()
 pub const SpinLock = struct {
     const Self = @This();
-    cpu_id: u32,
-    locked: bool,
-    lock_count: u32,
-    saved_int_state: bool,
+    next_ticket: std.atomic.Value(u32) align(std.atomic.cache_line) = .init(0),
+    now_serving: std.atomic.Value(u32) = .init(0),
+    owner: Owner = .{},
+    stats: Stats = no_stats,
 
     pub fn create() Self {
-        return .{
-            .cpu_id = INVALID_CPU_ID,
-            .locked = false,
-            .lock_count = 0,
-            .saved_int_state = false,
-        };
+        return .{};
+    }
+
+    pub fn lock(self: *Self) void {
+        const int_state = saveAndDisableInterrupts();
+        self.owner.checkNotHeld();
+        const ticket = self.next_ticket.fetchAdd(1, .monotonic);
+        var spins: u64 = 0;
+        var wait_start: u64 = 0;
+        if (self.now_serving.load(.acquire) != ticket) {
+            @branchHint(.unlikely);
+            wait_start = timestamp();
+            while (self.now_serving.load(.acquire) != ticket) : (spins += 1) {
+                std.atomic.spinLoopHint();
+            }
+        }
+        self.owner.acquired(int_state);
+        if (options.lock_stats) self.stats.record(spins, timestamp() -% wait_start);
+    }
+
+    // NOTE: no recursion check, a lock held by the current cpu is busy like any other and tryLock fails
+    pub fn tryLock(self: *Self) bool {
+        const int_state = saveAndDisableInterrupts();
+        const serving = self.now_serving.load(.monotonic);
+        if (self.next_ticket.cmpxchgStrong(serving, serving +% 1, .acquire, .monotonic) != null) {
+            restoreInterrupts(int_state);
+            return false;
+        }
+        self.owner.acquired(int_state);
+        if (options.lock_stats) self.stats.record(0, 0);
+        return true;
+    }
+
+    pub fn unlock(self: *Self) void {
+        const int_state = self.owner.released();
+        // NOTE: only the holder writes now_serving, a plain increment is enough
+        self.now_serving.store(self.now_serving.load(.monotonic) +% 1, .release);
+        restoreInterrupts(int_state);
+    }
+
+    pub fn isLocked(self: *const Self) bool {
+        return self.next_ticket.load(.monotonic) != self.now_serving.load(.monotonic);
+    }
+};
+
+// NOTE: mcs queue lock for the heavily contended paths. each waiter spins on its own node instead of
+// the shared lock word, so a release only touches the cache line of the next cpu in the queue.
+// the node lives on the caller's stack and must be passed to both lock() and unlock()
+pub const McsLock = struct {
+    const Self = @This();
+    pub const Node = struct {
+        next: std.atomic.Value(?*Node) align(std.atomic.cache_line) = .init(null),
+        granted: std.atomic.Value(bool) = .init(false),
+    };
+
+    tail: std.atomic.Value(?*Node) align(std.atomic.cache_line) = .init(null),
+    owner: Owner = .{},
+    stats: Stats = no_stats,
+
+    pub fn create() Self {
+        return .{};
+    }
+
+    pub fn lock(self: *Self, node: *Node) void {
+        const int_state = saveAndDisableInterrupts();
+        self.owner.checkNotHeld();
+        node.* = .{};
+        var spins: u64 = 0;
+        var wait_start: u64 = 0;
+        if (self.tail.swap(node, .acq_rel)) |prev| {
+            @branchHint(.unlikely);
+            wait_start = timestamp();
+            prev.next.store(node, .release);
+            while (!node.granted.load(.acquire)) : (spins += 1) {
+                std.atomic.spinLoopHint();
+            }
+        }
+        self.owner.acquired(int_state);
+        if (options.lock_stats) self.stats.record(spins, timestamp() -% wait_start);
     }
 
-    pub fn lock(self: Self) void {
-        _ = self;
-        // log.debug("Locking", .{});
+    pub fn unlock(self: *Self, node: *Node) void {
+        const int_state = self.owner.released();
+        const next = node.next.load(.acquire) orelse blk: {
+            if (self.tail.cmpxchgStrong(node, null, .release, .monotonic) == null) {
+                restoreInterrupts(int_state);
+                return;
+            }
+            // NOTE: a cpu swapped itself in as the tail but hasn't linked its node yet
+            while (true) {
+                if (node.next.load(.acquire)) |linked| break :blk linked;
+                std.atomic.spinLoopHint();
+            }
+        };
+        next.granted.store(true, .release);
+        restoreInterrupts(int_state);
     }
 
-    pub fn unlock(self: Self) void {
-        _ = self;
-        // log.debug("Unlocking", .{});
+    pub fn isLocked(self: *const Self) bool {
+        return self.tail.load(.monotonic) != null;
     }
 };
+
+// NOTE: sequence lock for small read-mostly state. readers copy the value without writing anything
+// shared and retry when a writer ran meanwhile, writers are serialized by a spin lock. the value is
+// stored as words loaded with acquire ordering so the copy can't be reordered past the final check
+pub fn SeqLock(comptime T: type) type {
+    return struct {
+        const Self = @This();
+        const word_count = std.math.divCeil(usize, @sizeOf(T), @sizeOf(usize)) catch unreachable;
+        const Words = [word_count]usize;
+
+        sequence: std.atomic.Value(u32) align(std.atomic.cache_line) = .init(0),
+        words: [word_count]std.atomic.Value(usize),
+        writer_lock: SpinLock = .create(),
+
+        pub fn init(value: T) Self {
+            var self: Self = .{ .words = undefined };
+            for (&self.words, toWords(value)) |*word, value_word| word.* = .init(value_word);
+            return self;
+        }
+
+        fn toWords(value: T) Words {
+            var words: Words = .{0} ** word_count;
+            @memcpy(std.mem.sliceAsBytes(&words)[0..@sizeOf(T)], std.mem.asBytes(&value));
+            return words;
+        }
+
+        fn fromWords(words: *const Words) T {
+            var value: T = undefined;
+            @memcpy(std.mem.asBytes(&value), std.mem.sliceAsBytes(words)[0..@sizeOf(T)]);
+            return value;
+        }
+
+        pub fn read(self: *const Self) T {
+            while (true) {
+                const start = self.sequence.load(.acquire);
+                if (start & 1 != 0) {
+                    @branchHint(.unlikely);
+                    std.atomic.spinLoopHint();
+                    continue;
+                }
+                var words: Words = undefined;
+                for (&words, &self.words) |*word, *shared| word.* = shared.load(.acquire);
+                if (self.sequence.load(.monotonic) == start) return fromWords(&words);
+            }
+        }
+
+        // NOTE: returns the current value, the new one is published by endWrite()
+        pub fn beginWrite(self: *Self) T {
+            self.writer_lock.lock();
+            const sequence = self.sequence.load(.monotonic);
+            self.sequence.store(sequence +% 1, .monotonic);
+            var words: Words = undefined;
+            for (&words, &self.words) |*word, *shared| word.* = shared.load(.monotonic);
+            return fromWords(&words);
+        }
+
+        pub fn endWrite(self: *Self, value: T) void {
+            // NOTE: release stores keep the odd sequence store above them
+            for (&self.words, toWords(value)) |*shared, word| shared.store(word, .release);
+            self.sequence.store(self.sequence.load(.monotonic) +% 1, .release);
+            self.writer_lock.unlock();
+        }
+
+        pub fn write(self: *Self, value: T) void {
+            _ = self.beginWrite();
+            self.endWrite(value);
+        }
+    };
+}
+
+test "SpinLock serves tickets in order" {
+    var spin_lock: SpinLock = .create();
+    spin_lock.lock();
+    try std.testing.expect(spin_lock.isLocked());
+    try std.testing.expect(!spin_lock.tryLock());
+    spin_lock.unlock();
+    try std.testing.expect(!spin_lock.isLocked());
+    try std.testing.expect(spin_lock.tryLock());
+    spin_lock.unlock();
+    try std.testing.expectEqual(@as(u32, 2), spin_lock.now_serving.load(.monotonic));
+}
+
+fn hammerLocks(spin_lock: *SpinLock, mcs_lock: *McsLock, counters: *[2]u64, rounds: usize) void {
+    for (0..rounds) |_| {
+        spin_lock.lock();
+        counters[0] += 1;
+        spin_lock.unlock();
+
+        var node: McsLock.Node = .{};
+        mcs_lock.lock(&node);
+        counters[1] += 1;
+        mcs_lock.unlock(&node);
+    }
+}
+
+test "Locks exclude each other across threads" {
+    if (builtin.single_threaded) return error.SkipZigTest;
+    const thread_count = 4;
+    const rounds = 10_000;
+    var spin_lock: SpinLock = .create();
+    var mcs_lock: McsLock = .create();
+    var counters: [2]u64 = .{ 0, 0 };
+    var threads: [thread_count]std.Thread = undefined;
+    for (&threads) |*thread| {
+        thread.* = try std.Thread.spawn(.{}, hammerLocks, .{ &spin_lock, &mcs_lock, &counters, rounds });
+    }
+    for (threads) |thread| thread.join();
+    try std.testing.expectEqual(@as(u64, thread_count * rounds), counters[0]);
+    try std.testing.expectEqual(@as(u64, thread_count * rounds), counters[1]);
+    try std.testing.expect(!spin_lock.isLocked());
+    try std.testing.expect(!mcs_lock.isLocked());
+}
+
+test "SeqLock readers never see a torn value" {
+    if (builtin.single_threaded) return error.SkipZigTest;
+    const Pair = struct { a: u64, b: u64, c: u32 };
+    const rounds = 100_000;
+    var seq_lock: SeqLock(Pair) = .init(.{ .a = 0, .b = 0, .c = 0 });
+    const writer = try std.Thread.spawn(.{}, struct {
+        fn run(lock: *SeqLock(Pair)) void {
+            for (1..rounds + 1) |round| {
+                var pair = lock.beginWrite();
+                pair.a = round;
+                pair.b = round * 2;
+                pair.c = @truncate(round * 3);
+                lock.endWrite(pair);
+            }
+        }
+    }.run, .{&seq_lock});
+    var last: u64 = 0;
+    while (last < rounds) {
+        const pair = seq_lock.read();
+        try std.testing.expectEqual(pair.a * 2, pair.b);
+        try std.testing.expectEqual(@as(u32, @truncate(pair.a * 3)), pair.c);
+        try std.testing.expect(pair.a >= last);
+        last = pair.a;
+    }
+    writer.join();
+}
@@ -1,5 +1,11 @@
 const std = @import("std");
 const irq = @import("irq.zig");
+const cpu = @import("cpu.zig");
+const memory = @import("memory.zig");
+const timer_wheel = @import("timer_wheel.zig");
+const synchronization = @import("synchronization.zig");
+const SeqLock = synchronization.SeqLock;
+const SpinLock = synchronization.SpinLock;
 // NOTE: design notes for time keeping subsystem
 // * arch independent tick source "interface" offers a read() -> u64 function to read the underlying timer chip counter
 // * time keeping can register different tick source implementations each of which has a precision factor (sort of minimal/typical period ?) that determines priority
@@ -31,7 +37,11 @@ pub const TickSource = struct {
     _read: *const fn () anyerror!TickCount,
     _freq: *const fn () anyerror!TickFreq,
     max_counter: u64,
+    counts_down: bool = false,
     priority: u8, // NOTE: the higher the better
+    // NOTE: ns = ticks * mult >> shift, set from the frequency when the source gets registered
+    mult: u64 = 0,
+    shift: u6 = 32,
 
     pub fn read(self: TickSource) !TickCount {
         return try self._read();
@@ -41,12 +51,29 @@ pub const TickSource = struct {
         return try self._freq();
     }
 
-    pub fn toNanoseconds(self: TickSource) !Duration {
-        // TODO:: impl this
-        _ = self;
-        return .{
-            .nanoseconds = 0,
-        };
+    // NOTE: ticks between two reads, the counter wrapped at most once in between
+    pub fn elapsed(self: TickSource, from: TickCount, to: TickCount) TickCount {
+        if (self.counts_down) {
+            return if (from >= to) from - to else from + (self.max_counter - to);
+        }
+        return if (to >= from) to - from else to + (self.max_counter - from);
+    }
+
+    // NOTE: how long the clocks can go without an update before the counter wraps around, with half
+    // the wrap period as margin for the interrupt latency. null for 64 bit counters, they never wrap
+    pub fn maxUpdateInterval(self: TickSource) ?Duration {
+        if (self.max_counter == std.math.maxInt(TickCount)) return null;
+        return self.toNanoseconds(self.max_counter / 2);
+    }
+
+    pub fn toNanoseconds(self: TickSource, ticks: TickCount) Duration {
+        return .{ .nanoseconds = @intCast((@as(u128, ticks) * self.mult) >> self.shift) };
+    }
+
+    fn computeScale(self: *TickSource) !void {
+        const frequency = try self.freq();
+        if (frequency == 0) return error.InvalidTickFrequency;
+        self.mult = @intCast(((@as(u128, 1_000_000_000) << self.shift) + frequency / 2) / frequency);
     }
 };
 
@@ -75,11 +102,22 @@ pub const Clock = struct {
     }
 };
 
+// NOTE: timers live in the wheel of the cpu that armed them, a wheel tick is 2^20ns (~1ms) and
+// deadlines are rounded up to the next tick so a timer never fires early
+const wheel_tick_shift = 20;
+
 pub const Timer = struct {
+    // NOTE: expired timers are out of the wheel, in the batch being serviced, until their callback starts
+    pub const State = enum { idle, armed, expired, running, cancelled };
+
     deadline: Timestamp,
     period: ?Duration = null,
     context: ?*anyopaque = null,
     callback: *const fn (?*anyopaque) void,
+    wheel_links: timer_wheel.Links(Timer) = .{},
+    // NOTE: owned by the wheel of `cpu_id`, only changed under its lock
+    cpu_id: u32 = 0,
+    state: State = .idle,
 
     pub fn oneShot(callback: *const fn (?*anyopaque) void, duration: Duration) Timer {
         return .{
@@ -88,31 +126,73 @@ pub const Timer = struct {
         };
     }
 
-    pub fn notify(self: Timer) void {
+    pub fn periodic(callback: *const fn (?*anyopaque) void, period: Duration) Timer {
+        return .{
+            .callback = callback,
+            .deadline = getClock(.monotonic).addDuration(period),
+            .period = period,
+        };
+    }
+
+    pub fn notify(self: *const Timer) void {
         self.callback(self.context);
     }
 
-    pub fn reArm(self: *Timer) void {
-        if (self.period) |p| {
-            self.deadline = getClock(.realtime).addDuration(p);
-        } else unreachable;
+    // NOTE: the next deadline follows the previous one, unless the timer fell a whole period behind
+    fn reArm(self: *Timer, now: Timestamp) void {
+        const period = self.period orelse unreachable;
+        self.deadline = self.deadline.addDuration(period);
+        if (self.deadline.nanoseconds <= now.nanoseconds) self.deadline = now.addDuration(period);
     }
 };
-fn timerLt(_: void, a: Timer, b: Timer) std.math.Order {
-    return std.math.order(a.deadline.nanoseconds, b.deadline.nanoseconds);
+
+const TimerWheel = timer_wheel.Wheel(Timer, .wheel_links);
+
+const CpuTimers = struct {
+    lock: SpinLock align(std.atomic.cache_line) = .create(),
+    wheel: TimerWheel = .init(0),
+    // NOTE: wheel tick the notifier was programmed for on this cpu, none_programmed when it wasn't
+    programmed: u64 = none_programmed,
+};
+const none_programmed = std.math.maxInt(u64);
+
+var cpu_timers: [cpu.possible_cpus_count]CpuTimers = .{CpuTimers{}} ** cpu.possible_cpus_count;
+
+fn wheelTick(timestamp: Timestamp) u64 {
+    const nanoseconds: u64 = @intCast(@max(timestamp.nanoseconds, 0));
+    return nanoseconds >> wheel_tick_shift;
+}
+
+fn deadlineTick(deadline: Timestamp) u64 {
+    const nanoseconds: u64 = @intCast(@max(deadline.nanoseconds, 0));
+    return std.math.divCeil(u64, nanoseconds, 1 << wheel_tick_shift) catch unreachable;
 }
 
 var tick_sources_buffer: [16]TickSource = .{undefined} ** 16;
 var tick_notifiers_buffer: [16]TickNotifier = .{undefined} ** 16;
 var time_manager: Self = undefined;
 
+// NOTE: the clocks as of the last update and the tick count they were updated at
+const ClockState = struct {
+    clocks: std.EnumArray(ClockType, Clock),
+    last_ticks: TickCount = 0,
+};
+
+// NOTE: lockless, callable from any cpu and from interrupt context. a 64 bit counter can't wrap
+// between two updates, the time elapsed since the last one is added in so the query costs a single
+// read of the source. narrower counters (the pit) only move the clocks on updates
 pub fn getClock(clock_type: ClockType) Timestamp {
-    const c = time_manager.clocks.get(clock_type);
-    return .{ .nanoseconds = c.now.nanoseconds };
+    const state = time_manager.clocks.read();
+    var now = state.clocks.get(clock_type).now;
+    const source = time_manager.active_tick_source;
+    if (source.max_counter == std.math.maxInt(TickCount)) {
+        const ticks_now = source.read() catch return now;
+        now.nanoseconds += source.toNanoseconds(source.elapsed(state.last_ticks, ticks_now)).nanoseconds;
+    }
+    return now;
 }
 
 const Self = @This();
-allocator: std.mem.Allocator,
 
 tick_sources: std.ArrayList(TickSource) = .initBuffer(&tick_sources_buffer),
 tick_notifiers: std.ArrayList(TickNotifier) = .initBuffer(&tick_notifiers_buffer),
@@ -121,19 +201,15 @@ active_tick_source: TickSource,
 active_tick_notifier: TickNotifier,
 active_tick_notifier_handle: ?irq.IrqHandle,
 
-last_ticks: TickCount = 0,
+// NOTE: read on every time query, written by the timer interrupt only
+clocks: SeqLock(ClockState),
 
-clocks: std.EnumArray(ClockType, Clock),
+timer_cache: *memory.ObjectCache(Timer),
 
-// timer_cache: add a timer cache/slab allocator here
-
-// TODO: one of these per-cpu please
-timers: std.PriorityQueue(Timer, void, timerLt) = .empty,
-
-pub fn init(allocator: std.mem.Allocator) void {
+pub fn init() !void {
     time_manager = .{
-        .allocator = allocator,
-        .clocks = .initDefault(.{ .now = .fromNanoseconds(0) }, .{}),
+        .timer_cache = try memory.createObjectCache(Timer, "timer", .{}),
+        .clocks = .init(.{ .clocks = .initDefault(.{ .now = .fromNanoseconds(0) }, .{}) }),
         .active_tick_source = undefined,
         .active_tick_notifier = undefined,
         .active_tick_notifier_handle = null,
@@ -141,13 +217,26 @@ pub fn init(allocator: std.mem.Allocator) void {
 }
 
 pub fn registerTickSource(self: *Self, tick_source: TickSource) !void {
-    try self.tick_sources.appendBounded(tick_source);
+    var scaled = tick_source;
+    try scaled.computeScale();
+    try self.tick_sources.appendBounded(scaled);
     self.reElectTickSource();
+    if (self.tick_notifiers.items.len > 0) try self.reprogramLocal();
 }
 
 pub fn registerTickNotifier(self: *Self, tick_notifier: TickNotifier) !void {
     try self.tick_notifiers.appendBounded(tick_notifier);
     self.reElectTickNotifier();
+    try self.reprogramLocal();
+}
+
+// NOTE: the current cpu's next interrupt goes through the newly elected source/notifier. with a narrow
+// source this also arms the first clock update while no timer is armed yet
+fn reprogramLocal(self: *Self) !void {
+    const local = &cpu_timers[cpu.currentId()];
+    local.lock.lock();
+    defer local.lock.unlock();
+    try self.programNext(local);
 }
 
 fn reElectTickSource(self: *Self) void {
@@ -156,8 +245,17 @@ fn reElectTickSource(self: *Self) void {
     for (self.tick_sources.items[1..]) |ts| {
         if (ts.priority > best.priority) best = ts;
     }
+    // NOTE: the time counted by the previous source up to now is kept, the new one counts from here
+    var state = self.clocks.beginWrite();
+    if (self.tick_sources.items.len > 1) {
+        const previous = self.active_tick_source;
+        const ticks_now = previous.read() catch unreachable;
+        for (&state.clocks.values) |*clock| clock.update(previous.toNanoseconds(previous.elapsed(state.last_ticks, ticks_now)));
+    }
     self.active_tick_source = best;
-    self.last_ticks = self.active_tick_source.read() catch unreachable;
+    state.last_ticks = best.read() catch unreachable;
+    self.clocks.endWrite(state);
+    log.info("tick source elected (priority {d}, {d}Hz)", .{ best.priority, best.freq() catch 0 });
 }
 
 fn reElectTickNotifier(self: *Self) void {
@@ -169,78 +267,164 @@ fn reElectTickNotifier(self: *Self) void {
     self.active_tick_notifier = best;
 }
 
-pub fn createTimer(self: *Self, timer: Timer) !void {
-    try self.timers.push(self.allocator, timer);
-    // TODO: remove this !!!!
-    try self.updateTime();
+// NOTE: arms the timer on the current cpu. the handle stays valid until cancelTimer() or, for a one
+// shot timer, until its callback returned
+pub fn createTimer(self: *Self, timer: Timer) !*Timer {
+    const armed = try self.timer_cache.create();
+    errdefer self.timer_cache.destroy(armed);
+    armed.* = timer;
+    const cpu_id = cpu.currentId();
+    const local = &cpu_timers[cpu_id];
+    local.lock.lock();
+    defer local.lock.unlock();
+    armed.cpu_id = cpu_id;
+    armed.state = .armed;
+    local.wheel.insert(armed, deadlineTick(armed.deadline));
+    errdefer _ = local.wheel.remove(armed);
+    if (armed.wheel_links.expires < local.programmed) try self.programNext(local);
+    return armed;
 }
 
-fn updateClocks(self: *Self, elapsed: Duration) void {
-    for (&self.clocks.values) |*clock| {
-        clock.update(elapsed);
+// NOTE: returns true when the timer was stopped before firing. a running timer is only marked, it
+// is released once its callback returns and isn't re-armed
+pub fn cancelTimer(self: *Self, timer: *Timer) bool {
+    const local = &cpu_timers[timer.cpu_id];
+    {
+        local.lock.lock();
+        defer local.lock.unlock();
+        switch (timer.state) {
+            .armed => {
+                _ = local.wheel.remove(timer);
+                timer.state = .idle;
+            },
+            // NOTE: the servicing cpu owns the timer, it skips it and releases it itself
+            .expired => {
+                timer.state = .cancelled;
+                return true;
+            },
+            .running => {
+                timer.state = .cancelled;
+                return false;
+            },
+            .idle, .cancelled => return false,
+        }
     }
+    // NOTE: the notifier may still fire for it on that cpu, it then finds nothing due
+    self.timer_cache.destroy(timer);
+    return true;
 }
 
-fn serviceTimers(self: *Self) !void {
-    const cutoff_time = getClock(.monotonic);
-    var timers_buffer: [128]Timer = .{undefined} ** 128;
-    var timers = std.ArrayList(Timer).initBuffer(&timers_buffer);
-    while (self.timers.peek()) |t| {
-        if (t.deadline.nanoseconds > cutoff_time.nanoseconds) return;
-        var timer = self.timers.pop().?;
+// NOTE: the source is read under the writer lock, updates from several cpus stay ordered
+fn updateClocks(self: *Self) !void {
+    var state = self.clocks.beginWrite();
+    const source = self.active_tick_source;
+    const ticks_now = source.read() catch |err| {
+        self.clocks.endWrite(state);
+        return err;
+    };
+    const elapsed = source.toNanoseconds(source.elapsed(state.last_ticks, ticks_now));
+    for (&state.clocks.values) |*clock| {
+        clock.update(elapsed);
+    }
+    state.last_ticks = ticks_now;
+    self.clocks.endWrite(state);
+}
 
-        // WARN: danger zone
-        timer.notify();
+// NOTE: every timer due on this cpu comes out of the wheel in one batch, the callbacks run with the
+// wheel unlocked so they can arm and cancel timers
+fn serviceTimers(self: *Self, local: *CpuTimers) !void {
+    var expired = blk: {
+        local.lock.lock();
+        defer local.lock.unlock();
+        const expired = local.wheel.advance(wheelTick(getClock(.monotonic)));
+        var cursor = expired.head;
+        while (cursor) |timer| : (cursor = timer.wheel_links.next) timer.state = .expired;
+        break :blk expired;
+    };
+    // NOTE: a timer only becomes running when its turn comes, one cancelled while the callbacks
+    // before it ran is dropped without firing
+    while (expired.pop()) |timer| {
+        const cancelled = blk: {
+            local.lock.lock();
+            defer local.lock.unlock();
+            if (timer.state == .cancelled) break :blk true;
+            timer.state = .running;
+            break :blk false;
+        };
+        if (!cancelled) timer.notify();
+        self.finishTimer(local, timer);
+    }
+    local.lock.lock();
+    defer local.lock.unlock();
+    try self.programNext(local);
+}
 
-        if (timer.period) |_| {
-            timer.reArm();
-            try timers.appendBounded(timer);
+fn finishTimer(self: *Self, local: *CpuTimers, timer: *Timer) void {
+    {
+        local.lock.lock();
+        defer local.lock.unlock();
+        if (timer.state == .running and timer.period != null) {
+            timer.reArm(getClock(.monotonic));
+            timer.state = .armed;
+            local.wheel.insert(timer, deadlineTick(timer.deadline));
+            return;
         }
+        timer.state = .idle;
     }
+    self.timer_cache.destroy(timer);
+}
 
-    try self.timers.pushSlice(self.allocator, timers.items);
+// NOTE: programs the notifier for the next wheel event only, a cpu with an empty wheel gets no
+// timer interrupt. the exception is a source that wraps around (the pit): the clocks only see its
+// elapsed time modulo the wrap, so the delay is capped and an idle cpu still wakes up to update them.
+// called with the wheel locked
+fn programNext(self: *Self, local: *CpuTimers) !void {
+    const max_delay = self.active_tick_source.maxUpdateInterval();
+    var delay: Duration = undefined;
+    if (local.wheel.nextEvent()) |next| {
+        local.programmed = next;
+        const at: Timestamp = .fromNanoseconds(@as(i96, next) << wheel_tick_shift);
+        delay = getClock(.monotonic).durationTo(at);
+    } else {
+        local.programmed = none_programmed;
+        delay = max_delay orelse return;
+    }
+    if (max_delay) |max| delay.nanoseconds = @min(delay.nanoseconds, max.nanoseconds);
+    const handle = try self.active_tick_notifier.programInterrupt(.{ .nanoseconds = @max(delay.nanoseconds, 0) });
+    self.active_tick_notifier_handle = handle;
+    try irq.unmask(handle);
 }
 
 pub fn updateTime(self: *Self) !void {
     if (self.active_tick_notifier_handle) |handle| try irq.mask(handle);
-
-    const ticks_now = try self.active_tick_source.read();
-    defer self.last_ticks = ticks_now;
-    // 1/ count elapsed ticks
-    const ticks_elapsed = if (self.last_ticks > ticks_now) self.last_ticks - ticks_now else self.active_tick_source.max_counter - (ticks_now - self.last_ticks);
-
-    // 2/ convert to nanoseconds
-    const freq = try self.active_tick_source.freq();
-    // TODO: make the freq in units of ns (or any units that would make conversion painless)
-    const elapsed_duration: Duration = .{ .nanoseconds = ticks_elapsed * 1_000_000_000 / freq };
-    // 3/ update clocks
-    self.updateClocks(elapsed_duration);
-    // 4.1/ walk the prio queue and service elapsed timers
-    // 4.2/ rearm periodic timers
-    try self.serviceTimers();
-    if (self.timers.peek()) |timer| {
-        const now = getClock(.monotonic);
-        const duration = now.durationTo(timer.deadline);
-        self.active_tick_notifier_handle = try self.active_tick_notifier.programInterrupt(duration);
-        try irq.unmask(self.active_tick_notifier_handle.?);
-    }
+    try self.updateClocks();
+    try self.serviceTimers(&cpu_timers[cpu.currentId()]);
 }
 
 pub fn waitDuration(self: *Self, duration: Duration) !void {
-    const freq = try self.active_tick_source.freq();
-    var ticks = @divTrunc(duration.toNanoseconds() * freq, 1_000_000_000);
-    var last_count = try self.active_tick_source.read();
-    while (ticks > 0) {
-        const current_count = try self.active_tick_source.read();
-        if (current_count < last_count) {
-            ticks -= last_count - current_count;
-        } else {
-            ticks -= self.active_tick_source.max_counter - (current_count - last_count);
-        }
-        last_count = current_count;
-    }
+    var watch = try Stopwatch.start(self.active_tick_source);
+    while ((try watch.read()).nanoseconds < duration.nanoseconds) {}
 }
 
+// NOTE: time measured by polling a tick source, it doesn't need the timer interrupt to move the
+// clocks. it must be read more often than the counter wraps (~55ms for the pit)
+pub const Stopwatch = struct {
+    source: TickSource,
+    last_count: TickCount,
+    ticks: TickCount = 0,
+
+    pub fn start(source: TickSource) !Stopwatch {
+        return .{ .source = source, .last_count = try source.read() };
+    }
+
+    pub fn read(self: *Stopwatch) !Duration {
+        const current_count = try self.source.read();
+        self.ticks += self.source.elapsed(self.last_count, current_count);
+        self.last_count = current_count;
+        return self.source.toNanoseconds(self.ticks);
+    }
+};
+
 // -------------------
 
 pub fn timerHandler(_: *const irq.Context, _: ?*anyopaque) void {
@@ -251,6 +435,10 @@ pub fn wait(duration: Duration) void {
     time_manager.waitDuration(duration) catch unreachable;
 }
 
+pub fn startStopwatch() Stopwatch {
+    return Stopwatch.start(time_manager.active_tick_source) catch unreachable;
+}
+
 pub fn _registerTickSource(tick_source: TickSource) void {
     time_manager.registerTickSource(tick_source) catch unreachable;
 }
@@ -259,6 +447,10 @@ pub fn _registerTickNotifier(tick_notifier: TickNotifier) void {
     time_manager.registerTickNotifier(tick_notifier) catch unreachable;
 }
 
-pub fn _createTimer(timer: Timer) void {
-    time_manager.createTimer(timer) catch unreachable;
+pub fn _createTimer(timer: Timer) *Timer {
+    return time_manager.createTimer(timer) catch unreachable;
+}
+
+pub fn _cancelTimer(timer: *Timer) bool {
+    return time_manager.cancelTimer(timer);
 }
@@ -0,0 +1,221 @@
+const std = @import("std");
+
+// NOTE: hierarchical timing wheel (varghese & lauck, cascading flavour). level n has 64 slots of 64^n
+// ticks, a node goes in the lowest level whose span covers its distance to `now`. arming and cancelling
+// are O(1) (a slot is an intrusive list), every 64^n ticks the current slot of level n is cascaded down
+// into the lower levels. most timers get cancelled long before they would cascade.
+// * `now` is the next tick to process, advance() runs every tick up to the target and hands back all
+//   the expired nodes at once
+// * empty stretches are skipped: occupied slots are tracked in a bitmap per level, nextEvent() finds
+//   the next slot to expire or cascade without walking the ticks in between
+// * deadlines past the horizon are queued at the horizon and re-queued when they get there
+pub const level_bits = 6;
+pub const level_size = 1 << level_bits;
+pub const level_count = 6;
+const level_mask = level_size - 1;
+pub const max_delta: u64 = (1 << (level_bits * level_count)) - 1;
+
+pub fn Links(comptime T: type) type {
+    return struct {
+        prev: ?*T = null,
+        next: ?*T = null,
+        expires: u64 = 0,
+        // NOTE: level * level_size + index of the slot holding the node, null while it isn't queued
+        slot: ?u16 = null,
+    };
+}
+
+pub fn Wheel(comptime T: type, comptime links_field: std.meta.FieldEnum(T)) type {
+    return struct {
+        const Self = @This();
+        const links_name = std.meta.fieldInfo(T, links_field).name;
+
+        now: u64,
+        count: usize = 0,
+        occupied: [level_count]u64 = .{0} ** level_count,
+        slots: [level_count][level_size]?*T = .{.{null} ** level_size} ** level_count,
+
+        pub const Expired = struct {
+            head: ?*T = null,
+
+            pub fn pop(self: *Expired) ?*T {
+                const node = self.head orelse return null;
+                self.head = links(node).next;
+                links(node).next = null;
+                return node;
+            }
+        };
+
+        pub fn init(now: u64) Self {
+            return .{ .now = now };
+        }
+
+        fn links(node: *T) *Links(T) {
+            return &@field(node, links_name);
+        }
+
+        fn shiftOf(level: usize) u6 {
+            return @intCast(level * level_bits);
+        }
+
+        fn bit(index: u64) u64 {
+            return @as(u64, 1) << @intCast(index);
+        }
+
+        fn levelOf(delta: u64) usize {
+            if (delta < level_size) return 0;
+            return @min(std.math.log2_int(u64, delta) / level_bits, level_count - 1);
+        }
+
+        pub fn isQueued(node: *T) bool {
+            return links(node).slot != null;
+        }
+
+        pub fn insert(self: *Self, node: *T, expires: u64) void {
+            std.debug.assert(!isQueued(node));
+            links(node).expires = expires;
+            self.enqueue(node);
+            self.count += 1;
+        }
+
+        // NOTE: returns false when the node wasn't queued (never armed or already expired)
+        pub fn remove(self: *Self, node: *T) bool {
+            const l = links(node);
+            const slot_id = l.slot orelse return false;
+            const level = slot_id / level_size;
+            const index = slot_id % level_size;
+            const slot = &self.slots[level][index];
+            if (l.prev) |prev| links(prev).next = l.next else slot.* = l.next;
+            if (l.next) |next| links(next).prev = l.prev;
+            if (slot.* == null) self.occupied[level] &= ~bit(index);
+            l.prev = null;
+            l.next = null;
+            l.slot = null;
+            self.count -= 1;
+            return true;
+        }
+
+        fn enqueue(self: *Self, node: *T) void {
+            const l = links(node);
+            const delta = @min(@max(l.expires, self.now) - self.now, max_delta);
+            const level = levelOf(delta);
+            const index = ((self.now + delta) >> shiftOf(level)) & level_mask;
+            const slot = &self.slots[level][index];
+            l.prev = null;
+            l.next = slot.*;
+            if (slot.*) |head| links(head).prev = node;
+            slot.* = node;
+            l.slot = @intCast(level * level_size + index);
+            self.occupied[level] |= bit(index);
+        }
+
+        fn takeSlot(self: *Self, level: usize, index: u64) ?*T {
+            const head = self.slots[level][index];
+            self.slots[level][index] = null;
+            self.occupied[level] &= ~bit(index);
+            return head;
+        }
+
+        // NOTE: at a multiple of 64 ticks the current slot of level 1 comes down, at a multiple of 64^2
+        // the one of level 2 too, and so on
+        fn cascade(self: *Self) void {
+            for (1..level_count) |level| {
+                const index = (self.now >> shiftOf(level)) & level_mask;
+                var cursor = self.takeSlot(level, index);
+                while (cursor) |node| {
+                    cursor = links(node).next;
+                    self.enqueue(node);
+                }
+                if (index != 0) break;
+            }
+        }
+
+        // NOTE: processes every tick up to `target` included, the expired nodes come out unqueued
+        pub fn advance(self: *Self, target: u64) Expired {
+            var expired: Expired = .{};
+            while (self.now <= target) {
+                const index = self.now & level_mask;
+                if (index == 0) self.cascade();
+                var cursor = self.takeSlot(0, index);
+                while (cursor) |node| {
+                    const l = links(node);
+                    cursor = l.next;
+                    // NOTE: queued at the horizon, not due yet
+                    if (l.expires > self.now) {
+                        self.enqueue(node);
+                        continue;
+                    }
+                    l.prev = null;
+                    l.slot = null;
+                    l.next = expired.head;
+                    expired.head = node;
+                    self.count -= 1;
+                }
+                self.now += 1;
+                if (self.now <= target) self.now = @min(self.nextEvent() orelse target + 1, target + 1);
+            }
+            return expired;
+        }
+
+        // NOTE: first tick from `now` on where a slot expires or cascades, null when the wheel is empty
+        pub fn nextEvent(self: *const Self) ?u64 {
+            if (self.count == 0) return null;
+            var tick = self.now;
+            for (0..level_count) |level| {
+                const shift = shiftOf(level);
+                const index = (tick >> shift) & level_mask;
+                const ahead = self.occupied[level] >> @intCast(index);
+                if (ahead != 0) return ((tick >> shift) + @ctz(ahead)) << shift;
+                // NOTE: nothing left in this round of the level, next stop is the cascade starting the
+                // next one. slots before `index` belong to that next round
+                tick = std.mem.alignForward(u64, tick, @as(u64, 1) << (shift + level_bits));
+                if (self.occupied[level] != 0) return tick;
+            }
+            return tick;
+        }
+    };
+}
+
+const TestNode = struct {
+    links: Links(TestNode) = .{},
+    expired_at: ?u64 = null,
+};
+const TestWheel = Wheel(TestNode, .links);
+
+test "Wheel expires every node on its tick" {
+    const count = 2000;
+    var nodes: [count]TestNode = .{TestNode{}} ** count;
+    var prng: std.Random.DefaultPrng = .init(7);
+    const random = prng.random();
+    var wheel: TestWheel = .init(100);
+    for (&nodes, 0..) |*node, index| {
+        // NOTE: a few past the horizon and a few already due
+        const expires: u64 = switch (index % 100) {
+            0 => 100 + max_delta * 3,
+            1 => 50,
+            else => 100 + random.uintLessThan(u64, 1 << 20),
+        };
+        wheel.insert(node, expires);
+    }
+    for (nodes[0 .. count / 4]) |*node| try std.testing.expect(wheel.remove(node));
+    try std.testing.expect(!wheel.remove(&nodes[0]));
+    try std.testing.expectEqual(@as(usize, count - count / 4), wheel.count);
+
+    var previous_target: u64 = 99;
+    while (wheel.nextEvent()) |next| {
+        try std.testing.expect(next >= wheel.now);
+        const target = next + random.uintLessThan(u64, 5000);
+        var expired = wheel.advance(target);
+        while (expired.pop()) |node| {
+            try std.testing.expect(!TestWheel.isQueued(node));
+            try std.testing.expect(node.expired_at == null);
+            const due = @max(node.links.expires, 100);
+            try std.testing.expect(due <= target and due > previous_target);
+            node.expired_at = target;
+        }
+        previous_target = target;
+    }
+    try std.testing.expectEqual(@as(usize, 0), wheel.count);
+    for (nodes[0 .. count / 4]) |node| try std.testing.expect(node.expired_at == null);
+    for (nodes[count / 4 ..]) |node| try std.testing.expect(node.expired_at != null);
+}
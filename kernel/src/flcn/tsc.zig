@@ -0,0 +1,92 @@
+const std = @import("std");
+const arch = @import("arch");
+const timer = @import("timer.zig");
+const pit = @import("pit.zig");
+const hpet = @import("hpet.zig");
+const cpu = @import("cpu.zig");
+
+const log = std.log.scoped(.tsc);
+
+// NOTE: invariant tsc tick source. the counter runs at a constant rate whatever the p/c state and is
+// read with a single rdtsc, no port io and no wrap around. its frequency isn't reliably reported so it
+// gets measured at boot against the hpet, or the pit without one: several short windows, the median
+// one is kept
+const calibration_runs = 5;
+const calibration_ms = 10;
+
+var frequency: timer.TickFreq = 0;
+
+pub fn init() void {
+    if (!cpu.hasFeature(.tsc) or !cpu.hasFeature(.constant_tsc)) {
+        log.info("no invariant tsc, keeping the current tick source", .{});
+        return;
+    }
+    frequency = calibrate();
+    log.info("tsc calibrated at {d}Hz", .{frequency});
+    timer._registerTickSource(tickSource());
+}
+
+pub fn isCalibrated() bool {
+    return frequency != 0;
+}
+
+// NOTE: saturates, a far enough deadline doesn't fit in 64 bits of ticks
+pub fn ticksFromNanoseconds(nanoseconds: u64) u64 {
+    return std.math.cast(u64, @as(u128, nanoseconds) * frequency / 1_000_000_000) orelse std.math.maxInt(u64);
+}
+
+fn calibrate() timer.TickFreq {
+    const int_state = cpu.saveAndDisableInterrupts();
+    defer cpu.restoreInterrupts(int_state);
+    var samples: [calibration_runs]timer.TickFreq = undefined;
+    for (&samples) |*sample| sample.* = calibrateOnce();
+    std.mem.sort(timer.TickFreq, &samples, {}, std.sort.asc(timer.TickFreq));
+    return samples[calibration_runs / 2];
+}
+
+fn calibrateOnce() timer.TickFreq {
+    return if (hpet.isPresent()) calibrateAgainstHpet() else calibrateAgainstPit();
+}
+
+fn calibrateAgainstHpet() timer.TickFreq {
+    const window = hpet.frequency() * calibration_ms / 1000;
+    const hpet_start = hpet.readCounter();
+    const tsc_start = arch.assembly.rdtsc();
+    var hpet_end = hpet_start;
+    while (hpet.elapsed(hpet_start, hpet_end) < window) hpet_end = hpet.readCounter();
+    const tsc_end = arch.assembly.rdtsc();
+    return (tsc_end - tsc_start) * hpet.frequency() / hpet.elapsed(hpet_start, hpet_end);
+}
+
+// NOTE: pit channel 1 counts down from the top, the window is well below a wrap around. the new count
+// only gets loaded on the next pit clock and reads return the previous one until then, the window starts
+// on the first change (which also lines it up with a pit clock)
+fn calibrateAgainstPit() timer.TickFreq {
+    const window = pit.millis(calibration_ms);
+    pit.setCounter(.Channel1, std.math.maxInt(u16));
+    const stale = pit.getCount(.Channel1);
+    var pit_start = stale;
+    while (pit_start == stale) pit_start = pit.getCount(.Channel1);
+    const tsc_start = arch.assembly.rdtsc();
+    var pit_end = pit_start;
+    while (pit_start -% pit_end < window) pit_end = pit.getCount(.Channel1);
+    const tsc_end = arch.assembly.rdtsc();
+    return (tsc_end - tsc_start) * pit.frequency / (pit_start -% pit_end);
+}
+
+fn read() !timer.TickCount {
+    return arch.assembly.rdtsc();
+}
+
+fn freq() !timer.TickFreq {
+    return frequency;
+}
+
+pub fn tickSource() timer.TickSource {
+    return .{
+        ._read = read,
+        ._freq = freq,
+        .max_counter = std.math.maxInt(u64),
+        .priority = 2,
+    };
+}
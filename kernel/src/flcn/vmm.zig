@@ -1,6 +1,7 @@
 const std = @import("std");
+const options = @import("options");
 const SpinLock = @import("synchronization.zig").SpinLock;
-const DoublyLinkedList = @import("list.zig").DoublyLinkedList;
+const avl = @import("avl.zig");
 
 pub const VirtRangeType = enum(u8) {
     mmio,
@@ -10,6 +11,7 @@ pub const VirtRangeType = enum(u8) {
     stack,
     quickmap,
     quickmap_pte,
+    vmalloc,
     free,
 };
 
@@ -35,10 +37,44 @@ pub fn VirtualMemoryManager(comptime TAddr: type, comptime TAddrSize: type) type
                 }
             }
         };
-        const VirtMemRangeListItem = struct {
+        const VirtMemRangeItem = struct {
             range: VirtMemRange,
-            prev: ?*VirtMemRangeListItem = null,
-            next: ?*VirtMemRangeListItem = null,
+            addr_links: avl.Links(VirtMemRangeItem) = .{},
+            size_links: avl.Links(VirtMemRangeItem) = .{},
+            // NOTE: longest range in this item's subtree of the address tree
+            max_length: u64 = 0,
+
+            fn start(self: *const @This()) TAddrSize {
+                return @bitCast(self.range.start);
+            }
+
+            fn end(self: *const @This()) TAddrSize {
+                return self.start() +% self.range.length;
+            }
+
+            fn compareStart(a: *const @This(), b: *const @This()) std.math.Order {
+                return std.math.order(a.start(), b.start());
+            }
+
+            fn compareSize(a: *const @This(), b: *const @This()) std.math.Order {
+                return switch (std.math.order(a.range.length, b.range.length)) {
+                    .eq => compareStart(a, b),
+                    else => |order| order,
+                };
+            }
+
+            fn updateMaxLength(self: *@This()) void {
+                self.max_length = self.range.length;
+                if (self.addr_links.left) |l| self.max_length = @max(self.max_length, l.max_length);
+                if (self.addr_links.right) |r| self.max_length = @max(self.max_length, r.max_length);
+            }
+
+            // NOTE: the aligned start of an allocation of `length` bytes carved from this range
+            fn fit(self: *const @This(), length: TAddrSize, alignment: TAddrSize) ?TAddrSize {
+                const aligned_start = std.mem.alignForward(TAddrSize, self.start(), alignment);
+                if (aligned_start - self.start() + length > self.range.length) return null;
+                return aligned_start;
+            }
 
             pub fn format(
                 self: *const @This(),
@@ -47,15 +83,70 @@ pub fn VirtualMemoryManager(comptime TAddr: type, comptime TAddrSize: type) type
                 try writer.print("{*}[range={f}]", .{ self, &self.range });
             }
         };
-        const VirtMemRangeList = DoublyLinkedList(VirtMemRangeListItem, .prev, .next);
+        const AddrTree = avl.AvlTree(VirtMemRangeItem, .addr_links, VirtMemRangeItem.compareStart, VirtMemRangeItem.updateMaxLength);
+        const SizeTree = avl.AvlTree(VirtMemRangeItem, .size_links, VirtMemRangeItem.compareSize, null);
+
+        // NOTE: the ranges of one type, indexed by start address (augmented with the longest range
+        // of each subtree for first fit) and by (length, start) for best fit. ranges never overlap
+        pub const RangeSet = struct {
+            by_addr: AddrTree = .{},
+            by_size: SizeTree = .{},
+
+            fn insert(self: *RangeSet, item: *VirtMemRangeItem) void {
+                self.by_addr.insert(item);
+                self.by_size.insert(item);
+            }
+
+            fn remove(self: *RangeSet, item: *VirtMemRangeItem) void {
+                self.by_addr.remove(item);
+                self.by_size.remove(item);
+            }
+
+            // NOTE: after changing the start or length of an item without moving it past its neighbours
+            fn resized(self: *RangeSet, item: *VirtMemRangeItem) void {
+                self.by_size.remove(item);
+                self.by_size.insert(item);
+                self.by_addr.update(item);
+            }
+
+            // NOTE: last range starting at or before `addr`
+            fn floor(self: *const RangeSet, addr: TAddrSize) ?*VirtMemRangeItem {
+                const key: VirtMemRangeItem = .{ .range = .{ .start = @bitCast(addr), .length = 0 } };
+                return self.by_addr.floor(&key);
+            }
+
+            pub fn iter(self: *const RangeSet) AddrTree.Iterator {
+                return self.by_addr.iter();
+            }
+
+            pub fn count(self: *const RangeSet) usize {
+                return self.by_addr.count;
+            }
+
+            fn firstFit(node: ?*VirtMemRangeItem, length: TAddrSize, alignment: TAddrSize) ?*VirtMemRangeItem {
+                const n = node orelse return null;
+                if (n.max_length < length) return null;
+                if (firstFit(n.addr_links.left, length, alignment)) |found| return found;
+                if (n.fit(length, alignment) != null) return n;
+                return firstFit(n.addr_links.right, length, alignment);
+            }
+
+            fn bestFit(self: *const RangeSet, length: TAddrSize, alignment: TAddrSize) ?*VirtMemRangeItem {
+                const key: VirtMemRangeItem = .{ .range = .{ .start = @bitCast(@as(TAddrSize, 0)), .length = length } };
+                var cursor = self.by_size.ceiling(&key);
+                // NOTE: only alignment padding can make a long enough range not fit
+                while (cursor) |item| : (cursor = SizeTree.next(item)) {
+                    if (item.fit(length, alignment) != null) return item;
+                }
+                return null;
+            }
+        };
 
         const num_range_slots = std.enums.directEnumArrayLen(VirtRangeType, 0);
 
         alloc: std.mem.Allocator,
         lock: SpinLock,
-        memory_map: [num_range_slots]VirtMemRangeList,
-        free_ranges: VirtMemRangeList,
-        reserved_ranges: VirtMemRangeList,
+        memory_map: [num_range_slots]RangeSet,
         quickmap_pt_entry: VirtMemRange,
         quickmap: VirtMemRange,
 
@@ -64,180 +155,243 @@ pub fn VirtualMemoryManager(comptime TAddr: type, comptime TAddrSize: type) type
             return .{
                 .lock = .create(),
                 .alloc = alloc,
-                .memory_map = [_]VirtMemRangeList{.{}} ** num_range_slots,
-                .free_ranges = VirtMemRangeList{},
-                .reserved_ranges = VirtMemRangeList{},
+                .memory_map = [_]RangeSet{.{}} ** num_range_slots,
                 .quickmap_pt_entry = .{ .start = @bitCast(zero), .length = 0, .typ = .quickmap_pte },
                 .quickmap = .{ .start = @bitCast(zero), .length = 0, .typ = .quickmap },
             };
         }
 
+        // NOTE: only needed by tests, the kernel's manager lives forever
+        pub fn deinit(self: *Self) void {
+            for (&self.memory_map) |*range_set| {
+                var iter = range_set.iter();
+                while (iter.next()) |item| self.alloc.destroy(item);
+                range_set.* = .{};
+            }
+        }
+
         const RangeArgs = struct {
             typ: ?VirtRangeType = null,
             frozen: bool = false,
         };
 
+        fn createItem(self: *Self, start: TAddrSize, length: u64, typ: ?VirtRangeType, frozen: bool) !*VirtMemRangeItem {
+            const item = try self.alloc.create(VirtMemRangeItem);
+            item.* = .{
+                .range = .{
+                    .start = @bitCast(start),
+                    .length = length,
+                    .typ = typ,
+                    .frozen = frozen,
+                },
+            };
+            return item;
+        }
+
         pub fn registerRange(self: *Self, start: TAddrSize, length: u64, args: RangeArgs) !void {
             const end = start +% length;
             const typ = args.typ orelse .free;
             log.debug("registering range 0x{x} -> 0x{x} ({d}) {t}", .{ start, end, length, typ });
-            const range_list = &self.memory_map[@intFromEnum(typ)];
-            var iter = range_list.iter();
-            var prev_opt: ?*VirtMemRangeListItem = null;
-            var next_opt: ?*VirtMemRangeListItem = null;
-            while (iter.next()) |item| {
-                const range = &item.range;
-                log.debug("checking range: {f}", .{range});
-                const range_start = @as(TAddrSize, @bitCast(range.start));
-                // const range_end = range_start +% range.length;
-                if (range_start <= start) {
-                    prev_opt = item;
-                    next_opt = item.next;
-                    break;
-                } else {
-                    next_opt = item;
-                    break;
-                }
-            }
+            const range_set = &self.memory_map[@intFromEnum(typ)];
+            const prev_opt = range_set.floor(start);
+            const next_opt = if (prev_opt) |p| AddrTree.next(p) else range_set.by_addr.first();
 
-            if (prev_opt == null and next_opt == null) {
-                // This should only happen if no ranges are present
-                std.debug.assert(range_list.head == null and range_list.tail == null);
-                const range_item = try self.alloc.create(VirtMemRangeListItem);
-                range_item.* = .{
-                    .range = .{
-                        .start = @bitCast(start),
-                        .length = length,
-                        .typ = typ,
-                        .frozen = args.frozen,
-                    },
-                };
-                range_list.append(range_item);
-            } else if (prev_opt == null) {
-                const n = next_opt.?; // Safety: we know this is non-null
-                const n_range = &n.range;
-                const n_start = @as(TAddrSize, @bitCast(n_range.start));
-                if (n_start <= end) {
-                    const overlap_length = end - n_start;
-                    n_range.start = @bitCast(start);
-                    n_range.length += length - overlap_length;
+            if (prev_opt) |p| {
+                const p_start = p.start();
+                const p_end = p.end();
+                if (p_end >= start) {
+                    p.range.length = @max(p_end, end) - p_start;
+                    self.mergeFollowing(range_set, p);
                     return;
                 }
-                const range_item = try self.alloc.create(VirtMemRangeListItem);
-                range_item.* = .{
-                    .range = .{
-                        .start = @bitCast(start),
-                        .length = length,
-                        .typ = typ,
-                        .frozen = args.frozen,
-                    },
-                };
-                range_list.insertBefore(n, range_item);
-            } else {
-                const p = prev_opt.?; // Safety: we know this is non-null
-                const p_range = &p.range;
-                const p_start = @as(TAddrSize, @bitCast(p_range.start));
-                const p_end = p_start +% p_range.length;
-                if (p_end >= start) {
-                    const overlap_length = p_end - start;
-                    p_range.length += length - overlap_length;
-                    if (next_opt) |n| {
-                        const n_range = &n.range;
-                        const n_start = @as(TAddrSize, @bitCast(n_range.start));
-                        const new_p_end = p_start +% p_range.length;
-                        if (new_p_end >= n_start) {
-                            const pn_overlap_length = new_p_end - n_start;
-                            p_range.length += n_range.length - pn_overlap_length;
-                            range_list.remove(n);
-                            defer self.alloc.destroy(n);
-                        }
-                    }
+            }
+            if (next_opt) |n| {
+                const n_start = n.start();
+                if (end >= n_start) {
+                    const n_end = n.end();
+                    n.range.start = @bitCast(start);
+                    n.range.length = @max(n_end, end) - start;
+                    self.mergeFollowing(range_set, n);
                     return;
                 }
-                const range_item = try self.alloc.create(VirtMemRangeListItem);
-                range_item.* = .{
-                    .range = .{
-                        .start = @bitCast(start),
-                        .length = length,
-                        .typ = typ,
-                        .frozen = args.frozen,
-                    },
-                };
-                range_list.insertAfter(p, range_item);
             }
+
+            range_set.insert(try self.createItem(start, length, typ, args.frozen));
         }
 
+        // NOTE: a range that grew can now overlap or touch the ones after it
+        fn mergeFollowing(self: *Self, range_set: *RangeSet, item: *VirtMemRangeItem) void {
+            const range_start = item.start();
+            while (AddrTree.next(item)) |n| {
+                const range_end = item.end();
+                if (range_end < n.start()) break;
+                item.range.length = @max(range_end, n.end()) - range_start;
+                range_set.remove(n);
+                self.alloc.destroy(n);
+            }
+            range_set.resized(item);
+        }
+
+        // NOTE: moves [start, start + length) from the ranges of the source type to the destination type.
+        // frozen ranges are left alone
         pub fn reserveRange(self: *Self, start: TAddrSize, length: u64, src_args: RangeArgs, dst_typ: VirtRangeType) !void {
             const end = start +% length;
             const src_typ = src_args.typ orelse .free;
-            const free_ranges_list = &self.memory_map[@intFromEnum(src_typ)];
-            var iter = free_ranges_list.iter();
-            while (iter.next()) |item| {
-                const range = &item.range;
-                const range_start: TAddrSize = @bitCast(range.start);
-                const range_end = range_start + range.length;
-                if (range.frozen) continue;
-                if (range_start <= start and range_end <= start) continue;
-                if (range_start <= start and range_end >= end) {
-                    // we are contained in range
-                    const top_excess_length = start - range_start;
-                    const bottom_excess_length = range_end - end;
-                    if (top_excess_length == 0 and bottom_excess_length == 0) {
-                        defer self.alloc.destroy(item);
-                        defer free_ranges_list.remove(item);
-                    } else if (top_excess_length > 0 and bottom_excess_length > 0) {
-                        range.length = top_excess_length;
-                        const end_range = try self.alloc.create(VirtMemRangeListItem);
-                        end_range.* = .{
-                            .range = .{
-                                .start = @bitCast(end),
-                                .length = bottom_excess_length,
-                                .typ = range.typ,
-                            },
-                        };
-                        free_ranges_list.insertAfter(item, end_range);
-                    } else if (top_excess_length > 0) {
-                        range.length = top_excess_length;
-                    } else if (bottom_excess_length > 0) {
-                        range.start = @bitCast(end);
-                        range.length = bottom_excess_length;
-                    } else {
-                        // maybe we forgot a case ?
-                        unreachable;
-                    }
-                } else if (range_start <= start) {
-                    const overlap_length = range_end - start;
-                    range.length -= overlap_length;
-                } else if (range_end >= end) {
-                    const overlap_length = end - range_start;
-                    range.start = @bitCast(end);
-                    range.length -= overlap_length;
+            const range_set = &self.memory_map[@intFromEnum(src_typ)];
+            var cursor = range_set.floor(start) orelse range_set.by_addr.first();
+            while (cursor) |item| {
+                const range_start = item.start();
+                const range_end = item.end();
+                cursor = AddrTree.next(item);
+                if (range_start >= end) break;
+                if (item.range.frozen or range_end <= start) continue;
+                if (range_start < start and range_end > end) {
+                    // NOTE: we are contained in the range, it gets split in two
+                    const tail = try self.createItem(end, range_end - end, item.range.typ, false);
+                    item.range.length = start - range_start;
+                    range_set.resized(item);
+                    range_set.insert(tail);
                     break;
+                } else if (range_start < start) {
+                    item.range.length = start - range_start;
+                    range_set.resized(item);
+                } else if (range_end > end) {
+                    item.range.start = @bitCast(end);
+                    item.range.length = range_end - end;
+                    range_set.resized(item);
+                    break;
+                } else {
+                    range_set.remove(item);
+                    self.alloc.destroy(item);
                 }
             }
             try self.registerRange(start, length, .{ .typ = dst_typ });
         }
 
-        pub fn allocateRange(self: *Self, length: TAddrSize, args: RangeArgs) !VirtMemRange {
+        pub const Fit = enum { first, best };
+        pub const AllocateArgs = struct {
+            typ: ?VirtRangeType = null,
+            alignment: TAddrSize = 1,
+            fit: Fit = .first,
+        };
+
+        // NOTE: the part of the range skipped to align the allocation stays where it is
+        pub fn allocateRange(self: *Self, length: TAddrSize, args: AllocateArgs) !VirtMemRange {
             const typ = args.typ orelse .free;
-            const range_list = &self.memory_map[@intFromEnum(typ)];
-            var iter = range_list.iter();
-            while (iter.next()) |item| {
-                var range = &item.range;
-                if (range.length == length) {
-                    range_list.remove(item);
-                    defer self.alloc.destroy(item);
-                    return range.*;
-                } else if (range.length > length) {
-                    const new_start: u64 = @as(u64, @bitCast(range.start)) + length;
-                    const new_range = VirtMemRange{ .start = range.start, .length = length, .typ = typ };
-                    range.start = @bitCast(new_start);
-                    range.length -= length;
-                    return new_range;
+            const range_set = &self.memory_map[@intFromEnum(typ)];
+            const item = switch (args.fit) {
+                .first => RangeSet.firstFit(range_set.by_addr.root, length, args.alignment),
+                .best => range_set.bestFit(length, args.alignment),
+            } orelse return error.OutOfVirtMemory;
+
+            const range_start = item.start();
+            const start = item.fit(length, args.alignment).?;
+            const head_length = start - range_start;
+            const tail_length = item.range.length - head_length - length;
+            const new_range = VirtMemRange{ .start = @bitCast(start), .length = length, .typ = typ };
+            if (head_length == 0 and tail_length == 0) {
+                range_set.remove(item);
+                self.alloc.destroy(item);
+            } else if (head_length == 0) {
+                item.range.start = @bitCast(start + length);
+                item.range.length = tail_length;
+                range_set.resized(item);
+            } else {
+                if (tail_length > 0) {
+                    range_set.insert(try self.createItem(start + length, tail_length, item.range.typ, false));
                 }
+                item.range.length = head_length;
+                range_set.resized(item);
             }
-
-            return error.OutOfVirtMemory;
+            return new_range;
         }
     };
 }
+
+const TestVmm = VirtualMemoryManager(u64, u64);
+const test_base: u64 = 0x1000_0000;
+const test_size: u64 = 1 << 32;
+
+fn expectConsistent(vmm: *TestVmm, allocated: u64) !void {
+    const range_set = &vmm.memory_map[@intFromEnum(VirtRangeType.free)];
+    _ = try range_set.by_addr.validate();
+    _ = try range_set.by_size.validate();
+    try std.testing.expectEqual(range_set.by_addr.count, range_set.by_size.count);
+    var free: u64 = 0;
+    var prev_end: ?u64 = null;
+    var iter = range_set.iter();
+    while (iter.next()) |item| {
+        // NOTE: ranges are merged, two of them never touch
+        if (prev_end) |e| try std.testing.expect(e < item.start());
+        var max_length = item.range.length;
+        if (item.addr_links.left) |l| max_length = @max(max_length, l.max_length);
+        if (item.addr_links.right) |r| max_length = @max(max_length, r.max_length);
+        try std.testing.expectEqual(max_length, item.max_length);
+        prev_end = item.end();
+        free += item.range.length;
+    }
+    try std.testing.expectEqual(test_size, free + allocated);
+}
+
+fn churn(vmm: *TestVmm, random: std.Random, live: []TestVmm.VirtMemRange, rounds: usize, check: bool) !void {
+    var allocated: u64 = 0;
+    for (live) |*range| range.length = 0;
+    for (0..rounds) |round| {
+        const range = &live[random.uintLessThan(usize, live.len)];
+        if (range.length != 0) {
+            try vmm.registerRange(range.start, range.length, .{});
+            allocated -= range.length;
+            range.length = 0;
+        } else {
+            const length = random.intRangeAtMost(u64, 1, 64) * 0x1000;
+            const alignment: u64 = if (random.boolean()) 0x1000 else 0x10000;
+            range.* = try vmm.allocateRange(length, .{ .alignment = alignment, .fit = if (round % 2 == 0) .first else .best });
+            try std.testing.expect(std.mem.isAligned(range.start, alignment));
+            allocated += length;
+        }
+        if (check and round % 64 == 0) try expectConsistent(vmm, allocated);
+    }
+    for (live) |*range| {
+        if (range.length == 0) continue;
+        try vmm.registerRange(range.start, range.length, .{});
+        allocated -= range.length;
+        range.length = 0;
+    }
+    try expectConsistent(vmm, allocated);
+}
+
+test "VirtualMemoryManager keeps its ranges merged and balanced through churn" {
+    var vmm: TestVmm = .init(std.testing.allocator);
+    defer vmm.deinit();
+    try vmm.registerRange(test_base, test_size, .{});
+    var prng: std.Random.DefaultPrng = .init(0x5eed);
+    var live: [4096]TestVmm.VirtMemRange = undefined;
+    try churn(&vmm, prng.random(), &live, 20_000, true);
+
+    const range_set = &vmm.memory_map[@intFromEnum(VirtRangeType.free)];
+    try std.testing.expectEqual(@as(usize, 1), range_set.count());
+    try std.testing.expectEqual(test_base, range_set.by_addr.root.?.start());
+
+    // NOTE: carving from the middle splits the range, giving it back merges it again
+    try vmm.reserveRange(test_base + 0x10000, 0x4000, .{}, .mmio);
+    try std.testing.expectEqual(@as(usize, 2), range_set.count());
+    try std.testing.expectEqual(@as(usize, 1), vmm.memory_map[@intFromEnum(VirtRangeType.mmio)].count());
+    try vmm.registerRange(test_base + 0x10000, 0x4000, .{});
+    try std.testing.expectEqual(@as(usize, 1), range_set.count());
+}
+
+// NOTE: only runs with -Dvmm_bench_rounds=N
+test "VirtualMemoryManager churn benchmark" {
+    const rounds = options.vmm_bench_rounds;
+    if (rounds == 0) return error.SkipZigTest;
+    const arch = @import("arch");
+    var vmm: TestVmm = .init(std.testing.allocator);
+    defer vmm.deinit();
+    try vmm.registerRange(test_base, test_size, .{});
+    var prng: std.Random.DefaultPrng = .init(0xbe1c);
+    var live: [8192]TestVmm.VirtMemRange = undefined;
+    const start = arch.assembly.rdtsc();
+    try churn(&vmm, prng.random(), &live, rounds, false);
+    const cycles = arch.assembly.rdtsc() - start;
+    TestVmm.log.info("churn: {d} operations over up to {d} live ranges, {d} cycles per operation", .{ rounds, live.len, cycles / rounds });
+}